@@ -0,0 +1,85 @@
+#include "BezierPatch.h"
+
+#include <sstream>
+#include <utility>
+
+
+struct PatchEvaluators
+{
+    PatchEvaluator evaluate;
+    HeightfieldEvaluator evaluateHeightfield;
+};
+
+//Table of every specialisation, indexed by [degreeU - 1][degreeV - 1][rational]
+template<int DU, int DV>
+static constexpr std::array<PatchEvaluators, 2> evaluatorPair()
+{
+    return {{
+        { &BezierPatch<DU, DV, false>::evaluate, &BezierPatch<DU, DV, false>::evaluateHeightfield },
+        { &BezierPatch<DU, DV, true>::evaluate, &BezierPatch<DU, DV, true>::evaluateHeightfield }
+    }};
+}
+
+template<int DU, int... DV>
+static constexpr std::array<std::array<PatchEvaluators, 2>, sizeof...(DV)> evaluatorRow(std::integer_sequence<int, DV...>)
+{
+    return { evaluatorPair<DU, DV + 1>()... };
+}
+
+template<int... DU>
+static constexpr auto evaluatorTable(std::integer_sequence<int, DU...>)
+{
+    return std::array<std::array<std::array<PatchEvaluators, 2>, MAX_PATCH_DEGREE>, MAX_PATCH_DEGREE>
+    {
+        evaluatorRow<DU + 1>(std::make_integer_sequence<int, MAX_PATCH_DEGREE>())...
+    };
+}
+
+static constexpr auto patchEvaluators = evaluatorTable(std::make_integer_sequence<int, MAX_PATCH_DEGREE>());
+
+
+static bool supportedDegrees(int degreeU, int degreeV)
+{
+    return degreeU >= 1 && degreeU <= MAX_PATCH_DEGREE && degreeV >= 1 && degreeV <= MAX_PATCH_DEGREE;
+}
+
+
+PatchEvaluator getPatchEvaluator(int degreeU, int degreeV, bool rational)
+{
+    if(!supportedDegrees(degreeU, degreeV))
+    {
+        return nullptr;
+    }
+    return patchEvaluators[degreeU - 1][degreeV - 1][rational ? 1 : 0].evaluate;
+}
+
+
+HeightfieldEvaluator getHeightfieldEvaluator(int degreeU, int degreeV, bool rational)
+{
+    if(!supportedDegrees(degreeU, degreeV))
+    {
+        return nullptr;
+    }
+    return patchEvaluators[degreeU - 1][degreeV - 1][rational ? 1 : 0].evaluateHeightfield;
+}
+
+
+std::string patchShaderDefines(int degreeU, int degreeV, bool rational)
+{
+    std::ostringstream defines;
+    defines << "#define DEGREE_U " << degreeU << "\n";
+    defines << "#define DEGREE_V " << degreeV << "\n";
+    defines << "#define RATIONAL " << (rational ? 1 : 0) << "\n";
+    //Global array initializers do not work on every driver, so the shader fills them in main()
+    defines << "#define INIT_BINOMIALS";
+    for(int i = 0; i <= degreeU; ++i)
+    {
+        defines << " n_choose_u[" << i << "] = " << binomial(degreeU, i) << ".0;";
+    }
+    for(int i = 0; i <= degreeV; ++i)
+    {
+        defines << " n_choose_v[" << i << "] = " << binomial(degreeV, i) << ".0;";
+    }
+    defines << "\n";
+    return defines.str();
+}
@@ -0,0 +1,204 @@
+#pragma once
+#ifndef BEZIER_PATCH_H
+#define BEZIER_PATCH_H
+
+#include <glm/glm.hpp>
+
+#include <array>
+#include <string>
+
+
+//Highest degree along u or v the loader and the renderer dispatch on
+constexpr int MAX_PATCH_DEGREE = 5;
+
+
+//Position and partial derivatives of a surface at a single (u, v)
+struct SurfaceDerivatives
+{
+    glm::vec3 p;
+    glm::vec3 dU;
+    glm::vec3 dV;
+    glm::vec3 dUU;
+    glm::vec3 dUV;
+    glm::vec3 dVV;
+};
+
+
+constexpr int binomial(int n, int k)
+{
+    return (k < 0 || k > n) ? 0 : (k == 0 || k == n) ? 1 : binomial(n - 1, k - 1) + binomial(n - 1, k);
+}
+
+
+/*
+    Bernstein basis of degree N. Coefficient tables are built at compile time and every loop
+    has a compile time trip count, so each degree gets a fully unrolled evaluator.
+*/
+template<int N>
+struct BernsteinBasis
+{
+    static constexpr int ORDER = N + 1;
+
+    static constexpr std::array<float, ORDER> makeCoefficients(int degree)
+    {
+        std::array<float, ORDER> c{};
+        for(int i = 0; i <= degree; ++i)
+        {
+            c[i] = (float)binomial(degree, i);
+        }
+        return c;
+    }
+
+    //n choose i of the basis itself and of the bases its derivatives are written in
+    static constexpr std::array<float, ORDER> C0 = makeCoefficients(N);
+    static constexpr std::array<float, ORDER> C1 = makeCoefficients(N - 1);
+    static constexpr std::array<float, ORDER> C2 = makeCoefficients(N - 2);
+
+    //Values, first and second derivatives of the ORDER basis functions at t
+    static void evaluate(float t, float B[ORDER], float dB[ORDER], float d2B[ORDER])
+    {
+        //Powers of t and (1 - t) up to N
+        float tp[ORDER];
+        float sp[ORDER];
+        tp[0] = sp[0] = 1.0f;
+        for(int i = 1; i <= N; ++i)
+        {
+            tp[i] = tp[i - 1] * t;
+            sp[i] = sp[i - 1] * (1.0f - t);
+        }
+        //Degree N-1 and N-2 bases, derivatives are differences of these
+        float B1[ORDER + 1];
+        float B2[ORDER + 2];
+        B1[0] = B1[ORDER] = 0.0f;
+        B2[0] = B2[1] = B2[ORDER] = B2[ORDER + 1] = 0.0f;
+        for(int i = 0; i < N; ++i)
+        {
+            B1[i + 1] = C1[i] * tp[i] * sp[N - 1 - i];
+        }
+        for(int i = 0; i + 1 < N; ++i)
+        {
+            B2[i + 2] = C2[i] * tp[i] * sp[N - 2 - i];
+        }
+        for(int i = 0; i <= N; ++i)
+        {
+            B[i] = C0[i] * tp[i] * sp[N - i];
+            //B1[i] holds the degree N-1 function i-1, B2[i] the degree N-2 function i-2
+            dB[i] = N * (B1[i] - B1[i + 1]);
+            d2B[i] = N * (N - 1) * (B2[i] - 2.0f * B2[i + 1] + B2[i + 2]);
+        }
+    }
+};
+
+
+/*
+    Tensor product Bezier patch of degree DU along u and DV along v. Control points are row
+    major: rows go along v, columns go along u. Rational patches also take one weight per
+    control point and are evaluated through their homogeneous form.
+*/
+template<int DU, int DV, bool RATIONAL>
+struct BezierPatch
+{
+    static constexpr int NU = DU + 1;
+    static constexpr int NV = DV + 1;
+    static constexpr int NUM_CP = NU * NV;
+
+    static SurfaceDerivatives evaluate(const glm::vec3* P, const float* W, float u, float v)
+    {
+        float Bu[NU], dBu[NU], d2Bu[NU];
+        float Bv[NV], dBv[NV], d2Bv[NV];
+        BernsteinBasis<DU>::evaluate(u, Bu, dBu, d2Bu);
+        BernsteinBasis<DV>::evaluate(v, Bv, dBv, d2Bv);
+
+        //Homogeneous point and its derivatives. w stays 1 for polynomial patches.
+        glm::vec3 H(0.0f), Hu(0.0f), Hv(0.0f), Huu(0.0f), Huv(0.0f), Hvv(0.0f);
+        float w = 0.0f, wu = 0.0f, wv = 0.0f, wuu = 0.0f, wuv = 0.0f, wvv = 0.0f;
+        for(int i = 0; i < NV; ++i) //along v
+        {
+            for(int j = 0; j < NU; ++j) //along u
+            {
+                float cw = RATIONAL ? W[NU*i + j] : 1.0f;
+                glm::vec3 cp = cw * P[NU*i + j];
+                float b = Bv[i] * Bu[j];
+                float bu = Bv[i] * dBu[j];
+                float bv = dBv[i] * Bu[j];
+                float buu = Bv[i] * d2Bu[j];
+                float buv = dBv[i] * dBu[j];
+                float bvv = d2Bv[i] * Bu[j];
+                H += b * cp;
+                Hu += bu * cp;
+                Hv += bv * cp;
+                Huu += buu * cp;
+                Huv += buv * cp;
+                Hvv += bvv * cp;
+                if(RATIONAL)
+                {
+                    w += b * cw;
+                    wu += bu * cw;
+                    wv += bv * cw;
+                    wuu += buu * cw;
+                    wuv += buv * cw;
+                    wvv += bvv * cw;
+                }
+            }
+        }
+
+        SurfaceDerivatives d;
+        if(!RATIONAL)
+        {
+            d.p = H;
+            d.dU = Hu;
+            d.dV = Hv;
+            d.dUU = Huu;
+            d.dUV = Huv;
+            d.dVV = Hvv;
+            return d;
+        }
+        //Quotient rule on S = H / w
+        float invW = 1.0f / w;
+        d.p = H * invW;
+        d.dU = (Hu - wu * d.p) * invW;
+        d.dV = (Hv - wv * d.p) * invW;
+        d.dUU = (Huu - 2.0f * wu * d.dU - wuu * d.p) * invW;
+        d.dUV = (Huv - wu * d.dV - wv * d.dU - wuv * d.p) * invW;
+        d.dVV = (Hvv - 2.0f * wv * d.dV - wvv * d.p) * invW;
+        return d;
+    }
+
+    /*
+        Same for a patch of a heightfield control grid (see ControlGrid): only the heights (and
+        weights) are stored, stride floats apart row to row. x and y of the control points are
+        the uniform layout layoutBezierSurfaces() uses and are reconstructed here.
+    */
+    static SurfaceDerivatives evaluateHeightfield(const float* Z, const float* W, int stride, float u, float v)
+    {
+        glm::vec3 P[NUM_CP];
+        float PW[NUM_CP];
+        for(int i = 0; i < NV; ++i)
+        {
+            for(int j = 0; j < NU; ++j)
+            {
+                P[NU*i + j] = glm::vec3(j / float(DU) - 0.5f, 0.5f - i / float(DV), Z[i*stride + j]);
+                PW[NU*i + j] = RATIONAL ? W[i*stride + j] : 1.0f;
+            }
+        }
+        return evaluate(P, PW, u, v);
+    }
+};
+
+
+//Signatures shared by every BezierPatch<DU, DV, RATIONAL> specialisation. W may be null for polynomial patches.
+typedef SurfaceDerivatives (*PatchEvaluator)(const glm::vec3* P, const float* W, float u, float v);
+typedef SurfaceDerivatives (*HeightfieldEvaluator)(const float* Z, const float* W, int stride, float u, float v);
+
+//Pick the specialisation for the given degrees. Return null if a degree is out of [1, MAX_PATCH_DEGREE].
+PatchEvaluator getPatchEvaluator(int degreeU, int degreeV, bool rational);
+HeightfieldEvaluator getHeightfieldEvaluator(int degreeU, int degreeV, bool rational);
+
+/*
+    Preamble that turns bezier.vert into the variant for the given degrees: the degrees, the
+    rational switch and statements filling the binomial tables from the same constexpr tables
+    the CPU evaluators use.
+*/
+std::string patchShaderDefines(int degreeU, int degreeV, bool rational);
+
+#endif
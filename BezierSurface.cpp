@@ -0,0 +1,137 @@
+#include "BezierSurface.h"
+#include "MeshOptimizer.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+
+glm::vec3 evalBezier(const ControlGrid& grid, const BezierSurface& surf, float u, float v)
+{
+    return evalDerivatives(grid, surf, u, v).p;
+}
+
+
+glm::vec3 evalDU(const ControlGrid& grid, const BezierSurface& surf, float u, float v)
+{
+    return evalDerivatives(grid, surf, u, v).dU;
+}
+
+
+glm::vec3 evalDV(const ControlGrid& grid, const BezierSurface& surf, float u, float v)
+{
+    return evalDerivatives(grid, surf, u, v).dV;
+}
+
+
+SurfaceDerivatives evalDerivatives(const ControlGrid& grid, const BezierSurface& surf, float u, float v)
+{
+    HeightfieldEvaluator evaluate = getHeightfieldEvaluator(grid.degreeU, grid.degreeV, isRational(grid));
+    const float* W = isRational(grid) ? &grid.weights[surf.gridOffset] : nullptr;
+    return evaluate(&grid.heights[surf.gridOffset], W, grid.numPx, u, v);
+}
+
+
+glm::vec3 controlPoint(const ControlGrid& grid, const BezierSurface& surf, int k)
+{
+    int i = k / (grid.degreeU + 1);
+    int j = k % (grid.degreeU + 1);
+    return glm::vec3(j / float(grid.degreeU) - 0.5f, 0.5f - i / float(grid.degreeV),
+                     grid.heights[surf.gridOffset + i * grid.numPx + j]);
+}
+
+
+glm::vec3 toSceneSpace(const BezierSurface& surf, const glm::vec3& p)
+{
+    return surf.translation + surf.scaling * p;
+}
+
+
+void patchBounds(const ControlGrid& grid, const BezierSurface& surf, glm::vec3& minCorner, glm::vec3& maxCorner)
+{
+    //x and y of the control points span [-0.5, 0.5], only z has to be searched
+    float minZ = grid.heights[surf.gridOffset];
+    float maxZ = minZ;
+    for(int i = 0; i <= grid.degreeV; ++i)
+    {
+        for(int j = 0; j <= grid.degreeU; ++j)
+        {
+            float z = grid.heights[surf.gridOffset + i * grid.numPx + j];
+            minZ = std::min(minZ, z);
+            maxZ = std::max(maxZ, z);
+        }
+    }
+    glm::vec3 a = toSceneSpace(surf, glm::vec3(-0.5f, -0.5f, minZ));
+    glm::vec3 b = toSceneSpace(surf, glm::vec3(0.5f, 0.5f, maxZ));
+    minCorner = glm::min(a, b);
+    maxCorner = glm::max(a, b);
+}
+
+
+void buildSampleMesh(int samples, std::vector<glm::u16vec2>& uv, std::vector<uint32_t>& indices, bool report)
+{
+    uv.clear();
+    indices.clear();
+    int si; //Sample index (temporary var)
+    float sampleSpacing = samples - 1;
+    uv.reserve(samples * samples);
+    indices.reserve(6 * (samples-1) * (samples-1));
+    //Create samples and triangulate at the same time
+    for(int i = 0; i < samples; ++i)
+    {
+        for(int j = 0; j < samples; ++j)
+        {
+            //Create the sample. Normalized 16 bit is exact at the patch borders, so neighbours still meet.
+            uv.push_back(glm::u16vec2(std::lround(j / sampleSpacing * 65535.0f), std::lround(i / sampleSpacing * 65535.0f)));
+            si = i * samples + j;
+            if((i != samples - 1) && (j != samples - 1))
+            {
+                //Counter-clockwise orientation
+                indices.insert(indices.end(), { (uint32_t)si, (uint32_t)(si + samples), (uint32_t)(si + samples + 1) });
+                indices.insert(indices.end(), { (uint32_t)si, (uint32_t)(si + samples + 1), (uint32_t)(si + 1) });
+            }
+        }
+    }
+
+    //Short rows already fit in the cache, keep whichever order is better
+    float rowMajorACMR = averageCacheMissRatio(indices);
+    std::vector<uint32_t> optimized = optimizeVertexCache(indices, (int)uv.size());
+    float optimizedACMR = averageCacheMissRatio(optimized);
+    if(optimizedACMR < rowMajorACMR)
+    {
+        indices.swap(optimized);
+    }
+    //Vertices in the order they are first used
+    std::vector<uint32_t> remap = optimizeVertexFetch(indices, (int)uv.size());
+    std::vector<glm::u16vec2> remapped(uv.size());
+    for(size_t v = 0; v < uv.size(); ++v)
+    {
+        remapped[remap[v]] = uv[v];
+    }
+    uv.swap(remapped);
+
+    if(report)
+    {
+        size_t indexBytes = indices.size() * (uv.size() <= 65536 ? sizeof(GLushort) : sizeof(GLuint));
+        size_t oldBytes = indices.size() * sizeof(GLuint) + uv.size() * sizeof(glm::vec2);
+        size_t newBytes = indexBytes + uv.size() * sizeof(glm::u16vec2);
+        std::cout << "Sample mesh " << samples << "x" << samples << ": ACMR " << rowMajorACMR << " -> "
+                  << std::min(rowMajorACMR, optimizedACMR) << " (cache of " << VERTEX_CACHE_SIZE << "), "
+                  << newBytes << " bytes per patch instead of " << oldBytes << std::endl;
+    }
+}
+
+
+std::vector<int> sampleLadder(int finestSamples, int maxLevels)
+{
+    std::vector<int> ladder;
+    for(int samples = finestSamples; (int)ladder.size() < maxLevels; samples = std::max(2, (samples - 1) / 2 + 1))
+    {
+        if(!ladder.empty() && samples >= ladder.back())
+        {
+            break;
+        }
+        ladder.push_back(samples);
+    }
+    return ladder;
+}
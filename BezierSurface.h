@@ -0,0 +1,57 @@
+#pragma once
+#ifndef BEZIER_SURFACE_H
+#define BEZIER_SURFACE_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "BezierPatch.h"
+#include "ControlGrid.h"
+
+
+struct BezierSurface
+{
+    int gridOffset; //Offset of the top left control point in the scene's ControlGrid. Degrees come from the grid.
+    glm::vec3 translation;
+    glm::vec3 scaling; //Scaling of each Bezier Surface is the same but anyway
+    //Evaluation cache: positions and normals of the samples, filled by transform feedback
+    GLuint cacheVAO = 0;
+    GLuint cacheVBO = 0;
+    bool cacheValid = false;
+};
+
+
+/*
+    CPU counterparts of the evaluators in bezier.vert. They work in the local frame of the
+    surface (the frame its control points are laid out in), the same frame the vertex shader
+    evaluates in. They dispatch to the BezierPatch specialisation of the grid's degrees.
+*/
+glm::vec3 evalBezier(const ControlGrid& grid, const BezierSurface& surf, float u, float v);
+glm::vec3 evalDU(const ControlGrid& grid, const BezierSurface& surf, float u, float v);
+glm::vec3 evalDV(const ControlGrid& grid, const BezierSurface& surf, float u, float v);
+SurfaceDerivatives evalDerivatives(const ControlGrid& grid, const BezierSurface& surf, float u, float v);
+//Control point k (row major in the patch's block) with its reconstructed x and y
+glm::vec3 controlPoint(const ControlGrid& grid, const BezierSurface& surf, int k);
+
+/*
+    Scene frame is the frame the surfaces are laid out in by layoutBezierSurfaces(): the
+    per surface scaling and translation are applied but the viewer rotation is not.
+*/
+glm::vec3 toSceneSpace(const BezierSurface& surf, const glm::vec3& p);
+//Box around the surface in the scene frame, from its control points (convex hull property)
+void patchBounds(const ControlGrid& grid, const BezierSurface& surf, glm::vec3& minCorner, glm::vec3& maxCorner);
+
+/*
+    Sample mesh every surface is drawn with: samples x samples (u, v) points and a grid of
+    triangles reordered for the vertex cache, since every vertex shaded again is another patch
+    evaluation. With report set, prints the ACMR before and after and the bytes per patch.
+*/
+void buildSampleMesh(int samples, std::vector<glm::u16vec2>& uv, std::vector<uint32_t>& indices, bool report);
+//Sample counts of up to maxLevels detail levels, from finestSamples halving down to 2
+std::vector<int> sampleLadder(int finestSamples, int maxLevels);
+
+#endif
@@ -0,0 +1,388 @@
+#include "ClosestPointQuery.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <thread>
+
+
+//Squared distance from q to the box [bmin, bmax]. 0 if q is inside.
+static float boxDistance2(const glm::vec3& q, const glm::vec3& bmin, const glm::vec3& bmax)
+{
+    glm::vec3 d = glm::max(glm::max(bmin - q, q - bmax), glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+
+
+ClosestPointQuery::ClosestPointQuery(const ControlGrid& grid, const std::vector<BezierSurface>& surfaces)
+    :
+    grid(&grid),
+    evaluate(getHeightfieldEvaluator(grid.degreeU, grid.degreeV, isRational(grid)))
+{
+    int numCP = (grid.degreeU + 1) * (grid.degreeV + 1);
+    patches.resize(surfaces.size());
+    patchOrder.resize(surfaces.size());
+    for(int i = 0; i < surfaces.size(); ++i)
+    {
+        const BezierSurface& surf = surfaces[i];
+        Patch& patch = patches[i];
+        patch.gridOffset = surf.gridOffset;
+        patch.translation = surf.translation;
+        patch.scaling = surf.scaling;
+        patch.bmin = glm::vec3(std::numeric_limits<float>::max());
+        patch.bmax = glm::vec3(-std::numeric_limits<float>::max());
+        for(int k = 0; k < numCP; ++k)
+        {
+            glm::vec3 p = toSceneSpace(surf, controlPoint(grid, surf, k));
+            //Convex hull property: the patch lies inside the bounds of its control points
+            patch.bmin = glm::min(patch.bmin, p);
+            patch.bmax = glm::max(patch.bmax, p);
+        }
+        //Coarse samples used both as an upper bound and as the Newton starting point
+        for(int a = 0; a < SEED_RES; ++a)
+        {
+            for(int b = 0; b < SEED_RES; ++b)
+            {
+                float u = b / float(SEED_RES - 1);
+                float v = a / float(SEED_RES - 1);
+                patch.seeds[a * SEED_RES + b] = evaluateScene(patch, u, v).p;
+            }
+        }
+        patchOrder[i] = i;
+    }
+
+    if(!patches.empty())
+    {
+        nodes.reserve(2 * patches.size());
+        nodes.emplace_back();
+        buildNode(0, 0, (int)patches.size());
+    }
+}
+
+
+void ClosestPointQuery::buildNode(int nodeIndex, int first, int count)
+{
+    glm::vec3 bmin(std::numeric_limits<float>::max());
+    glm::vec3 bmax(-std::numeric_limits<float>::max());
+    glm::vec3 cmin = bmin;
+    glm::vec3 cmax = bmax;
+    for(int i = first; i < first + count; ++i)
+    {
+        const Patch& patch = patches[patchOrder[i]];
+        bmin = glm::min(bmin, patch.bmin);
+        bmax = glm::max(bmax, patch.bmax);
+        glm::vec3 c = 0.5f * (patch.bmin + patch.bmax);
+        cmin = glm::min(cmin, c);
+        cmax = glm::max(cmax, c);
+    }
+    nodes[nodeIndex].bmin = bmin;
+    nodes[nodeIndex].bmax = bmax;
+    nodes[nodeIndex].first = first;
+    nodes[nodeIndex].count = count;
+    nodes[nodeIndex].left = -1;
+    if(count <= LEAF_SIZE)
+    {
+        return;
+    }
+
+    //Median split along the longest axis of the centroids
+    glm::vec3 extent = cmax - cmin;
+    int axis = 0;
+    if(extent.y > extent[axis]) axis = 1;
+    if(extent.z > extent[axis]) axis = 2;
+    int half = count / 2;
+    std::nth_element(patchOrder.begin() + first, patchOrder.begin() + first + half, patchOrder.begin() + first + count,
+        [this, axis](int a, int b)
+        {
+            return patches[a].bmin[axis] + patches[a].bmax[axis] < patches[b].bmin[axis] + patches[b].bmax[axis];
+        });
+
+    //Children are allocated as a pair so that only the left one has to be stored
+    int left = (int)nodes.size();
+    nodes[nodeIndex].left = left;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    buildNode(left, first, half);
+    buildNode(left + 1, first + half, count - half);
+}
+
+
+SurfaceDerivatives ClosestPointQuery::evaluateScene(const Patch& patch, float u, float v) const
+{
+    const float* W = isRational(*grid) ? &grid->weights[patch.gridOffset] : nullptr;
+    SurfaceDerivatives d = evaluate(&grid->heights[patch.gridOffset], W, grid->numPx, u, v);
+    //The scene map is a scale followed by a translation, derivatives are only scaled
+    d.p = patch.translation + patch.scaling * d.p;
+    d.dU *= patch.scaling;
+    d.dV *= patch.scaling;
+    d.dUU *= patch.scaling;
+    d.dUV *= patch.scaling;
+    d.dVV *= patch.scaling;
+    return d;
+}
+
+
+ClosestPointStats ClosestPointQuery::query(const std::vector<glm::vec3>& points, std::vector<ClosestPointResult>& results, int numThreads) const
+{
+    auto start = std::chrono::steady_clock::now();
+    if(numThreads <= 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    numThreads = std::max(1, std::min<int>(numThreads, (int)points.size()));
+    results.resize(points.size());
+
+    //Each thread takes a contiguous chunk of the points and owns its scratch memory
+    std::vector<size_t> solves(numThreads, 0);
+    auto work = [&](int t)
+    {
+        std::vector<int> stack;
+        std::vector<Candidate> candidates;
+        size_t begin = points.size() * t / numThreads;
+        size_t end = points.size() * (t + 1) / numThreads;
+        for(size_t i = begin; i < end; ++i)
+        {
+            results[i] = queryPoint(points[i], stack, candidates, solves[t]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for(int t = 1; t < numThreads; ++t)
+    {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    ClosestPointStats stats;
+    stats.numPoints = points.size();
+    stats.numNewtonSolves = 0;
+    for(size_t s : solves)
+    {
+        stats.numNewtonSolves += s;
+    }
+    stats.numThreads = numThreads;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.pointsPerSecond = stats.seconds > 0.0 ? points.size() / stats.seconds : 0.0;
+    return stats;
+}
+
+
+ClosestPointResult ClosestPointQuery::queryPoint(const glm::vec3& q, std::vector<int>& stack, std::vector<Candidate>& candidates, size_t& numSolves) const
+{
+    ClosestPointResult result;
+    result.patchId = -1;
+    result.uv = glm::vec2(0.0f);
+    result.distance = std::numeric_limits<float>::max();
+    result.position = glm::vec3(0.0f);
+    result.normal = glm::vec3(0.0f, 0.0f, 1.0f);
+    if(nodes.empty())
+    {
+        return result;
+    }
+
+    //Traverse the BVH nearest child first. Seeds of every visited patch tighten the upper bound.
+    float best2 = std::numeric_limits<float>::max();
+    candidates.clear();
+    stack.clear();
+    stack.push_back(0);
+    while(!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if(boxDistance2(q, node.bmin, node.bmax) > best2)
+        {
+            continue;
+        }
+        if(node.left < 0)
+        {
+            for(int i = node.first; i < node.first + node.count; ++i)
+            {
+                int id = patchOrder[i];
+                const Patch& patch = patches[id];
+                Candidate c;
+                c.patchId = id;
+                c.boxDist2 = boxDistance2(q, patch.bmin, patch.bmax);
+                if(c.boxDist2 > best2)
+                {
+                    continue;
+                }
+                c.seedDist2 = std::numeric_limits<float>::max();
+                for(int s = 0; s < SEED_RES * SEED_RES; ++s)
+                {
+                    glm::vec3 d = patch.seeds[s] - q;
+                    float d2 = glm::dot(d, d);
+                    if(d2 < c.seedDist2)
+                    {
+                        c.seedDist2 = d2;
+                        c.seedUV = glm::vec2((s % SEED_RES) / float(SEED_RES - 1), (s / SEED_RES) / float(SEED_RES - 1));
+                    }
+                }
+                best2 = std::min(best2, c.seedDist2);
+                candidates.push_back(c);
+            }
+            continue;
+        }
+        const Node& a = nodes[node.left];
+        const Node& b = nodes[node.left + 1];
+        //Push the farther one first so that the nearer one is popped first
+        if(boxDistance2(q, a.bmin, a.bmax) < boxDistance2(q, b.bmin, b.bmax))
+        {
+            stack.push_back(node.left + 1);
+            stack.push_back(node.left);
+        }
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.left + 1);
+        }
+    }
+
+    //Candidates whose bounds are farther than the best seed can not hold the closest point
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+        [best2](const Candidate& c) { return c.boxDist2 > best2; }), candidates.end());
+    //Most promising first, so that a batch is likely to hold the winner
+    std::sort(candidates.begin(), candidates.end(),
+        [](const Candidate& a, const Candidate& b) { return a.seedDist2 < b.seedDist2; });
+
+    //Project in batches. Before each batch drop the candidates the results so far rule out.
+    Candidate batch[LANES];
+    size_t next = 0;
+    while(next < candidates.size())
+    {
+        float bestDist2 = result.distance * result.distance;
+        int count = 0;
+        for(; next < candidates.size() && count < LANES; ++next)
+        {
+            if(result.patchId == -1 || candidates[next].boxDist2 <= bestDist2)
+            {
+                batch[count++] = candidates[next];
+            }
+        }
+        if(count == 0)
+        {
+            break;
+        }
+        newtonBatch(q, batch, count, result);
+        numSolves += count;
+    }
+
+    return result;
+}
+
+
+void ClosestPointQuery::newtonBatch(const glm::vec3& q, const Candidate* candidates, int count, ClosestPointResult& result) const
+{
+    //Structure of arrays over the lanes so that the per lane loops vectorise. Evaluation goes
+    //through the unrolled specialisation of the grid's degrees.
+    const Patch* patch[LANES];
+    float u[LANES], v[LANES];
+    bool active[LANES];
+    //Best iterate of every lane. The seed is the first iterate, so a lane never gets worse than it.
+    float bestD2[LANES], bestU[LANES], bestV[LANES];
+    glm::vec3 bestS[LANES], bestSu[LANES], bestSv[LANES];
+    for(int l = 0; l < count; ++l)
+    {
+        patch[l] = &patches[candidates[l].patchId];
+        u[l] = candidates[l].seedUV.x;
+        v[l] = candidates[l].seedUV.y;
+        active[l] = true;
+        bestD2[l] = std::numeric_limits<float>::max();
+    }
+
+    glm::vec3 S[LANES], Su[LANES], Sv[LANES], Suu[LANES], Suv[LANES], Svv[LANES];
+    for(int iteration = 0; iteration <= MAX_NEWTON_ITERATIONS; ++iteration)
+    {
+        //Position and derivatives of every lane
+        for(int l = 0; l < count; ++l)
+        {
+            SurfaceDerivatives d = evaluateScene(*patch[l], u[l], v[l]);
+            S[l] = d.p;
+            Su[l] = d.dU;
+            Sv[l] = d.dV;
+            Suu[l] = d.dUU;
+            Suv[l] = d.dUV;
+            Svv[l] = d.dVV;
+        }
+
+        //Newton step on the gradient of 0.5 * |S(u, v) - q|^2, projected onto the unit square
+        bool anyActive = false;
+        for(int l = 0; l < count; ++l)
+        {
+            glm::vec3 r = S[l] - q;
+            float d2 = glm::dot(r, r);
+            if(d2 < bestD2[l])
+            {
+                bestD2[l] = d2;
+                bestU[l] = u[l];
+                bestV[l] = v[l];
+                bestS[l] = S[l];
+                bestSu[l] = Su[l];
+                bestSv[l] = Sv[l];
+            }
+
+            float gu = glm::dot(r, Su[l]);
+            float gv = glm::dot(r, Sv[l]);
+            float huu = glm::dot(Su[l], Su[l]) + glm::dot(r, Suu[l]);
+            float huv = glm::dot(Su[l], Sv[l]) + glm::dot(r, Suv[l]);
+            float hvv = glm::dot(Sv[l], Sv[l]) + glm::dot(r, Svv[l]);
+            //A parameter on a border whose descent direction leaves the square stays where it is
+            bool fixU = (u[l] <= 0.0f && gu > 0.0f) || (u[l] >= 1.0f && gu < 0.0f);
+            bool fixV = (v[l] <= 0.0f && gv > 0.0f) || (v[l] >= 1.0f && gv < 0.0f);
+            float du = 0.0f;
+            float dv = 0.0f;
+            float det = huu * hvv - huv * huv;
+            if(!fixU && !fixV)
+            {
+                if(det > 1e-12f && huu > 0.0f)
+                {
+                    du = (hvv * gu - huv * gv) / det;
+                    dv = (huu * gv - huv * gu) / det;
+                }
+                else
+                {
+                    //Hessian is not positive definite, fall back to a Gauss-Newton like gradient step
+                    float scale = glm::dot(Su[l], Su[l]) + glm::dot(Sv[l], Sv[l]) + 1e-12f;
+                    du = gu / scale;
+                    dv = gv / scale;
+                }
+            }
+            else if(!fixU)
+            {
+                du = gu / (huu > 1e-12f ? huu : glm::dot(Su[l], Su[l]) + 1e-12f);
+            }
+            else if(!fixV)
+            {
+                dv = gv / (hvv > 1e-12f ? hvv : glm::dot(Sv[l], Sv[l]) + 1e-12f);
+            }
+            float nu = glm::clamp(u[l] - du, 0.0f, 1.0f);
+            float nv = glm::clamp(v[l] - dv, 0.0f, 1.0f);
+            bool moving = std::abs(nu - u[l]) + std::abs(nv - v[l]) > 1e-6f;
+            u[l] = active[l] ? nu : u[l];
+            v[l] = active[l] ? nv : v[l];
+            active[l] = active[l] && moving;
+            anyActive = anyActive || active[l];
+        }
+        if(!anyActive)
+        {
+            break;
+        }
+    }
+
+    for(int l = 0; l < count; ++l)
+    {
+        float d = std::sqrt(bestD2[l]);
+        if(d < result.distance)
+        {
+            result.patchId = candidates[l].patchId;
+            result.uv = glm::vec2(bestU[l], bestV[l]);
+            result.distance = d;
+            result.position = bestS[l];
+            glm::vec3 n = glm::cross(bestSv[l], bestSu[l]);
+            float len = glm::length(n);
+            result.normal = len > 0.0f ? n / len : glm::vec3(0.0f, 0.0f, 1.0f);
+        }
+    }
+}
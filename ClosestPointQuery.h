@@ -0,0 +1,100 @@
+#pragma once
+#ifndef CLOSEST_POINT_QUERY_H
+#define CLOSEST_POINT_QUERY_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstddef>
+
+#include "BezierSurface.h"
+
+
+struct ClosestPointResult
+{
+    int patchId; //Index into the surface array the query was built from. -1 if there is no surface
+    glm::vec2 uv;
+    float distance;
+    glm::vec3 position; //Closest point on the surface (scene frame)
+    glm::vec3 normal; //Unit surface normal at the closest point, oriented like the shader's normal
+};
+
+
+struct ClosestPointStats
+{
+    size_t numPoints;
+    size_t numNewtonSolves; //(point, patch) pairs that survived the pruning and got projected
+    int numThreads;
+    double seconds;
+    double pointsPerSecond;
+};
+
+
+/*
+    Answers "closest point on the surface to p" for large batches of points.
+    Points are expected in the scene frame (see toSceneSpace()), i.e. the frame the control grid
+    is laid out in before the viewer rotation. A BVH over the control point bounds of the patches
+    gives the candidate patches of a point, a coarse grid of samples on each candidate gives an
+    upper bound to prune with and the starting (u, v), and the surviving candidates are refined
+    by Newton iterations that run in lockstep over a batch of lanes.
+    Bounds rely on the convex hull property, so rational patches must have positive weights.
+*/
+class ClosestPointQuery
+{
+public:
+    //Builds the spatial index. Transforms of the surfaces are copied, the grid is referenced
+    //and has to outlive the query.
+    ClosestPointQuery(const ControlGrid& grid, const std::vector<BezierSurface>& surfaces);
+    //numThreads <= 0 uses every hardware thread.
+    ClosestPointStats query(const std::vector<glm::vec3>& points, std::vector<ClosestPointResult>& results, int numThreads = 0) const;
+
+private:
+    static constexpr int SEED_RES = 5;
+    static constexpr int LEAF_SIZE = 4;
+    static constexpr int LANES = 8;
+    static constexpr int MAX_NEWTON_ITERATIONS = 10;
+
+    struct Patch
+    {
+        int gridOffset;
+        glm::vec3 translation;
+        glm::vec3 scaling;
+        //Scene frame bounds and samples
+        glm::vec3 bmin;
+        glm::vec3 bmax;
+        glm::vec3 seeds[SEED_RES * SEED_RES];
+    };
+
+    struct Node
+    {
+        glm::vec3 bmin;
+        glm::vec3 bmax;
+        int left; //Children are left and left + 1. -1 for leaves
+        int first; //Leaf range in patchOrder
+        int count;
+    };
+
+    struct Candidate
+    {
+        int patchId;
+        float boxDist2; //Lower bound of the squared distance
+        float seedDist2; //Upper bound of the squared distance
+        glm::vec2 seedUV;
+    };
+
+    void buildNode(int nodeIndex, int first, int count);
+    //Evaluates the patch in the local frame and maps the result to the scene frame
+    SurfaceDerivatives evaluateScene(const Patch& patch, float u, float v) const;
+    ClosestPointResult queryPoint(const glm::vec3& q, std::vector<int>& stack, std::vector<Candidate>& candidates, size_t& numSolves) const;
+    //Projects q onto up to LANES candidates at once and keeps the best one in result
+    void newtonBatch(const glm::vec3& q, const Candidate* candidates, int count, ClosestPointResult& result) const;
+
+private:
+    const ControlGrid* grid;
+    HeightfieldEvaluator evaluate; //Specialisation for the degrees of the grid
+    std::vector<Patch> patches;
+    std::vector<int> patchOrder;
+    std::vector<Node> nodes;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include "ControlGrid.h"
+#include "GlAccounting.h"
+
+#include <iostream>
+#include <algorithm>
+
+
+bool isRational(const ControlGrid& grid)
+{
+    return !grid.weights.empty();
+}
+
+
+int numPatchesX(const ControlGrid& grid)
+{
+    return grid.numPx / (grid.degreeU + 1);
+}
+
+
+int numPatchesY(const ControlGrid& grid)
+{
+    return grid.numPy / (grid.degreeV + 1);
+}
+
+
+int patchOffset(const ControlGrid& grid, int i, int j)
+{
+    return (grid.degreeV + 1) * i * grid.numPx + (grid.degreeU + 1) * j;
+}
+
+
+int patchIndex(const ControlGrid& grid, int gridOffset)
+{
+    int i = gridOffset / ((grid.degreeV + 1) * grid.numPx);
+    int j = (gridOffset % grid.numPx) / (grid.degreeU + 1);
+    return i * numPatchesX(grid) + j;
+}
+
+
+size_t hostBytes(const ControlGrid& grid)
+{
+    return sizeof(float) * (grid.heights.size() + grid.weights.size());
+}
+
+
+float layoutPatchSize(const ControlGrid& grid, float extent)
+{
+    return extent / std::max(numPatchesX(grid), numPatchesY(grid));
+}
+
+
+glm::vec3 layoutOrigin(const ControlGrid& grid, float extent)
+{
+    int numBezierX = numPatchesX(grid);
+    int numBezierY = numPatchesY(grid);
+    float s = layoutPatchSize(grid, extent);
+    glm::vec3 offset;
+    if(numBezierX == numBezierY) //If the whole surface is square
+    {
+        offset = glm::vec3(0.5 * s - extent / 2, extent / 2 - 0.5 * s, 0.0);
+    }
+    else //Non-square
+    {
+        if(numBezierX > numBezierY) //X dominated case
+        {
+            offset = glm::vec3(0.5 * s - extent / 2, -extent / 2 + s * numBezierY - 0.5 * s, 0.0);
+        }
+        else //Y dominated case
+        {
+            offset = glm::vec3(0.5 * s - extent / 2, extent / 2 - 0.5 * s, 0.0);
+        }
+    }
+    
+    return offset;
+}
+
+
+std::vector<glm::vec3> layoutTranslations(const ControlGrid& grid, float extent)
+{
+    int numBezierX = numPatchesX(grid);
+    int numBezierY = numPatchesY(grid);
+    float s = layoutPatchSize(grid, extent);
+    glm::vec3 offset = layoutOrigin(grid, extent); //Maps the first surface to the top left
+    std::vector<glm::vec3> translations((size_t)numBezierX * numBezierY);
+    for(int i = 0; i < numBezierY; ++i)
+    {
+        for(int j = 0; j < numBezierX; ++j)
+        {
+            translations[(size_t)i * numBezierX + j] = offset + glm::vec3(j * s, -i * s, 0.0);
+        }
+    }
+    return translations;
+}
+
+
+void uploadTextureBuffer(GLuint& buffer, GLuint& texture, const std::vector<float>& values)
+{
+    if(buffer == 0)
+    {
+        glGenBuffers(1, &buffer);
+        glGenTextures(1, &texture);
+    }
+    glc::bindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glc::bufferData(GL_TEXTURE_BUFFER, sizeof(float) * values.size(), values.data(), GL_STATIC_DRAW);
+    glc::bindTexture(GL_TEXTURE_BUFFER, texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, buffer);
+    glc::bindTexture(GL_TEXTURE_BUFFER, 0);
+    glc::bindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+
+size_t maxControlGridPoints()
+{
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    return (size_t)std::max(maxTexels, 0);
+}
+
+
+bool uploadControlGrid(ControlGrid& grid)
+{
+    size_t maxTexels = maxControlGridPoints();
+    if(grid.heights.size() > maxTexels)
+    {
+        std::cout << "Control grid has " << grid.heights.size() << " points but texture buffers hold at most "
+                  << maxTexels << " texels. Split it into tiles with --make-tiles and view it with --paged." << std::endl;
+        return false;
+    }
+    uploadTextureBuffer(grid.heightBuffer, grid.heightTexture, grid.heights);
+    if(isRational(grid))
+    {
+        uploadTextureBuffer(grid.weightBuffer, grid.weightTexture, grid.weights);
+    }
+    return true;
+}
+
+
+void releaseControlGrid(ControlGrid& grid)
+{
+    glDeleteTextures(1, &grid.heightTexture);
+    glDeleteBuffers(1, &grid.heightBuffer);
+    glDeleteTextures(1, &grid.weightTexture);
+    glDeleteBuffers(1, &grid.weightBuffer);
+    grid.heightTexture = grid.heightBuffer = grid.weightTexture = grid.weightBuffer = 0;
+}
+
+
+void bindControlGrid(const ControlGrid& grid)
+{
+    glc::activeTexture(GL_TEXTURE0);
+    glc::bindTexture(GL_TEXTURE_BUFFER, grid.heightTexture);
+    if(isRational(grid))
+    {
+        glc::activeTexture(GL_TEXTURE1);
+        glc::bindTexture(GL_TEXTURE_BUFFER, grid.weightTexture);
+        glc::activeTexture(GL_TEXTURE0);
+    }
+}
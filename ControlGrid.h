@@ -0,0 +1,68 @@
+#pragma once
+#ifndef CONTROL_GRID_H
+#define CONTROL_GRID_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstddef>
+
+
+/*
+    Heightfield control grid shared by all patches of a scene. Only z is stored: x and y of a
+    control point follow from its position in its patch's block and are reconstructed by the
+    evaluators (BezierPatch::evaluateHeightfield and bezier.vert). Each patch takes a
+    (degreeV + 1) x (degreeU + 1) block and refers to it by the offset of its top left entry.
+    The GPU copy has the same layout, one texture buffer for the heights and one for the weights.
+*/
+struct ControlGrid
+{
+    int numPx = 0; //Number of horizontal control points
+    int numPy = 0; //Number of vertical control points
+    int degreeU = 3;
+    int degreeV = 3;
+    std::vector<float> heights; //numPy rows of numPx, row major
+    std::vector<float> weights; //Same layout. Empty unless the patches are rational.
+    //OpenGL Params
+    GLuint heightBuffer = 0;
+    GLuint heightTexture = 0;
+    GLuint weightBuffer = 0;
+    GLuint weightTexture = 0;
+};
+
+
+bool isRational(const ControlGrid& grid);
+//Number of patches along each axis
+int numPatchesX(const ControlGrid& grid);
+int numPatchesY(const ControlGrid& grid);
+//Offset of the top left control point of patch (row i, column j)
+int patchOffset(const ControlGrid& grid, int i, int j);
+//Row major index i * numPatchesX + j of the patch starting at gridOffset
+int patchIndex(const ControlGrid& grid, int gridOffset);
+size_t hostBytes(const ControlGrid& grid);
+/*
+    Layout of the patches in the scene frame: every patch is a square of side layoutPatchSize()
+    and patch (i, j) is centered at layoutOrigin() + (j, -i, 0) * layoutPatchSize(). The grid is
+    centered around the origin and its longer side spans extent.
+*/
+float layoutPatchSize(const ControlGrid& grid, float extent);
+glm::vec3 layoutOrigin(const ControlGrid& grid, float extent);
+//Centers of all patches in row major patch order, the translations of the laid out surfaces
+std::vector<glm::vec3> layoutTranslations(const ControlGrid& grid, float extent);
+
+/*
+    Creates (or refills) the texture buffers of the grid. Needs a current context. A grid with
+    more points than a texture buffer holds is not uploaded, since the shaders would read 0 past
+    the limit; returns false and points at the paged path.
+*/
+bool uploadControlGrid(ControlGrid& grid);
+//Most points uploadControlGrid() takes (GL_MAX_TEXTURE_BUFFER_SIZE). Needs a current context.
+size_t maxControlGridPoints();
+void releaseControlGrid(ControlGrid& grid);
+//Fills buffer with values and makes texture a single channel float view of it. Creates both if buffer is 0.
+void uploadTextureBuffer(GLuint& buffer, GLuint& texture, const std::vector<float>& values);
+//Binds the heights to texture unit 0 and the weights to texture unit 1
+void bindControlGrid(const ControlGrid& grid);
+
+#endif
@@ -0,0 +1,421 @@
+#include "FrameCapture.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+
+bool parseCaptureFormat(const std::string& name, CaptureFormat& format)
+{
+    if(name == "ppm")
+    {
+        format = CaptureFormat::PPM;
+    }
+    else if(name == "png")
+    {
+        format = CaptureFormat::PNG;
+    }
+    else if(name == "raw")
+    {
+        format = CaptureFormat::RAW;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+static void writeBigEndian(std::vector<unsigned char>& out, uint32_t value)
+{
+    out.push_back((unsigned char)(value >> 24));
+    out.push_back((unsigned char)(value >> 16));
+    out.push_back((unsigned char)(value >> 8));
+    out.push_back((unsigned char)value);
+}
+
+
+static uint32_t crc32(const unsigned char* data, size_t size)
+{
+    static uint32_t table[256];
+    static bool tableReady = [](){
+        for(uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for(int k = 0; k < 8; ++k)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        return true;
+    }();
+    (void)tableReady;
+    uint32_t crc = 0xFFFFFFFFu;
+    for(size_t i = 0; i < size; ++i)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+
+static void writeChunk(std::ofstream& file, const char* type, const std::vector<unsigned char>& data)
+{
+    std::vector<unsigned char> chunk;
+    chunk.reserve(data.size() + 12);
+    writeBigEndian(chunk, (uint32_t)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    writeBigEndian(chunk, crc32(&chunk[4], chunk.size() - 4));
+    file.write((const char*)chunk.data(), chunk.size());
+}
+
+
+/*
+    8 bit RGB PNG, rows from the top. There is no zlib in the project, so the image data goes
+    into stored (uncompressed) deflate blocks: files are as big as a PPM but any viewer opens them.
+*/
+static bool writePNG(const std::string& fileName, int width, int height, const std::vector<unsigned char>& rgb)
+{
+    std::ofstream file(fileName, std::ios::binary);
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    file.write((const char*)signature, 8);
+
+    std::vector<unsigned char> header;
+    writeBigEndian(header, (uint32_t)width);
+    writeBigEndian(header, (uint32_t)height);
+    header.insert(header.end(), { 8, 2, 0, 0, 0 }); //8 bit, RGB, deflate, adaptive filtering, no interlace
+    writeChunk(file, "IHDR", header);
+
+    //Every row starts with its filter type, 0 is none
+    size_t rowSize = (size_t)width * 3;
+    std::vector<unsigned char> raw;
+    raw.reserve((rowSize + 1) * height);
+    for(int row = 0; row < height; ++row)
+    {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + row * rowSize, rgb.begin() + (row + 1) * rowSize);
+    }
+    std::vector<unsigned char> zlib = { 0x78, 0x01 };
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    size_t position = 0;
+    do
+    {
+        size_t blockSize = std::min(raw.size() - position, (size_t)65535);
+        bool last = position + blockSize == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back((unsigned char)blockSize);
+        zlib.push_back((unsigned char)(blockSize >> 8));
+        zlib.push_back((unsigned char)~blockSize);
+        zlib.push_back((unsigned char)(~blockSize >> 8));
+        zlib.insert(zlib.end(), raw.begin() + position, raw.begin() + position + blockSize);
+        position += blockSize;
+    } while(position < raw.size());
+    uint32_t a = 1, b = 0;
+    for(unsigned char byte : raw)
+    {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    writeBigEndian(zlib, (b << 16) | a);
+    writeChunk(file, "IDAT", zlib);
+    writeChunk(file, "IEND", {});
+    return (bool)file;
+}
+
+
+FrameCapture::FrameCapture(const std::string& prefix, CaptureFormat format, int numEncoders, int ringSize)
+    : prefix(prefix), format(format), ring(ringSize), next(0), width(0), height(0), frameCount(0), warnedSize(false),
+      maxQueued(2 * numEncoders), numEncoding(0), stopping(false), nextRawFrame(0), stats()
+{
+    for(Slot& slot : ring)
+    {
+        glGenBuffers(1, &slot.buffer);
+        slot.fence = 0;
+        slot.frame = 0;
+    }
+    if(format == CaptureFormat::RAW)
+    {
+        rawStream.open(prefix + ".rgb", std::ios::binary);
+        if(!rawStream)
+        {
+            std::cout << "Failed to open " << prefix << ".rgb" << std::endl;
+        }
+    }
+    for(int e = 0; e < numEncoders; ++e)
+    {
+        encoders.emplace_back(&FrameCapture::encoderLoop, this);
+    }
+}
+
+
+FrameCapture::~FrameCapture()
+{
+    finish();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    for(std::thread& encoder : encoders)
+    {
+        encoder.join();
+    }
+    for(Slot& slot : ring)
+    {
+        glDeleteBuffers(1, &slot.buffer);
+    }
+}
+
+
+void FrameCapture::capture(int width, int height)
+{
+    auto start = std::chrono::steady_clock::now();
+    //Minimized
+    if(width <= 0 || height <= 0)
+    {
+        return;
+    }
+    if(width != this->width || height != this->height)
+    {
+        //A raw stream has one size for all its frames
+        if(format == CaptureFormat::RAW && frameCount > 0)
+        {
+            if(!warnedSize)
+            {
+                std::cout << "The raw stream stays " << this->width << "x" << this->height << ", frames of other sizes are skipped" << std::endl;
+                warnedSize = true;
+            }
+            return;
+        }
+        resize(width, height);
+    }
+
+    //The slot comes back around: its frame is ringSize - 1 frames old and usually done
+    Slot& slot = ring[next];
+    retire(slot, true);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    //RGBA rows are always 4 byte aligned and match the framebuffer, so drivers copy them without conversion
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frame = frameCount++;
+    next = (next + 1) % (int)ring.size();
+
+    //Older frames the GPU already finished leave now rather than next time around
+    for(size_t k = 0; k + 1 < ring.size(); ++k)
+    {
+        if(!retire(ring[(next + k) % ring.size()], false))
+        {
+            break;
+        }
+    }
+    stats.framesCaptured++;
+    stats.renderThreadMs += millisecondsSince(start);
+}
+
+
+void FrameCapture::finish()
+{
+    auto start = std::chrono::steady_clock::now();
+    //Oldest first, so the frames reach the encoders in order
+    for(size_t k = 0; k < ring.size(); ++k)
+    {
+        retire(ring[(next + k) % ring.size()], true);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    queueChanged.wait(lock, [this](){ return queue.empty() && numEncoding == 0; });
+    if(rawStream.is_open())
+    {
+        rawStream.flush();
+    }
+    stats.stallMs += millisecondsSince(start);
+}
+
+
+CaptureStats FrameCapture::takeStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    CaptureStats taken = stats;
+    stats = CaptureStats();
+    return taken;
+}
+
+
+int FrameCapture::getFrameWidth() const
+{
+    return width;
+}
+
+
+int FrameCapture::getFrameHeight() const
+{
+    return height;
+}
+
+
+void FrameCapture::resize(int width, int height)
+{
+    //Frames of the old size are still in the ring
+    for(size_t k = 0; k < ring.size(); ++k)
+    {
+        retire(ring[(next + k) % ring.size()], true);
+    }
+    this->width = width;
+    this->height = height;
+    for(Slot& slot : ring)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+
+bool FrameCapture::retire(Slot& slot, bool wait)
+{
+    if(!slot.fence)
+    {
+        return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if(status == GL_TIMEOUT_EXPIRED && !wait)
+    {
+        return false;
+    }
+    while(status == GL_TIMEOUT_EXPIRED)
+    {
+        status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); //1 ms
+    }
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    //Encoders behind: wait for room rather than drop frames, a capture has to be complete
+    std::vector<unsigned char> pixels;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        queueChanged.wait(lock, [this](){ return queue.size() < maxQueued; });
+        if(!spareBuffers.empty())
+        {
+            pixels.swap(spareBuffers.back());
+            spareBuffers.pop_back();
+        }
+    }
+    stats.stallMs += millisecondsSince(start);
+
+    size_t size = (size_t)width * height * 4;
+    pixels.resize(size);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)size, GL_MAP_READ_BIT);
+    if(mapped)
+    {
+        std::memcpy(pixels.data(), mapped, size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    else
+    {
+        //Still queued, black, so that later frames keep their numbers and the raw stream its order
+        std::cout << "Failed to map the pixels of frame " << slot.frame << std::endl;
+        std::fill(pixels.begin(), pixels.end(), 0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back({ slot.frame, width, height, std::move(pixels) });
+    }
+    queueChanged.notify_all();
+    return true;
+}
+
+
+void FrameCapture::encoderLoop()
+{
+    std::vector<unsigned char> rgb;
+    while(true)
+    {
+        EncodedFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queueChanged.wait(lock, [this](){ return stopping || !queue.empty(); });
+            if(queue.empty())
+            {
+                return;
+            }
+            frame = std::move(queue.front());
+            queue.pop_front();
+            numEncoding++;
+        }
+        queueChanged.notify_all();
+
+        encode(frame, rgb);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            spareBuffers.push_back(std::move(frame.rgba));
+            numEncoding--;
+            stats.framesWritten++;
+        }
+        queueChanged.notify_all();
+    }
+}
+
+
+void FrameCapture::encode(EncodedFrame& frame, std::vector<unsigned char>& rgb)
+{
+    //Drop alpha and flip to rows from the top
+    rgb.resize((size_t)frame.width * frame.height * 3);
+    for(int row = 0; row < frame.height; ++row)
+    {
+        const unsigned char* in = &frame.rgba[(size_t)(frame.height - 1 - row) * frame.width * 4];
+        unsigned char* out = &rgb[(size_t)row * frame.width * 3];
+        for(int x = 0; x < frame.width; ++x)
+        {
+            out[3*x] = in[4*x];
+            out[3*x + 1] = in[4*x + 1];
+            out[3*x + 2] = in[4*x + 2];
+        }
+    }
+
+    if(format == CaptureFormat::RAW)
+    {
+        //Frames are taken from the queue in order, so the one whose turn it is is always being encoded
+        std::unique_lock<std::mutex> lock(rawMutex);
+        rawTurn.wait(lock, [&](){ return nextRawFrame == frame.frame; });
+        rawStream.write((const char*)rgb.data(), rgb.size());
+        nextRawFrame++;
+        lock.unlock();
+        rawTurn.notify_all();
+        return;
+    }
+
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%05llu", (unsigned long long)frame.frame);
+    std::string fileName = prefix + number + (format == CaptureFormat::PNG ? ".png" : ".ppm");
+    bool written;
+    if(format == CaptureFormat::PNG)
+    {
+        written = writePNG(fileName, frame.width, frame.height, rgb);
+    }
+    else
+    {
+        std::ofstream image(fileName, std::ios::binary);
+        image << "P6\n" << frame.width << " " << frame.height << "\n255\n";
+        image.write((const char*)rgb.data(), rgb.size());
+        written = (bool)image;
+    }
+    if(!written)
+    {
+        std::cout << "Failed to write " << fileName << std::endl;
+    }
+}
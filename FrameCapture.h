@@ -0,0 +1,110 @@
+#pragma once
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <GL/glew.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <cstdint>
+
+
+enum class CaptureFormat
+{
+    PPM,
+    PNG,
+    RAW //One headerless RGB24 stream, frames in order (ffmpeg -f rawvideo -pix_fmt rgb24)
+};
+
+//Parses "ppm", "png" or "raw", false for anything else
+bool parseCaptureFormat(const std::string& name, CaptureFormat& format);
+
+
+struct CaptureStats
+{
+    uint64_t framesCaptured;
+    uint64_t framesWritten;
+    double renderThreadMs; //Time spent in capture(), summed
+    double stallMs; //Part of it spent waiting for fences or for the encoders
+};
+
+
+/*
+    Captures the default framebuffer without stalling the pipeline. capture() only issues a
+    glReadPixels into the next pixel buffer object of a ring and puts a fence behind it, the
+    pixels of frame N are mapped when the ring comes back around, by then the GPU is rendering
+    frame N + ringSize - 1. The copies then go to a pool of encoder threads writing
+    <prefix>_<frame>.ppm/.png or appending to <prefix>.rgb.
+    Call capture() after drawing and before glfwSwapBuffers, with the context current.
+*/
+class FrameCapture
+{
+public:
+    FrameCapture(const std::string& prefix, CaptureFormat format, int numEncoders = 2, int ringSize = 3);
+    //Calls finish()
+    ~FrameCapture();
+
+    void capture(int width, int height);
+    //Reads back every frame in flight and waits until all of them are written
+    void finish();
+    CaptureStats takeStats();
+    //Size of the frames read back, for a raw stream the size of all of its frames. 0 before the first frame.
+    int getFrameWidth() const;
+    int getFrameHeight() const;
+
+private:
+    struct Slot
+    {
+        GLuint buffer;
+        GLsync fence;
+        uint64_t frame;
+    };
+
+    struct EncodedFrame
+    {
+        uint64_t frame;
+        int width;
+        int height;
+        std::vector<unsigned char> rgba; //Rows from the bottom, like glReadPixels
+    };
+
+    void resize(int width, int height);
+    //Maps the slot once its fence has passed and queues the pixels. With wait false a slot the
+    //GPU has not finished yet is left alone.
+    bool retire(Slot& slot, bool wait);
+    void encoderLoop();
+    void encode(EncodedFrame& frame, std::vector<unsigned char>& rgb);
+
+private:
+    std::string prefix;
+    CaptureFormat format;
+    std::vector<Slot> ring;
+    int next;
+    int width;
+    int height;
+    uint64_t frameCount;
+    bool warnedSize;
+
+    std::vector<std::thread> encoders;
+    std::mutex mutex;
+    std::condition_variable queueChanged;
+    std::deque<EncodedFrame> queue;
+    std::vector<std::vector<unsigned char>> spareBuffers; //Recycled pixel copies
+    size_t maxQueued;
+    size_t numEncoding;
+    bool stopping;
+    //The raw stream is appended in frame order whichever encoder finishes first
+    std::mutex rawMutex;
+    std::ofstream rawStream;
+    uint64_t nextRawFrame;
+    std::condition_variable rawTurn;
+
+    CaptureStats stats;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "GlAccounting.h"
+
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+
+
+bool isGlAccountingEnabled()
+{
+#ifdef GL_ACCOUNTING
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+bool hasGlBudget(const GlBudget& budget)
+{
+    return budget.drawCalls >= 0 || budget.stateChanges >= 0 || budget.uniformUploads >= 0 ||
+           budget.bytesUploaded >= 0 || budget.bufferAllocations >= 0;
+}
+
+
+bool parseGlBudget(const std::string& text, GlBudget& budget)
+{
+    std::istringstream stream(text);
+    std::string item;
+    while(std::getline(stream, item, ','))
+    {
+        size_t equals = item.find('=');
+        char* end = nullptr;
+        long long limit = equals == std::string::npos ? 0 : std::strtoll(item.c_str() + equals + 1, &end, 10);
+        if(equals == std::string::npos || end == item.c_str() + equals + 1 || *end != '\0' || limit < 0)
+        {
+            std::cout << "Can not read the GL budget \"" << item << "\", expected <counter>=<limit>" << std::endl;
+            return false;
+        }
+        std::string counter = item.substr(0, equals);
+        if(counter == "draws")
+        {
+            budget.drawCalls = limit;
+        }
+        else if(counter == "state")
+        {
+            budget.stateChanges = limit;
+        }
+        else if(counter == "uniforms")
+        {
+            budget.uniformUploads = limit;
+        }
+        else if(counter == "bytes")
+        {
+            budget.bytesUploaded = limit;
+        }
+        else if(counter == "allocs")
+        {
+            budget.bufferAllocations = limit;
+        }
+        else
+        {
+            std::cout << "Unknown GL budget counter " << counter << ", use draws, state, uniforms, bytes or allocs" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool checkGlBudget(const GlFrameStats& stats, const GlBudget& budget, std::string& violations)
+{
+    std::ostringstream out;
+    auto check = [&out](const char* name, long long value, long long limit)
+    {
+        if(limit >= 0 && value > limit)
+        {
+            out << (out.tellp() > 0 ? ", " : "") << name << " " << value << " > " << limit;
+        }
+    };
+    check("draws", stats.drawCalls, budget.drawCalls);
+    check("state", stats.stateChanges, budget.stateChanges);
+    check("uniforms", stats.uniformUploads, budget.uniformUploads);
+    check("bytes", stats.bytesUploaded, budget.bytesUploaded);
+    check("allocs", stats.bufferAllocations, budget.bufferAllocations);
+    violations = out.str();
+    return violations.empty();
+}
+
+
+void printGlStats(std::ostream& out, const GlFrameStats& stats)
+{
+    out << stats.drawCalls << " draws, " << stats.stateChanges << " state changes, " << stats.uniformUploads
+        << " uniforms, " << stats.bytesUploaded << " bytes, " << stats.bufferAllocations << " allocations";
+}
+
+
+namespace glc
+{
+    GlFrameStats& frameStats()
+    {
+        thread_local GlFrameStats stats;
+        return stats;
+    }
+
+    GlFrameStats takeFrameStats()
+    {
+        GlFrameStats stats = frameStats();
+        frameStats() = GlFrameStats();
+        return stats;
+    }
+}
@@ -0,0 +1,221 @@
+#pragma once
+#ifndef GL_ACCOUNTING_H
+#define GL_ACCOUNTING_H
+
+#include <GL/glew.h>
+
+#include <string>
+#include <ostream>
+
+
+//GL work of one frame, as counted by the glc wrappers
+struct GlFrameStats
+{
+    long long drawCalls = 0; //Draws, compute dispatches and blits
+    long long stateChanges = 0; //Program, vertex array, buffer, texture and framebuffer binds and attachments, texture parameters, enables and disables
+    long long uniformUploads = 0;
+    long long bytesUploaded = 0; //glBufferData with data and glBufferSubData
+    long long bufferAllocations = 0; //glBufferData calls, each one allocates new storage
+};
+
+//Limits per frame, negative ones are not checked
+struct GlBudget
+{
+    long long drawCalls = -1;
+    long long stateChanges = -1;
+    long long uniformUploads = -1;
+    long long bytesUploaded = -1;
+    long long bufferAllocations = -1;
+};
+
+//True when built with GL_ACCOUNTING, otherwise every counter stays 0
+bool isGlAccountingEnabled();
+//True if any counter has a limit
+bool hasGlBudget(const GlBudget& budget);
+//Parses a comma separated list of draws=N, state=N, uniforms=N, bytes=N and allocs=N. Prints what it could not read.
+bool parseGlBudget(const std::string& text, GlBudget& budget);
+//True if no counter is over its limit, otherwise violations lists the ones that are
+bool checkGlBudget(const GlFrameStats& stats, const GlBudget& budget, std::string& violations);
+//One line: draws, state changes, uniforms, bytes and allocations
+void printGlStats(std::ostream& out, const GlFrameStats& stats);
+
+
+/*
+    Thin dispatch layer over the GL calls the renderer makes per frame. Built with GL_ACCOUNTING
+    defined, every wrapper adds to the calling thread's counters before making the call (each
+    render worker has its own context and its own counters). Without it the wrappers are the bare
+    GL calls. Code that runs every frame calls GL through these, setup code may call GL directly.
+*/
+namespace glc
+{
+    //Counters of the calling thread since the last takeFrameStats()
+    GlFrameStats& frameStats();
+    //Returns the counters and starts the next frame
+    GlFrameStats takeFrameStats();
+}
+
+#ifdef GL_ACCOUNTING
+#define GLC_COUNT(counter, amount) (glc::frameStats().counter += (amount))
+#else
+#define GLC_COUNT(counter, amount) ((void)0)
+#endif
+
+namespace glc
+{
+    //Draws
+    inline void drawElements(GLenum mode, GLsizei count, GLenum type, const void* indices)
+    {
+        GLC_COUNT(drawCalls, 1);
+        glDrawElements(mode, count, type, indices);
+    }
+    inline void drawArrays(GLenum mode, GLint first, GLsizei count)
+    {
+        GLC_COUNT(drawCalls, 1);
+        glDrawArrays(mode, first, count);
+    }
+    inline void multiDrawElementsIndirect(GLenum mode, GLenum type, const void* indirect, GLsizei drawCount, GLsizei stride)
+    {
+        GLC_COUNT(drawCalls, 1);
+        glMultiDrawElementsIndirect(mode, type, indirect, drawCount, stride);
+    }
+    inline void dispatchCompute(GLuint x, GLuint y, GLuint z)
+    {
+        GLC_COUNT(drawCalls, 1);
+        glDispatchCompute(x, y, z);
+    }
+    inline void blitFramebuffer(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1,
+                                GLint dstY1, GLbitfield mask, GLenum filter)
+    {
+        GLC_COUNT(drawCalls, 1);
+        glBlitFramebuffer(srcX0, srcY0, srcX1, srcY1, dstX0, dstY0, dstX1, dstY1, mask, filter);
+    }
+
+    //State
+    inline void useProgram(GLuint program)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glUseProgram(program);
+    }
+    inline void bindVertexArray(GLuint vao)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glBindVertexArray(vao);
+    }
+    inline void bindBuffer(GLenum target, GLuint buffer)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glBindBuffer(target, buffer);
+    }
+    inline void bindBufferBase(GLenum target, GLuint index, GLuint buffer)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glBindBufferBase(target, index, buffer);
+    }
+    inline void activeTexture(GLenum unit)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glActiveTexture(unit);
+    }
+    inline void bindTexture(GLenum target, GLuint texture)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glBindTexture(target, texture);
+    }
+    inline void bindFramebuffer(GLenum target, GLuint framebuffer)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glBindFramebuffer(target, framebuffer);
+    }
+    inline void framebufferTexture2D(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glFramebufferTexture2D(target, attachment, textarget, texture, level);
+    }
+    inline void texParameteri(GLenum target, GLenum name, GLint value)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glTexParameteri(target, name, value);
+    }
+    inline void enable(GLenum capability)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glEnable(capability);
+    }
+    inline void disable(GLenum capability)
+    {
+        GLC_COUNT(stateChanges, 1);
+        glDisable(capability);
+    }
+
+    //Uploads
+    inline void bufferData(GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+    {
+        GLC_COUNT(bufferAllocations, 1);
+        GLC_COUNT(bytesUploaded, data != nullptr ? (long long)size : 0);
+        glBufferData(target, size, data, usage);
+    }
+    inline void bufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void* data)
+    {
+        GLC_COUNT(bytesUploaded, (long long)size);
+        glBufferSubData(target, offset, size, data);
+    }
+
+    //Uniforms
+    inline void uniform1i(GLint location, GLint value)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform1i(location, value);
+    }
+    inline void uniform1f(GLint location, GLfloat value)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform1f(location, value);
+    }
+    inline void uniform2f(GLint location, GLfloat x, GLfloat y)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform2f(location, x, y);
+    }
+    inline void uniform3f(GLint location, GLfloat x, GLfloat y, GLfloat z)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform3f(location, x, y, z);
+    }
+    inline void uniform4f(GLint location, GLfloat x, GLfloat y, GLfloat z, GLfloat w)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform4f(location, x, y, z, w);
+    }
+    inline void uniform1fv(GLint location, GLsizei count, const GLfloat* values)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform1fv(location, count, values);
+    }
+    inline void uniform2fv(GLint location, GLsizei count, const GLfloat* values)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform2fv(location, count, values);
+    }
+    inline void uniform3fv(GLint location, GLsizei count, const GLfloat* values)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform3fv(location, count, values);
+    }
+    inline void uniform4fv(GLint location, GLsizei count, const GLfloat* values)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniform4fv(location, count, values);
+    }
+    inline void uniformMatrix3fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* values)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniformMatrix3fv(location, count, transpose, values);
+    }
+    inline void uniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* values)
+    {
+        GLC_COUNT(uniformUploads, 1);
+        glUniformMatrix4fv(location, count, transpose, values);
+    }
+}
+
+#endif
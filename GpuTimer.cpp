@@ -0,0 +1,75 @@
+#include "GpuTimer.h"
+
+
+GpuTimer::GpuTimer(int numQueries)
+    : queries(numQueries), pending(numQueries, 0), next(0), running(false), totalNs(0), numMeasured(0)
+{
+    glGenQueries(numQueries, queries.data());
+}
+
+
+GpuTimer::~GpuTimer()
+{
+    glDeleteQueries((GLsizei)queries.size(), queries.data());
+}
+
+
+void GpuTimer::begin()
+{
+    collect();
+    //Every query of the ring is still in flight, this frame goes unmeasured
+    if(pending[next])
+    {
+        return;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+    running = true;
+}
+
+
+void GpuTimer::end()
+{
+    if(!running)
+    {
+        return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    pending[next] = 1;
+    next = (next + 1) % (int)queries.size();
+    running = false;
+}
+
+
+double GpuTimer::takeAverageMs()
+{
+    collect();
+    double average = numMeasured > 0 ? totalNs / (1.0e6 * numMeasured) : -1.0;
+    totalNs = 0;
+    numMeasured = 0;
+    return average;
+}
+
+
+void GpuTimer::collect()
+{
+    //Oldest first, results become available in order
+    for(size_t k = 0; k < queries.size(); ++k)
+    {
+        int q = (next + (int)k) % (int)queries.size();
+        if(!pending[q])
+        {
+            continue;
+        }
+        GLint available = GL_FALSE;
+        glGetQueryObjectiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+        {
+            break;
+        }
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &ns);
+        totalNs += ns;
+        numMeasured++;
+        pending[q] = 0;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <GL/glew.h>
+
+#include <vector>
+#include <cstdint>
+
+
+/*
+    Measures GPU time of the commands between begin() and end() with GL_TIME_ELAPSED queries.
+    Queries are kept in a ring and only read back once the GPU has finished them, so timing a
+    pass never stalls the pipeline. Results arrive a few frames late.
+*/
+class GpuTimer
+{
+public:
+    explicit GpuTimer(int numQueries = 4);
+    ~GpuTimer();
+
+    void begin();
+    void end();
+    //Average of the measurements finished since the last call, in milliseconds. -1 if there are none.
+    double takeAverageMs();
+
+private:
+    void collect();
+
+private:
+    std::vector<GLuint> queries;
+    std::vector<char> pending; //Started and not read back yet
+    int next;
+    bool running;
+    uint64_t totalNs;
+    int numMeasured;
+};
+
+#endif
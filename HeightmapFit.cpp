@@ -0,0 +1,459 @@
+#include "HeightmapFit.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+
+
+//Relative size of the ridge term that keeps the normal equations definite when a patch has few pixels
+static const double RIDGE = 1e-10;
+
+
+/*
+    The C1 cubic splines with N uniform pieces along one axis, sampled at the pixel centers.
+    Sample p lies in patch k and depends on coefficients first[p] = 2k .. 2k + 3 only.
+*/
+struct AxisBasis
+{
+    int numPatches;
+    int numCoefficients; //2 * numPatches + 2
+    std::vector<int> first;
+    std::vector<double> weights; //4 per sample
+    std::vector<int> patchStart; //First sample of every patch, then the number of samples
+    std::vector<double> gram; //A^T A, 7 diagonals per row: gram[a * 7 + 3 + (b - a)]
+};
+
+static AxisBasis buildAxisBasis(int numSamples, int numPatches)
+{
+    AxisBasis basis;
+    basis.numPatches = numPatches;
+    basis.numCoefficients = 2 * numPatches + 2;
+    basis.first.resize(numSamples);
+    basis.weights.resize(4 * (size_t)numSamples);
+    basis.patchStart.assign(numPatches + 1, numSamples);
+    for(int p = numSamples - 1; p >= 0; --p)
+    {
+        double t = (p + 0.5) / numSamples * numPatches;
+        int k = std::min((int)t, numPatches - 1);
+        double u = t - k, s = 1.0 - u;
+        double B0 = s * s * s, B1 = 3.0 * u * s * s, B2 = 3.0 * u * u * s, B3 = u * u * u;
+        //Bezier points 3k + 1 and 3k + 2 are coefficients 2k + 1 and 2k + 2, an inner seam point
+        //is the midpoint of its neighbours and the two end points are coefficients of their own
+        bool firstPatch = k == 0, lastPatch = k == numPatches - 1;
+        double* w = &basis.weights[4 * (size_t)p];
+        w[0] = firstPatch ? B0 : 0.5 * B0;
+        w[1] = (firstPatch ? 0.0 : 0.5 * B0) + B1;
+        w[2] = B2 + (lastPatch ? 0.0 : 0.5 * B3);
+        w[3] = lastPatch ? B3 : 0.5 * B3;
+        basis.first[p] = 2 * k;
+        basis.patchStart[k] = p;
+    }
+    for(int k = numPatches - 1; k >= 0; --k)
+    {
+        basis.patchStart[k] = std::min(basis.patchStart[k], basis.patchStart[k + 1]);
+    }
+
+    basis.gram.assign(7 * (size_t)basis.numCoefficients, 0.0);
+    for(int p = 0; p < numSamples; ++p)
+    {
+        const double* w = &basis.weights[4 * (size_t)p];
+        for(int i = 0; i < 4; ++i)
+        {
+            for(int j = 0; j < 4; ++j)
+            {
+                basis.gram[(basis.first[p] + i) * 7 + 3 + (j - i)] += w[i] * w[j];
+            }
+        }
+    }
+    return basis;
+}
+
+//Row a of the banded Gram matrix times column c of X, X has stride rows
+static inline double gramTimes(const AxisBasis& basis, int a, const double* X, size_t stride)
+{
+    int lo = std::max(0, a - 3), hi = std::min(basis.numCoefficients - 1, a + 3);
+    const double* g = &basis.gram[a * 7 + 3];
+    double sum = 0.0;
+    for(int b = lo; b <= hi; ++b)
+    {
+        sum += g[b - a] * X[b * stride];
+    }
+    return sum;
+}
+
+//Bezier point m of the 3N + 1 along one axis, from the coefficient at stride apart
+static inline double expandCoefficient(const double* c, int m, int numPatches, size_t stride)
+{
+    int k = m / 3;
+    switch(m % 3)
+    {
+    case 1:
+        return c[(2 * k + 1) * stride];
+    case 2:
+        return c[(2 * k + 2) * stride];
+    default:
+        if(k == 0)
+        {
+            return c[0];
+        }
+        if(k == numPatches)
+        {
+            return c[(2 * k + 1) * stride];
+        }
+        return 0.5 * (c[2 * k * stride] + c[(2 * k + 1) * stride]);
+    }
+}
+
+//Splits [0, count) into numThreads contiguous ranges and runs work on each, the first on the calling thread
+static void parallelRanges(int numThreads, int count, const std::function<void(int, int)>& work)
+{
+    numThreads = std::max(1, std::min(numThreads, count));
+    std::vector<std::thread> threads;
+    for(int t = 1; t < numThreads; ++t)
+    {
+        threads.emplace_back(work, (int)((long long)count * t / numThreads), (int)((long long)count * (t + 1) / numThreads));
+    }
+    work(0, count / numThreads);
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+
+static bool readPgm(std::ifstream& in, const char* fileName, Heightmap& map)
+{
+    //Header fields are separated by whitespace and may be interleaved with comment lines
+    auto readField = [&in](int& value)
+    {
+        for(int c = in.peek(); c != EOF && (std::isspace(c) || c == '#'); c = in.peek())
+        {
+            if(c == '#')
+            {
+                std::string comment;
+                std::getline(in, comment);
+            }
+            else
+            {
+                in.get();
+            }
+        }
+        return (bool)(in >> value);
+    };
+    int maxValue = 0;
+    if(!readField(map.width) || !readField(map.height) || !readField(maxValue) || map.width <= 0 || map.height <= 0 ||
+       maxValue <= 0 || maxValue > 65535)
+    {
+        std::cout << "Failed to read the PGM header of " << fileName << std::endl;
+        return false;
+    }
+    in.get(); //The single whitespace before the pixels
+    int bytesPerPixel = maxValue < 256 ? 1 : 2;
+    std::vector<unsigned char> pixels((size_t)map.width * map.height * bytesPerPixel);
+    if(!in.read((char*)pixels.data(), pixels.size()))
+    {
+        std::cout << "The PGM file " << fileName << " ends before all pixels are read" << std::endl;
+        return false;
+    }
+    map.values.resize((size_t)map.width * map.height);
+    float scale = 1.0f / maxValue;
+    for(size_t i = 0; i < map.values.size(); ++i)
+    {
+        //16 bit samples are big endian
+        int value = bytesPerPixel == 1 ? pixels[i] : (pixels[2 * i] << 8) | pixels[2 * i + 1];
+        map.values[i] = value * scale;
+    }
+    return true;
+}
+
+
+bool readHeightmap(const char* fileName, Heightmap& map, int rawWidth)
+{
+    std::ifstream in(fileName, std::ios::binary);
+    if(!in)
+    {
+        std::cout << "Failed to open the heightmap " << fileName << std::endl;
+        return false;
+    }
+    char magic[2] = {};
+    in.read(magic, 2);
+    if(in && magic[0] == 'P' && magic[1] == '5')
+    {
+        return readPgm(in, fileName, map);
+    }
+
+    //Raw floats
+    in.clear();
+    in.seekg(0, std::ios::end);
+    size_t count = (size_t)in.tellg() / sizeof(float);
+    in.seekg(0);
+    map.width = rawWidth > 0 ? rawWidth : (int)std::lround(std::sqrt((double)count));
+    map.height = map.width > 0 ? (int)(count / map.width) : 0;
+    if(map.width <= 0 || map.height <= 0 || (size_t)map.width * map.height != count)
+    {
+        std::cout << "The raw heightmap " << fileName << " holds " << count << " floats, which is not "
+                  << (rawWidth > 0 ? "a whole number of rows" : "a square, give the width") << std::endl;
+        return false;
+    }
+    map.values.resize(count);
+    if(!in.read((char*)map.values.data(), sizeof(float) * count))
+    {
+        std::cout << "Failed to read the heightmap " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+HeightmapFit fitHeightmap(const Heightmap& map, int pixelsPerPatch, float heightScale, double tolerance, int maxIterations, int numThreads)
+{
+    auto start = std::chrono::steady_clock::now();
+    HeightmapFit fit = {};
+    fit.numThreads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+    pixelsPerPatch = std::max(pixelsPerPatch, 1);
+    fit.numPatchesX = std::max(1, map.width / pixelsPerPatch);
+    fit.numPatchesY = std::max(1, map.height / pixelsPerPatch);
+    AxisBasis basisX = buildAxisBasis(map.width, fit.numPatchesX);
+    AxisBasis basisY = buildAxisBasis(map.height, fit.numPatchesY);
+    int Mx = basisX.numCoefficients;
+    int My = basisY.numCoefficients;
+    size_t numUnknowns = (size_t)Mx * My;
+
+    //Right hand side Ay^T H Ax. Each patch row sums its pixels into the 4 coefficient rows it
+    //touches, the rows shared by neighbouring patch rows are added up afterwards in order.
+    std::vector<double> partial(4 * (size_t)Mx * fit.numPatchesY, 0.0);
+    parallelRanges(fit.numThreads, fit.numPatchesY, [&](int firstPatch, int lastPatch)
+    {
+        std::vector<double> rowProduct(Mx);
+        for(int k = firstPatch; k < lastPatch; ++k)
+        {
+            double* acc = &partial[4 * (size_t)Mx * k];
+            for(int r = basisY.patchStart[k]; r < basisY.patchStart[k + 1]; ++r)
+            {
+                std::fill(rowProduct.begin(), rowProduct.end(), 0.0);
+                const float* row = &map.values[(size_t)r * map.width];
+                for(int c = 0; c < map.width; ++c)
+                {
+                    double h = (double)row[c] * heightScale;
+                    const double* w = &basisX.weights[4 * (size_t)c];
+                    double* out = &rowProduct[basisX.first[c]];
+                    out[0] += w[0] * h;
+                    out[1] += w[1] * h;
+                    out[2] += w[2] * h;
+                    out[3] += w[3] * h;
+                }
+                const double* wy = &basisY.weights[4 * (size_t)r];
+                for(int i = 0; i < 4; ++i)
+                {
+                    for(int c = 0; c < Mx; ++c)
+                    {
+                        acc[i * Mx + c] += wy[i] * rowProduct[c];
+                    }
+                }
+            }
+        }
+    });
+    std::vector<double> rhs(numUnknowns, 0.0);
+    for(int k = 0; k < fit.numPatchesY; ++k)
+    {
+        const double* acc = &partial[4 * (size_t)Mx * k];
+        double* out = &rhs[2 * (size_t)k * Mx];
+        for(size_t i = 0; i < 4 * (size_t)Mx; ++i)
+        {
+            out[i] += acc[i];
+        }
+    }
+    partial = std::vector<double>();
+
+    //Jacobi preconditioned conjugate gradients on (Gy (x) Gx + ridge) C = rhs. The operator is
+    //applied as Gy (P Gx), both factors banded, one band of coefficient rows per thread.
+    auto solveStart = std::chrono::steady_clock::now();
+    auto meanDiagonal = [](const AxisBasis& basis)
+    {
+        double sum = 0.0;
+        for(int a = 0; a < basis.numCoefficients; ++a)
+        {
+            sum += basis.gram[a * 7 + 3];
+        }
+        return sum / basis.numCoefficients;
+    };
+    double ridge = RIDGE * meanDiagonal(basisX) * meanDiagonal(basisY);
+    std::vector<double> x(numUnknowns, 0.0), r = rhs, z(numUnknowns), p(numUnknowns, 0.0), q(numUnknowns), product(numUnknowns);
+    std::vector<double> inverseDiagonal(numUnknowns);
+    for(int a = 0; a < My; ++a)
+    {
+        for(int c = 0; c < Mx; ++c)
+        {
+            inverseDiagonal[(size_t)a * Mx + c] = 1.0 / (basisY.gram[a * 7 + 3] * basisX.gram[c * 7 + 3] + ridge);
+        }
+    }
+    //Per coefficient row partial sums, added in row order so the result does not depend on the bands
+    std::vector<double> rowSumA(My), rowSumB(My);
+    auto sumRows = [](const std::vector<double>& rows)
+    {
+        double sum = 0.0;
+        for(double value : rows)
+        {
+            sum += value;
+        }
+        return sum;
+    };
+
+    double rhsNorm = 0.0;
+    double rz = 0.0;
+    parallelRanges(fit.numThreads, My, [&](int firstRow, int lastRow)
+    {
+        for(int a = firstRow; a < lastRow; ++a)
+        {
+            double bb = 0.0, bz = 0.0;
+            for(size_t i = (size_t)a * Mx; i < (size_t)(a + 1) * Mx; ++i)
+            {
+                z[i] = r[i] * inverseDiagonal[i];
+                bb += r[i] * r[i];
+                bz += r[i] * z[i];
+            }
+            rowSumA[a] = bb;
+            rowSumB[a] = bz;
+        }
+    });
+    rhsNorm = std::sqrt(sumRows(rowSumA));
+    rz = sumRows(rowSumB);
+    double beta = 0.0;
+    fit.residual = rhsNorm > 0.0 ? 1.0 : 0.0;
+    fit.converged = fit.residual <= tolerance;
+    while(!fit.converged && fit.iterations < maxIterations)
+    {
+        //p = z + beta p and product = P Gx
+        parallelRanges(fit.numThreads, My, [&](int firstRow, int lastRow)
+        {
+            for(int a = firstRow; a < lastRow; ++a)
+            {
+                double* pRow = &p[(size_t)a * Mx];
+                const double* zRow = &z[(size_t)a * Mx];
+                for(int c = 0; c < Mx; ++c)
+                {
+                    pRow[c] = zRow[c] + beta * pRow[c];
+                }
+                double* out = &product[(size_t)a * Mx];
+                for(int c = 0; c < Mx; ++c)
+                {
+                    out[c] = gramTimes(basisX, c, pRow, 1);
+                }
+            }
+        });
+        //q = Gy product + ridge p, and p.q
+        parallelRanges(fit.numThreads, My, [&](int firstRow, int lastRow)
+        {
+            for(int a = firstRow; a < lastRow; ++a)
+            {
+                double pq = 0.0;
+                for(int c = 0; c < Mx; ++c)
+                {
+                    size_t i = (size_t)a * Mx + c;
+                    q[i] = gramTimes(basisY, a, &product[c], Mx) + ridge * p[i];
+                    pq += p[i] * q[i];
+                }
+                rowSumA[a] = pq;
+            }
+        });
+        double alpha = rz / sumRows(rowSumA);
+        //x += alpha p, r -= alpha q, z = r / diagonal
+        parallelRanges(fit.numThreads, My, [&](int firstRow, int lastRow)
+        {
+            for(int a = firstRow; a < lastRow; ++a)
+            {
+                double rr = 0.0, rzRow = 0.0;
+                for(size_t i = (size_t)a * Mx; i < (size_t)(a + 1) * Mx; ++i)
+                {
+                    x[i] += alpha * p[i];
+                    r[i] -= alpha * q[i];
+                    z[i] = r[i] * inverseDiagonal[i];
+                    rr += r[i] * r[i];
+                    rzRow += r[i] * z[i];
+                }
+                rowSumA[a] = rr;
+                rowSumB[a] = rzRow;
+            }
+        });
+        ++fit.iterations;
+        double rzNext = sumRows(rowSumB);
+        beta = rzNext / rz;
+        rz = rzNext;
+        fit.residual = std::sqrt(sumRows(rowSumA)) / rhsNorm;
+        fit.converged = fit.residual <= tolerance;
+    }
+    fit.solveSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - solveStart).count();
+    r = z = p = q = product = inverseDiagonal = std::vector<double>();
+
+    //Error at every pixel: the fitted row is blended from 4 coefficient rows, then each pixel from 4 coefficients
+    std::vector<double> rowMax(map.height);
+    std::vector<double> rowSquares(map.height);
+    parallelRanges(fit.numThreads, map.height, [&](int firstRow, int lastRow)
+    {
+        std::vector<double> fitted(Mx);
+        for(int row = firstRow; row < lastRow; ++row)
+        {
+            const double* wy = &basisY.weights[4 * (size_t)row];
+            const double* c0 = &x[(size_t)basisY.first[row] * Mx];
+            for(int c = 0; c < Mx; ++c)
+            {
+                fitted[c] = wy[0] * c0[c] + wy[1] * c0[Mx + c] + wy[2] * c0[2 * Mx + c] + wy[3] * c0[3 * Mx + c];
+            }
+            const float* heights = &map.values[(size_t)row * map.width];
+            double squares = 0.0, largest = 0.0;
+            for(int c = 0; c < map.width; ++c)
+            {
+                const double* w = &basisX.weights[4 * (size_t)c];
+                const double* f = &fitted[basisX.first[c]];
+                double error = w[0] * f[0] + w[1] * f[1] + w[2] * f[2] + w[3] * f[3] - (double)heights[c] * heightScale;
+                squares += error * error;
+                largest = std::max(largest, std::abs(error));
+            }
+            rowSquares[row] = squares;
+            rowMax[row] = largest;
+        }
+    });
+    fit.rmsError = std::sqrt(sumRows(rowSquares) / ((double)map.width * map.height));
+    fit.maxError = *std::max_element(rowMax.begin(), rowMax.end());
+
+    //Expand the coefficients into the Bezier points, 3N + 1 along each axis, then copy every
+    //patch's 4 x 4 block into the grid, neighbouring blocks repeat their shared seam points
+    int netWidth = 3 * fit.numPatchesX + 1;
+    int netHeight = 3 * fit.numPatchesY + 1;
+    std::vector<double> columnsExpanded((size_t)My * netWidth);
+    for(int a = 0; a < My; ++a)
+    {
+        for(int m = 0; m < netWidth; ++m)
+        {
+            columnsExpanded[(size_t)a * netWidth + m] = expandCoefficient(&x[(size_t)a * Mx], m, fit.numPatchesX, 1);
+        }
+    }
+    ControlGrid& grid = fit.grid;
+    grid.degreeU = grid.degreeV = 3;
+    grid.numPx = 4 * fit.numPatchesX;
+    grid.numPy = 4 * fit.numPatchesY;
+    grid.heights.resize((size_t)grid.numPx * grid.numPy);
+    for(int n = 0; n < netHeight; ++n)
+    {
+        for(int m = 0; m < netWidth; ++m)
+        {
+            float value = (float)expandCoefficient(&columnsExpanded[m], n, fit.numPatchesY, netWidth);
+            //A seam point belongs to the patches on both sides of it
+            for(int i = std::max(0, (n - 1) / 3); i <= std::min(fit.numPatchesY - 1, n / 3); ++i)
+            {
+                for(int j = std::max(0, (m - 1) / 3); j <= std::min(fit.numPatchesX - 1, m / 3); ++j)
+                {
+                    grid.heights[(size_t)(4 * i + n - 3 * i) * grid.numPx + 4 * j + m - 3 * j] = value;
+                }
+            }
+        }
+    }
+    fit.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return fit;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#ifndef HEIGHTMAP_FIT_H
+#define HEIGHTMAP_FIT_H
+
+#include <vector>
+
+#include "ControlGrid.h"
+
+
+//Dense height samples, row 0 at the top (v = 0 of the top patch row)
+struct Heightmap
+{
+    int width = 0;
+    int height = 0;
+    std::vector<float> values; //height rows of width, row major
+};
+
+/*
+    Reads a binary PGM (P5, 8 or 16 bits, scaled to [0, 1] by its maxval) or, for any other
+    extension, raw 32 bit floats in host byte order. A raw file is square unless rawWidth is given.
+    Returns false and prints the reason if the file can not be read.
+*/
+bool readHeightmap(const char* fileName, Heightmap& map, int rawWidth = 0);
+
+
+struct HeightmapFit
+{
+    ControlGrid grid; //Bicubic, 4 x 4 control points per patch
+    int numPatchesX;
+    int numPatchesY;
+    double rmsError; //Over every pixel of the heightmap, in height units
+    double maxError;
+    int iterations; //Conjugate gradient iterations
+    double residual; //Final residual of the normal equations relative to their right hand side
+    bool converged;
+    int numThreads;
+    double solveSeconds; //Conjugate gradient only
+    double seconds; //Assembly, solve, error and grid
+};
+
+/*
+    Least squares fit of bicubic patches that are C1 across every seam to a heightmap, with about
+    pixelsPerPatch pixels along each side of a patch. Pixel (r, c) is sampled at the center of its
+    cell, patches cover the map edge to edge, heights are multiplied by heightScale.
+    The C1 surfaces are the tensor product of the C1 cubic splines along each axis: the inner
+    control points of every patch are free and each seam point is the midpoint of its neighbours,
+    so a row of N patches has 2N + 2 unknowns. The normal equations are Gy C Gx = Ay^T H Ax with
+    banded 1D Gram matrices, and are solved by Jacobi preconditioned conjugate gradients that apply
+    the operator matrix free, one band of patch rows per thread (0 picks one per core).
+    Every reduction is summed in row order, so the grid does not depend on the thread count.
+*/
+HeightmapFit fitHeightmap(const Heightmap& map, int pixelsPerPatch, float heightScale = 1.0f,
+                          double tolerance = 1e-8, int maxIterations = 500, int numThreads = 0);
+
+#endif
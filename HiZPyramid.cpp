@@ -0,0 +1,229 @@
+#include "HiZPyramid.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include "GlAccounting.h"
+
+
+//The CPU test reads the level where the box spans fewer texels than this
+static const int CPU_TEST_TEXELS = 8;
+
+
+HiZPyramid::HiZPyramid()
+    : width(0), height(0), numLevels(0), built(false), firstReadLevel(0)
+{
+    reduceShader.reset(new Shader("Shaders/hiz/hiz.vert", "Shaders/hiz/hiz.frag"));
+    glGenVertexArrays(1, &emptyVAO);
+    glGenFramebuffers(1, &sceneFBO);
+    glGenFramebuffers(1, &levelFBO);
+    glGenRenderbuffers(1, &colorBuffer);
+    glGenTextures(1, &depthTexture);
+    //Only the depth of the levels is written
+    glBindFramebuffer(GL_FRAMEBUFFER, levelFBO);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+
+HiZPyramid::~HiZPyramid()
+{
+    glDeleteVertexArrays(1, &emptyVAO);
+    glDeleteFramebuffers(1, &sceneFBO);
+    glDeleteFramebuffers(1, &levelFBO);
+    glDeleteRenderbuffers(1, &colorBuffer);
+    glDeleteTextures(1, &depthTexture);
+}
+
+
+void HiZPyramid::begin(int w, int h)
+{
+    if(w != width || h != height)
+    {
+        width = std::max(w, 1);
+        height = std::max(h, 1);
+        //Levels halve (rounding down) until both sides are 1
+        numLevels = 1 + (int)std::floor(std::log2((double)std::max(width, height)));
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        for(int level = 0; level < numLevels; ++level)
+        {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_DEPTH_COMPONENT32F, std::max(width >> level, 1), std::max(height >> level, 1),
+                         0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cout << "Hi-Z framebuffer of " << width << "x" << height << " is incomplete" << std::endl;
+        }
+
+        firstReadLevel = 0;
+        while(firstReadLevel < numLevels - 1 && std::max(width >> firstReadLevel, height >> firstReadLevel) > READ_BACK_SIZE)
+        {
+            ++firstReadLevel;
+        }
+        levels.assign(numLevels, std::vector<float>());
+    }
+    built = false;
+    glc::bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+    glViewport(0, 0, width, height);
+}
+
+
+void HiZPyramid::build()
+{
+    //Until the shader is built every box passes
+    if(!reduceShader->isReady())
+    {
+        return;
+    }
+    reduceShader->use();
+    reduceShader->setInt("sourceDepth", TEXTURE_UNIT);
+    glc::activeTexture(GL_TEXTURE0 + TEXTURE_UNIT);
+    glc::bindTexture(GL_TEXTURE_2D, depthTexture);
+    glc::bindFramebuffer(GL_FRAMEBUFFER, levelFBO);
+    glc::bindVertexArray(emptyVAO);
+    //Depth is only written with the test on, every texel of a level is written once
+    glDepthFunc(GL_ALWAYS);
+    for(int level = 1; level < numLevels; ++level)
+    {
+        //Sampling is limited to the level above, so the level being written is not read
+        glc::texParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+        glc::texParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+        glc::framebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, level);
+        glViewport(0, 0, std::max(width >> level, 1), std::max(height >> level, 1));
+        glc::drawArrays(GL_TRIANGLES, 0, 3);
+    }
+    glDepthFunc(GL_LESS);
+    glc::texParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glc::texParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+    glc::bindVertexArray(0);
+    glc::activeTexture(GL_TEXTURE0);
+    glc::bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+    glViewport(0, 0, width, height);
+    built = true;
+}
+
+
+void HiZPyramid::readBack()
+{
+    if(!built)
+    {
+        return;
+    }
+    glc::bindFramebuffer(GL_FRAMEBUFFER, levelFBO);
+    for(int level = firstReadLevel; level < numLevels; ++level)
+    {
+        int w = std::max(width >> level, 1);
+        int h = std::max(height >> level, 1);
+        levels[level].resize((size_t)w * h);
+        glc::framebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, level);
+        glReadPixels(0, 0, w, h, GL_DEPTH_COMPONENT, GL_FLOAT, levels[level].data());
+    }
+    glc::bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+}
+
+
+Occlusion HiZPyramid::test(const glm::vec3& minCorner, const glm::vec3& maxCorner, const glm::mat4& sceneToClip) const
+{
+    glm::vec3 ndcMin(1e30f), ndcMax(-1e30f);
+    for(int k = 0; k < 8; ++k)
+    {
+        glm::vec3 corner((k & 1) ? maxCorner.x : minCorner.x, (k & 2) ? maxCorner.y : minCorner.y, (k & 4) ? maxCorner.z : minCorner.z);
+        glm::vec4 clip = sceneToClip * glm::vec4(corner, 1.0f);
+        if(clip.w <= 1e-5f)
+        {
+            //Reaches behind the eye, the rectangle is unbounded
+            return Occlusion::VISIBLE;
+        }
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+    if(ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f || ndcMax.z < -1.0f || ndcMin.z > 1.0f)
+    {
+        return Occlusion::OUTSIDE;
+    }
+    if(ndcMin.z < -1.0f || !built || levels[firstReadLevel].empty())
+    {
+        return Occlusion::VISIBLE;
+    }
+
+    //Pixels under the box, then the level where they span at most 9x9 texels. Finer than the
+    //2x2 of cull.comp, a loop over a few more texels is cheap on the CPU and culls more.
+    int x0 = std::clamp((int)((ndcMin.x * 0.5f + 0.5f) * width), 0, width - 1);
+    int x1 = std::clamp((int)((ndcMax.x * 0.5f + 0.5f) * width), 0, width - 1);
+    int y0 = std::clamp((int)((ndcMin.y * 0.5f + 0.5f) * height), 0, height - 1);
+    int y1 = std::clamp((int)((ndcMax.y * 0.5f + 0.5f) * height), 0, height - 1);
+    int span = std::max(x1 - x0, y1 - y0) + 1;
+    int level = firstReadLevel;
+    while(level < numLevels - 1 && (span >> level) >= CPU_TEST_TEXELS)
+    {
+        ++level;
+    }
+    int w = std::max(width >> level, 1);
+    int h = std::max(height >> level, 1);
+    const std::vector<float>& depth = levels[level];
+    float farthest = 0.0f;
+    for(int y = std::min(y0 >> level, h - 1); y <= std::min(y1 >> level, h - 1); ++y)
+    {
+        for(int x = std::min(x0 >> level, w - 1); x <= std::min(x1 >> level, w - 1); ++x)
+        {
+            farthest = std::max(farthest, depth[(size_t)y * w + x]);
+        }
+    }
+    return ndcMin.z * 0.5f + 0.5f > farthest ? Occlusion::OCCLUDED : Occlusion::VISIBLE;
+}
+
+
+void HiZPyramid::present()
+{
+    glc::bindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+    glc::bindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glc::blitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glc::bindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+
+bool HiZPyramid::isBuilt() const
+{
+    return built;
+}
+
+
+GLuint HiZPyramid::getDepthTexture() const
+{
+    return depthTexture;
+}
+
+
+int HiZPyramid::getWidth() const
+{
+    return width;
+}
+
+
+int HiZPyramid::getHeight() const
+{
+    return height;
+}
+
+
+int HiZPyramid::getNumLevels() const
+{
+    return numLevels;
+}
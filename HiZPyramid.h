@@ -0,0 +1,78 @@
+#pragma once
+#ifndef HIZ_PYRAMID_H
+#define HIZ_PYRAMID_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <memory>
+
+#include "Shader.h"
+
+
+//Result of testing a box against the pyramid
+enum class Occlusion
+{
+    VISIBLE,
+    OCCLUDED, //In the view but behind the depth drawn so far
+    OUTSIDE //Outside the view frustum
+};
+
+
+/*
+    Hierarchical Z buffer for occlusion culling. While it is in use the frame is drawn into its
+    framebuffer (a colour renderbuffer and a mipmapped depth texture) and copied to the window at
+    the end. build() reduces the depth drawn so far level by level, every texel keeping the
+    farthest depth of the 2x2 below it, so texel (x >> L, y >> L) of level L bounds the depth
+    of pixel (x, y). A box whose nearest depth is behind that bound over its whole screen
+    rectangle is hidden; a few texels of the level the rectangle fits in are enough to tell.
+    cull.comp samples the pyramid on the GPU. The CPU fallback reads the levels from about
+    READ_BACK_SIZE texels across down with readBack() and tests boxes with test().
+*/
+class HiZPyramid
+{
+public:
+    //Unit the pyramid is sampled from, clear of the control grid (0, 1) and the analysis (2)
+    static constexpr int TEXTURE_UNIT = 3;
+
+    HiZPyramid();
+    ~HiZPyramid();
+
+    //Binds the framebuffer for the frame, reallocating it when the window size changed
+    void begin(int width, int height);
+    //Builds the pyramid from the depth drawn so far and binds the framebuffer again for more drawing
+    void build();
+    //CPU fallback: reads the coarse levels back. Waits for the GPU to finish the depth.
+    void readBack();
+    //Tests a box of the frame sceneToClip maps to clip space against the levels read back
+    Occlusion test(const glm::vec3& minCorner, const glm::vec3& maxCorner, const glm::mat4& sceneToClip) const;
+    //Copies the colour to the window's framebuffer and binds that again
+    void present();
+
+    //True once build() made the levels of this frame
+    bool isBuilt() const;
+    GLuint getDepthTexture() const;
+    int getWidth() const;
+    int getHeight() const;
+    int getNumLevels() const;
+
+private:
+    static constexpr int READ_BACK_SIZE = 128;
+
+    std::unique_ptr<Shader> reduceShader;
+    GLuint emptyVAO;
+    GLuint sceneFBO; //Colour and depth level 0
+    GLuint levelFBO; //Depth only, one level at a time
+    GLuint colorBuffer;
+    GLuint depthTexture;
+    int width;
+    int height;
+    int numLevels;
+    bool built;
+    //CPU copy of the levels from firstReadLevel on, the finer ones stay empty
+    int firstReadLevel;
+    std::vector<std::vector<float>> levels;
+};
+
+#endif
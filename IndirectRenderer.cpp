@@ -0,0 +1,231 @@
+#include "IndirectRenderer.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "GlAccounting.h"
+
+
+//Instanced attributes of one patch, locations 1 and 2 of bezier.vert's INDIRECT variant
+struct PatchRecord
+{
+    GLint gridOffset;
+    glm::vec3 translation;
+};
+
+//std430 layouts of cull.comp
+struct PatchBounds
+{
+    glm::vec4 minCorner;
+    glm::vec4 maxCorner;
+};
+
+struct LevelRecord
+{
+    GLuint count;
+    GLuint firstIndex;
+    GLuint baseVertex;
+    GLuint samples;
+};
+
+static const int DRAW_COMMAND_SIZE = 5 * sizeof(GLuint);
+static const int NUM_COUNTERS = 2; //numVisible and numOccluded, before the levels
+
+
+bool IndirectRenderer::isSupported()
+{
+    return GLEW_VERSION_4_3;
+}
+
+
+IndirectRenderer::IndirectRenderer()
+    : indexType(GL_UNSIGNED_SHORT), numPatches(0), patchScaling(1.0f)
+{
+    cullShader.reset(new Shader("Shaders/bezier/cull.comp", nullptr));
+    glGenVertexArrays(1, &meshVAO);
+    glGenBuffers(1, &meshVBO);
+    glGenBuffers(1, &meshEBO);
+    glGenBuffers(1, &levelBuffer);
+    glGenBuffers(1, &recordBuffer);
+    glGenBuffers(1, &boundsBuffer);
+    glGenBuffers(1, &commandBuffer);
+    glGenBuffers(1, &counterBuffer);
+    glGenBuffers(1, &visibilityBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, (NUM_COUNTERS + MAX_LODS) * sizeof(GLuint), nullptr, GL_DYNAMIC_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    //The attributes stay pointed at these buffers, refilling them keeps the VAO valid
+    glBindVertexArray(meshVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, meshVBO);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(glm::u16vec2), (void*)0);
+    glBindBuffer(GL_ARRAY_BUFFER, recordBuffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribIPointer(1, 1, GL_INT, sizeof(PatchRecord), (void*)offsetof(PatchRecord, gridOffset));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(PatchRecord), (void*)offsetof(PatchRecord, translation));
+    glVertexAttribDivisor(2, 1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshEBO);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+
+IndirectRenderer::~IndirectRenderer()
+{
+    glDeleteVertexArrays(1, &meshVAO);
+    GLuint buffers[] = { meshVBO, meshEBO, levelBuffer, recordBuffer, boundsBuffer, commandBuffer, counterBuffer, visibilityBuffer };
+    glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+}
+
+
+void IndirectRenderer::setPatches(const ControlGrid& grid, const std::vector<BezierSurface>& surfaces)
+{
+    numPatches = (int)surfaces.size();
+    std::vector<PatchRecord> records(numPatches);
+    std::vector<PatchBounds> bounds(numPatches);
+    for(int p = 0; p < numPatches; ++p)
+    {
+        const BezierSurface& surf = surfaces[p];
+        records[p] = { surf.gridOffset, surf.translation };
+        glm::vec3 minCorner, maxCorner;
+        patchBounds(grid, surf, minCorner, maxCorner);
+        bounds[p] = { glm::vec4(minCorner, 1.0f), glm::vec4(maxCorner, 1.0f) };
+    }
+    if(numPatches > 0)
+    {
+        patchScaling = surfaces[0].scaling;
+    }
+
+    glc::bindBuffer(GL_ARRAY_BUFFER, recordBuffer);
+    glc::bufferData(GL_ARRAY_BUFFER, sizeof(PatchRecord) * records.size(), records.data(), GL_STATIC_DRAW);
+    glc::bindBuffer(GL_ARRAY_BUFFER, 0);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+    glc::bufferData(GL_SHADER_STORAGE_BUFFER, sizeof(PatchBounds) * bounds.size(), bounds.data(), GL_STATIC_DRAW);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glc::bufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)DRAW_COMMAND_SIZE * numPatches, nullptr, GL_DYNAMIC_COPY);
+    //A new layout starts with every patch visible, the late pass sorts them out in the first frame
+    std::vector<GLuint> visible(numPatches, 1);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, visibilityBuffer);
+    glc::bufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * visible.size(), visible.data(), GL_DYNAMIC_COPY);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void IndirectRenderer::setLevels(int finestSamples)
+{
+    levelSamples = sampleLadder(finestSamples, MAX_LODS);
+
+    std::vector<glm::u16vec2> allUV;
+    std::vector<uint32_t> allIndices;
+    std::vector<LevelRecord> levels;
+    std::vector<glm::u16vec2> uv;
+    std::vector<uint32_t> indices;
+    for(int samples : levelSamples)
+    {
+        buildSampleMesh(samples, uv, indices, false);
+        levels.push_back({ (GLuint)indices.size(), (GLuint)allIndices.size(), (GLuint)allUV.size(), (GLuint)samples });
+        allUV.insert(allUV.end(), uv.begin(), uv.end());
+        allIndices.insert(allIndices.end(), indices.begin(), indices.end());
+    }
+
+    glc::bindBuffer(GL_ARRAY_BUFFER, meshVBO);
+    glc::bufferData(GL_ARRAY_BUFFER, sizeof(glm::u16vec2) * allUV.size(), allUV.data(), GL_STATIC_DRAW);
+    glc::bindBuffer(GL_ARRAY_BUFFER, 0);
+    //Indices are relative to each level's baseVertex, so 16 bits hold any level the W key reaches
+    glc::bindVertexArray(meshVAO);
+    if(finestSamples * finestSamples <= 65536)
+    {
+        std::vector<GLushort> shortIndices(allIndices.begin(), allIndices.end());
+        glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * shortIndices.size(), shortIndices.data(), GL_STATIC_DRAW);
+        indexType = GL_UNSIGNED_SHORT;
+    }
+    else
+    {
+        glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * allIndices.size(), allIndices.data(), GL_STATIC_DRAW);
+        indexType = GL_UNSIGNED_INT;
+    }
+    glc::bindVertexArray(0);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, levelBuffer);
+    glc::bufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LevelRecord) * levels.size(), levels.data(), GL_STATIC_DRAW);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void IndirectRenderer::draw(Shader& shader, const glm::mat4& PV, const glm::mat4& sceneRotation, const glm::vec3& eye,
+                            float fovY, int viewportHeight, CullPass pass, const HiZPyramid* hiZ)
+{
+    if(numPatches == 0 || levelSamples.empty() || !cullShader->isReady())
+    {
+        return;
+    }
+
+    //Cull and pick the levels
+    cullShader->use();
+    cullShader->setMat4("sceneToClip", PV * sceneRotation);
+    cullShader->setVec3("eyeScene", glm::vec3(glm::inverse(sceneRotation) * glm::vec4(eye, 1.0f)));
+    cullShader->setInt("numPatches", numPatches);
+    cullShader->setInt("numLevels", (int)levelSamples.size());
+    cullShader->setFloat("pixelsPerUnit", viewportHeight / (2.0f * std::tan(glm::radians(fovY) * 0.5f)));
+    cullShader->setFloat("pixelsPerSample", PIXELS_PER_SAMPLE);
+    cullShader->setInt("cullPass", (int)pass);
+    bool hasHiZ = pass == CullPass::LATE && hiZ != nullptr && hiZ->isBuilt();
+    cullShader->setBool("hasHiZ", hasHiZ);
+    cullShader->setInt("hiZ", HiZPyramid::TEXTURE_UNIT);
+    if(hasHiZ)
+    {
+        cullShader->setVec2("viewportSize", (float)hiZ->getWidth(), (float)hiZ->getHeight());
+        glc::activeTexture(GL_TEXTURE0 + HiZPyramid::TEXTURE_UNIT);
+        glc::bindTexture(GL_TEXTURE_2D, hiZ->getDepthTexture());
+        glc::activeTexture(GL_TEXTURE0);
+    }
+    //The late pass adds to the counters of the early one
+    if(pass != CullPass::LATE)
+    {
+        GLuint zeros[NUM_COUNTERS + MAX_LODS] = {};
+        glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+        glc::bufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zeros), zeros);
+        glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    glc::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, boundsBuffer);
+    glc::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+    glc::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, levelBuffer);
+    glc::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, counterBuffer);
+    glc::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, visibilityBuffer);
+    glc::dispatchCompute((numPatches + 63) / 64, 1, 1);
+    //The commands are read by the draw below, the visibility by the next early pass
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    //Every patch in one call
+    shader.use();
+    shader.setMat4("sceneMat", sceneRotation);
+    shader.setVec3("patchScaling", patchScaling);
+    glc::bindVertexArray(meshVAO);
+    glc::bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glc::multiDrawElementsIndirect(GL_TRIANGLES, indexType, nullptr, numPatches, 0);
+    glc::bindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glc::bindVertexArray(0);
+}
+
+
+IndirectStats IndirectRenderer::readStats()
+{
+    IndirectStats stats;
+    stats.numPatches = numPatches;
+    stats.levelSamples = levelSamples;
+    GLuint counters[NUM_COUNTERS + MAX_LODS] = {};
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+    glc::bindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    stats.numVisible = (int)counters[0];
+    stats.numOccluded = (int)counters[1];
+    stats.numPerLevel.assign(counters + NUM_COUNTERS, counters + NUM_COUNTERS + levelSamples.size());
+    return stats;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#ifndef INDIRECT_RENDERER_H
+#define INDIRECT_RENDERER_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <memory>
+
+#include "BezierSurface.h"
+#include "Shader.h"
+#include "HiZPyramid.h"
+
+
+struct IndirectStats
+{
+    int numPatches;
+    int numVisible;
+    int numOccluded; //In the view but hidden, 0 without occlusion culling
+    std::vector<int> numPerLevel; //Visible patches drawn at each level, finest first
+    std::vector<int> levelSamples;
+};
+
+
+/*
+    GPU driven drawing of all patches. A compute pass (cull.comp) frustum tests the control point
+    bounds of every patch, picks a sample mesh level from its projected size and writes one
+    DrawElementsIndirectCommand per patch, then the whole scene is a single
+    glMultiDrawElementsIndirect. The CPU cost per frame does not depend on the number of patches.
+    The levels' sample meshes share one vertex and one index buffer, and each draw takes its
+    patch's grid offset and translation as instanced attributes (through baseInstance).
+    With occlusion culling a frame draws twice: CullPass::EARLY draws the patches visible in the
+    last frame, the caller builds the Hi-Z pyramid of that depth, and CullPass::LATE tests every
+    patch against it and draws the visible ones that were not drawn yet. Patches that come into
+    view from behind others are drawn in the frame they appear in, not one later.
+    Needs GL 4.3 (compute shaders and multi draw indirect).
+*/
+enum class CullPass
+{
+    ALL, //Frustum culling only
+    EARLY,
+    LATE
+};
+
+class IndirectRenderer
+{
+public:
+    static bool isSupported();
+
+    IndirectRenderer();
+    ~IndirectRenderer();
+
+    //Patch records and bounds, again whenever the scene or its layout changes
+    void setPatches(const ControlGrid& grid, const std::vector<BezierSurface>& surfaces);
+    //Sample meshes of the levels: finestSamples per side, then about half as many each level
+    void setLevels(int finestSamples);
+    /*
+        Culls and draws every patch. shader is the INDIRECT variant of bezier.vert, in use, with
+        its lighting, grid and PV uniforms set. sceneRotation is the rotation applied to the
+        whole scene, PV * sceneRotation is what the patches are culled against. The late pass
+        needs hiZ, built from the depth of the early one.
+    */
+    void draw(Shader& shader, const glm::mat4& PV, const glm::mat4& sceneRotation, const glm::vec3& eye,
+              float fovY, int viewportHeight, CullPass pass = CullPass::ALL, const HiZPyramid* hiZ = nullptr);
+    //Reads the counters of the last draw back. This waits for the GPU, so call it rarely.
+    IndirectStats readStats();
+
+private:
+    static constexpr int MAX_LODS = 6; //As in cull.comp
+    static constexpr float PIXELS_PER_SAMPLE = 8.0f;
+
+    std::unique_ptr<Shader> cullShader;
+    //Sample meshes of every level
+    GLuint meshVAO;
+    GLuint meshVBO;
+    GLuint meshEBO;
+    GLenum indexType;
+    std::vector<int> levelSamples;
+    GLuint levelBuffer;
+    //Per patch
+    GLuint recordBuffer; //gridOffset and translation, instanced attributes
+    GLuint boundsBuffer;
+    GLuint commandBuffer;
+    GLuint counterBuffer;
+    GLuint visibilityBuffer; //Written by the late pass, read by the next early pass
+    int numPatches;
+    glm::vec3 patchScaling;
+};
+
+#endif
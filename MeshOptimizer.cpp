@@ -0,0 +1,220 @@
+#include "MeshOptimizer.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+//Scoring from Forsyth's paper
+static const float CACHE_DECAY_POWER = 1.5f;
+static const float LAST_TRIANGLE_SCORE = 0.75f;
+static const float VALENCE_BOOST_SCALE = 2.0f;
+static const float VALENCE_BOOST_POWER = 0.5f;
+
+
+struct OptimizerVertex
+{
+    int cachePosition = -1; //-1 if not in the cache
+    int remainingTriangles = 0; //Triangles not emitted yet that use the vertex
+    int firstTriangle = 0; //Into the adjacency array
+    float score = 0.0f;
+};
+
+
+static float vertexScore(const OptimizerVertex& vertex)
+{
+    if(vertex.remainingTriangles == 0)
+    {
+        return -1.0f;
+    }
+    float score = 0.0f;
+    if(vertex.cachePosition >= 0)
+    {
+        if(vertex.cachePosition < 3)
+        {
+            //Used by the last triangle. A fixed score, otherwise the optimiser would keep
+            //emitting strips that only ever share the two newest vertices.
+            score = LAST_TRIANGLE_SCORE;
+        }
+        else
+        {
+            float scale = 1.0f / (VERTEX_CACHE_SIZE - 3);
+            score = std::pow(1.0f - (vertex.cachePosition - 3) * scale, CACHE_DECAY_POWER);
+        }
+    }
+    //Finish off vertices with few triangles left, lone vertices are expensive to come back to
+    score += VALENCE_BOOST_SCALE * std::pow((float)vertex.remainingTriangles, -VALENCE_BOOST_POWER);
+    return score;
+}
+
+
+std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, int numVertices)
+{
+    int numTriangles = (int)indices.size() / 3;
+    std::vector<OptimizerVertex> vertices(numVertices);
+    for(uint32_t index : indices)
+    {
+        vertices[index].remainingTriangles++;
+    }
+    //Triangles of every vertex, packed
+    int offset = 0;
+    for(OptimizerVertex& vertex : vertices)
+    {
+        vertex.firstTriangle = offset;
+        offset += vertex.remainingTriangles;
+    }
+    std::vector<int> adjacency(indices.size());
+    std::vector<int> filled(numVertices, 0);
+    for(int t = 0; t < numTriangles; ++t)
+    {
+        for(int k = 0; k < 3; ++k)
+        {
+            uint32_t index = indices[3*t + k];
+            adjacency[vertices[index].firstTriangle + filled[index]++] = t;
+        }
+    }
+    for(OptimizerVertex& vertex : vertices)
+    {
+        vertex.score = vertexScore(vertex);
+    }
+    std::vector<float> triangleScores(numTriangles);
+    for(int t = 0; t < numTriangles; ++t)
+    {
+        triangleScores[t] = vertices[indices[3*t]].score + vertices[indices[3*t + 1]].score + vertices[indices[3*t + 2]].score;
+    }
+
+    std::vector<char> emitted(numTriangles, 0);
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    //LRU cache of vertex indices with room for the three a triangle pushes in
+    std::vector<uint32_t> cache;
+    cache.reserve(VERTEX_CACHE_SIZE + 3);
+    std::vector<uint32_t> newCache;
+    newCache.reserve(VERTEX_CACHE_SIZE + 3);
+    int bestTriangle = -1;
+    int scanStart = 0; //Triangles before this are all emitted
+    for(int emittedCount = 0; emittedCount < numTriangles; ++emittedCount)
+    {
+        //Nothing in the cache is worth continuing with, take the best of the rest
+        if(bestTriangle < 0)
+        {
+            float bestScore = -1.0f;
+            while(scanStart < numTriangles && emitted[scanStart])
+            {
+                scanStart++;
+            }
+            for(int t = scanStart; t < numTriangles; ++t)
+            {
+                if(!emitted[t] && triangleScores[t] > bestScore)
+                {
+                    bestScore = triangleScores[t];
+                    bestTriangle = t;
+                }
+            }
+        }
+
+        //Emit it and drop it from its vertices' lists
+        emitted[bestTriangle] = 1;
+        newCache.clear();
+        for(int k = 0; k < 3; ++k)
+        {
+            uint32_t index = indices[3*bestTriangle + k];
+            result.push_back(index);
+            newCache.push_back(index);
+            OptimizerVertex& vertex = vertices[index];
+            int* first = &adjacency[vertex.firstTriangle];
+            int* last = first + vertex.remainingTriangles;
+            std::iter_swap(std::find(first, last, bestTriangle), last - 1);
+            vertex.remainingTriangles--;
+        }
+        //Its vertices move to the front of the cache
+        for(uint32_t index : cache)
+        {
+            if(index != newCache[0] && index != newCache[1] && index != newCache[2])
+            {
+                newCache.push_back(index);
+            }
+        }
+        for(size_t c = VERTEX_CACHE_SIZE; c < newCache.size(); ++c)
+        {
+            OptimizerVertex& vertex = vertices[newCache[c]];
+            vertex.cachePosition = -1;
+            vertex.score = vertexScore(vertex);
+        }
+        newCache.resize(std::min(newCache.size(), (size_t)VERTEX_CACHE_SIZE));
+        cache.swap(newCache);
+
+        //Rescore what is in the cache and pick the next triangle among theirs
+        for(size_t c = 0; c < cache.size(); ++c)
+        {
+            OptimizerVertex& vertex = vertices[cache[c]];
+            vertex.cachePosition = (int)c;
+            vertex.score = vertexScore(vertex);
+        }
+        float bestScore = -1.0f;
+        bestTriangle = -1;
+        for(uint32_t index : cache)
+        {
+            const OptimizerVertex& vertex = vertices[index];
+            for(int a = 0; a < vertex.remainingTriangles; ++a)
+            {
+                int t = adjacency[vertex.firstTriangle + a];
+                float score = vertices[indices[3*t]].score + vertices[indices[3*t + 1]].score + vertices[indices[3*t + 2]].score;
+                triangleScores[t] = score;
+                if(score > bestScore)
+                {
+                    bestScore = score;
+                    bestTriangle = t;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+
+std::vector<uint32_t> optimizeVertexFetch(std::vector<uint32_t>& indices, int numVertices)
+{
+    const uint32_t UNUSED = 0xFFFFFFFFu;
+    std::vector<uint32_t> remap(numVertices, UNUSED);
+    uint32_t next = 0;
+    for(uint32_t& index : indices)
+    {
+        if(remap[index] == UNUSED)
+        {
+            remap[index] = next++;
+        }
+        index = remap[index];
+    }
+    //Unreferenced vertices go to the end
+    for(uint32_t& r : remap)
+    {
+        if(r == UNUSED)
+        {
+            r = next++;
+        }
+    }
+    return remap;
+}
+
+
+float averageCacheMissRatio(const std::vector<uint32_t>& indices, int cacheSize)
+{
+    if(indices.empty())
+    {
+        return 0.0f;
+    }
+    //FIFO like the fixed function caches ACMR figures are usually quoted for
+    std::vector<uint32_t> fifo(cacheSize, 0xFFFFFFFFu);
+    int head = 0;
+    int misses = 0;
+    for(uint32_t index : indices)
+    {
+        if(std::find(fifo.begin(), fifo.end(), index) == fifo.end())
+        {
+            fifo[head] = index;
+            head = (head + 1) % cacheSize;
+            misses++;
+        }
+    }
+    return misses / (indices.size() / 3.0f);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <vector>
+#include <cstdint>
+
+
+//Size of the post transform vertex cache the optimiser targets and the ACMR is measured with
+constexpr int VERTEX_CACHE_SIZE = 32;
+
+
+/*
+    Reorders the triangles of an indexed triangle list so that consecutive triangles reuse the
+    vertices the GPU has just shaded (Forsyth's linear speed vertex cache optimisation).
+    Every vertex that is shaded again costs a full patch evaluation in bezier.vert.
+*/
+std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, int numVertices);
+
+/*
+    Renumbers the vertices in the order the triangles first use them, so vertex fetches
+    walk through memory. remap[old] = new; vertex arrays have to be permuted with it.
+*/
+std::vector<uint32_t> optimizeVertexFetch(std::vector<uint32_t>& indices, int numVertices);
+
+//Average cache miss ratio: vertices shaded per triangle with a FIFO cache of the given size
+float averageCacheMissRatio(const std::vector<uint32_t>& indices, int cacheSize = VERTEX_CACHE_SIZE);
+
+#endif
@@ -0,0 +1,249 @@
+#include "ProgressiveRenderer.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+
+#include "BezierSurface.h"
+#include "GlAccounting.h"
+
+
+//Budget of the first frames, until there are measured ones
+static const double INITIAL_VERTEX_BUDGET = 262144.0;
+
+
+ProgressiveRenderer::ProgressiveRenderer(double budgetMs)
+    : shown(0), hasImage(false), width(0), height(0), budgetSeconds(budgetMs / 1000.0), vertexBudget(INITIAL_VERTEX_BUDGET),
+      stepVertices(0), stale(true), numPatches(0), shownLevel(-1), refineLevel(-1), nextPatch(0)
+{
+    glGenVertexArrays(1, &levelVAO);
+    glGenBuffers(1, &levelVBO);
+    glGenBuffers(1, &levelEBO);
+    glGenFramebuffers(2, framebuffers);
+    glGenRenderbuffers(2, colorBuffers);
+    glGenRenderbuffers(2, depthBuffers);
+}
+
+
+ProgressiveRenderer::~ProgressiveRenderer()
+{
+    glDeleteVertexArrays(1, &levelVAO);
+    glDeleteBuffers(1, &levelVBO);
+    glDeleteBuffers(1, &levelEBO);
+    glDeleteFramebuffers(2, framebuffers);
+    glDeleteRenderbuffers(2, colorBuffers);
+    glDeleteRenderbuffers(2, depthBuffers);
+}
+
+
+void ProgressiveRenderer::setLevels(int finestSamples)
+{
+    levelSamples = sampleLadder(finestSamples, MAX_LEVELS);
+    levelIndexCount.assign(1, 0);
+    levelFirstIndex.assign(1, 0);
+
+    //Level 1 has at most 40 x 40 samples for the 80 the W key reaches, so every level above 0
+    //fits 16 bit indices together
+    std::vector<glm::u16vec2> allUV;
+    std::vector<GLushort> allIndices;
+    std::vector<glm::u16vec2> uv;
+    std::vector<uint32_t> indices;
+    for(size_t l = 1; l < levelSamples.size(); ++l)
+    {
+        buildSampleMesh(levelSamples[l], uv, indices, false);
+        levelIndexCount.push_back((GLsizei)indices.size());
+        levelFirstIndex.push_back(allIndices.size());
+        for(uint32_t index : indices)
+        {
+            allIndices.push_back((GLushort)(allUV.size() + index));
+        }
+        allUV.insert(allUV.end(), uv.begin(), uv.end());
+    }
+
+    glc::bindVertexArray(levelVAO);
+    glc::bindBuffer(GL_ARRAY_BUFFER, levelVBO);
+    glc::bufferData(GL_ARRAY_BUFFER, sizeof(glm::u16vec2) * allUV.size(), allUV.data(), GL_STATIC_DRAW);
+    glc::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, levelEBO);
+    glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * allIndices.size(), allIndices.data(), GL_STATIC_DRAW);
+    //UV as in the sample mesh, location 0 of bezier.vert
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(glm::u16vec2), (void*)0);
+    glc::bindVertexArray(0);
+    glc::bindBuffer(GL_ARRAY_BUFFER, 0);
+    glc::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    stale = true;
+}
+
+
+void ProgressiveRenderer::invalidate()
+{
+    stale = true;
+}
+
+
+void ProgressiveRenderer::resize(int w, int h)
+{
+    width = std::max(w, 1);
+    height = std::max(h, 1);
+    for(int k = 0; k < 2; ++k)
+    {
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffers[k]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffers[k]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[k]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffers[k]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffers[k]);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cout << "Progressive refinement framebuffer of " << width << "x" << height << " is incomplete" << std::endl;
+        }
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    hasImage = false;
+    stale = true;
+}
+
+
+long long ProgressiveRenderer::levelVertices(int level) const
+{
+    return (long long)levelSamples[level] * levelSamples[level];
+}
+
+
+ProgressiveStep ProgressiveRenderer::begin(int w, int h, int patches, bool moving)
+{
+    if(w != width || h != height)
+    {
+        resize(w, h);
+    }
+    if(patches != numPatches)
+    {
+        numPatches = patches;
+        stale = true;
+    }
+    ProgressiveStep step = { 0, 0, 0, false };
+    if(levelSamples.empty() || numPatches == 0)
+    {
+        hasImage = false;
+        stale = false;
+        refineLevel = -1;
+        stepVertices = 0;
+        return step;
+    }
+
+    if(moving || stale)
+    {
+        //A complete frame at the finest level that fits, the coarsest if none does
+        int level = 0;
+        while(level + 1 < (int)levelSamples.size() && numPatches * levelVertices(level) > vertexBudget)
+        {
+            ++level;
+        }
+        step = { level, 0, numPatches, moving };
+        stale = false;
+    }
+    else if(refineLevel >= 0)
+    {
+        //At least one patch, so a budget below one patch of the level still gets there
+        long long count = std::max((long long)(vertexBudget / levelVertices(refineLevel)), 1LL);
+        step = { refineLevel, nextPatch, (int)std::min(count, (long long)(numPatches - nextPatch)), false };
+    }
+    stepVertices = step.numPatches * levelVertices(step.level);
+
+    if(step.numPatches > 0)
+    {
+        glc::bindFramebuffer(GL_FRAMEBUFFER, framebuffers[1 - shown]);
+        glViewport(0, 0, width, height);
+        if(step.firstPatch == 0)
+        {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        }
+    }
+    return step;
+}
+
+
+void ProgressiveRenderer::drawLevel(int level)
+{
+    glc::bindVertexArray(levelVAO);
+    glc::drawElements(GL_TRIANGLES, levelIndexCount[level], GL_UNSIGNED_SHORT, (void*)(levelFirstIndex[level] * sizeof(GLushort)));
+}
+
+
+void ProgressiveRenderer::present(const ProgressiveStep& step)
+{
+    if(step.numPatches > 0)
+    {
+        nextPatch = step.firstPatch + step.numPatches;
+        if(nextPatch >= numPatches)
+        {
+            //Complete, it goes on screen. A cheaply shaded level is drawn again, a fully shaded one refines.
+            shown = 1 - shown;
+            hasImage = true;
+            shownLevel = step.level;
+            refineLevel = step.reducedShading ? step.level : step.level - 1;
+            nextPatch = 0;
+        }
+    }
+    if(hasImage)
+    {
+        glc::bindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[shown]);
+        glc::bindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glc::blitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+    glc::bindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, width, height);
+}
+
+
+void ProgressiveRenderer::frameTime(double seconds)
+{
+    if(stepVertices <= 0 || seconds <= 0.0)
+    {
+        return;
+    }
+    //Vertices a frame of the budget could have drawn at the rate of this one. The last step of a
+    //level is often far below the budget, it only says something when it was over.
+    double estimate = stepVertices * budgetSeconds / seconds;
+    if(estimate < vertexBudget || stepVertices >= vertexBudget * 0.5)
+    {
+        //Damped, a single slow frame (a shader compiling, the window moving) does not wreck the budget
+        vertexBudget = std::max(std::clamp(estimate, vertexBudget * 0.5, vertexBudget * 1.25), MIN_VERTEX_BUDGET);
+    }
+    stepVertices = 0;
+}
+
+
+bool ProgressiveRenderer::isRefining() const
+{
+    return stale || refineLevel >= 0;
+}
+
+
+int ProgressiveRenderer::getNumLevels() const
+{
+    return (int)levelSamples.size();
+}
+
+
+int ProgressiveRenderer::getLevelSamples(int level) const
+{
+    return levelSamples[level];
+}
+
+
+int ProgressiveRenderer::getShownLevel() const
+{
+    return shownLevel;
+}
+
+
+double ProgressiveRenderer::getVertexBudget() const
+{
+    return vertexBudget;
+}
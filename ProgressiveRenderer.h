@@ -0,0 +1,96 @@
+#pragma once
+#ifndef PROGRESSIVE_RENDERER_H
+#define PROGRESSIVE_RENDERER_H
+
+#include <GL/glew.h>
+
+#include <vector>
+
+
+//What one frame of progressive refinement draws
+struct ProgressiveStep
+{
+    int level; //0 is the full sample mesh, every level about halves the samples of the one before
+    int firstPatch;
+    int numPatches; //0 when the image on screen is already final
+    bool reducedShading; //Ambient and the diffuse part of the first light only
+};
+
+
+/*
+    Progressive refinement: while the camera moves every frame is a complete image at the finest
+    detail level whose patches all fit the frame's vertex budget, shaded cheaply. Once the camera
+    stops, every level finer than that is drawn again with full shading, as many patches per frame
+    as the budget allows, into a second framebuffer. The window keeps showing the last complete
+    image until the level being drawn is complete, so the surfaces never show half drawn, and the
+    refinement ends with the full sample mesh. Any other change (a key, a new mesh or layout)
+    starts over from a complete coarse frame.
+    The budget is a vertex count, adapted after every frame that drew something from its measured
+    time: the vertices drawn are scaled by how far the frame was from budgetMs.
+*/
+class ProgressiveRenderer
+{
+public:
+    static constexpr int MAX_LEVELS = 6; //Level 0 included
+
+    explicit ProgressiveRenderer(double budgetMs);
+    ~ProgressiveRenderer();
+
+    //Builds the levels below the sample mesh of finestSamples, starts the refinement over
+    void setLevels(int finestSamples);
+    //The image is out of date, the next frame is a complete coarse one
+    void invalidate();
+    //Picks the work of the frame and binds the framebuffer it is drawn into, cleared when the
+    //step starts a new image. moving is set while the camera moves.
+    ProgressiveStep begin(int width, int height, int numPatches, bool moving);
+    //Draws one patch at a level above 0 with the shader in use. Level 0 is the caller's mesh.
+    void drawLevel(int level);
+    //Ends the step and copies the newest complete image to the window's framebuffer, which is bound again
+    void present(const ProgressiveStep& step);
+    //Time of the last frame from begin() to after its swap, adapts the budget
+    void frameTime(double seconds);
+
+    //True until the full sample mesh with full shading is on screen
+    bool isRefining() const;
+    int getNumLevels() const;
+    int getLevelSamples(int level) const;
+    //Level last completed on screen, and the vertex budget of a frame
+    int getShownLevel() const;
+    double getVertexBudget() const;
+
+private:
+    void resize(int width, int height);
+    long long levelVertices(int level) const;
+
+private:
+    //The budget never drops below this many vertices, so one coarse frame of any scene can be drawn
+    static constexpr double MIN_VERTEX_BUDGET = 4096.0;
+
+    //Levels above 0 share one buffer. Their 16 bit indices are offset to the level's vertices.
+    GLuint levelVAO;
+    GLuint levelVBO;
+    GLuint levelEBO;
+    std::vector<int> levelSamples;
+    std::vector<GLsizei> levelIndexCount;
+    std::vector<size_t> levelFirstIndex;
+
+    //Two images: the one on screen and the one being refined
+    GLuint framebuffers[2];
+    GLuint colorBuffers[2];
+    GLuint depthBuffers[2];
+    int shown; //Index of the complete image
+    bool hasImage;
+    int width;
+    int height;
+
+    double budgetSeconds;
+    double vertexBudget;
+    long long stepVertices; //Drawn by the last step
+    bool stale; //The next step is a complete frame
+    int numPatches;
+    int shownLevel;
+    int refineLevel; //Level being drawn into the second image, -1 once refined
+    int nextPatch;
+};
+
+#endif
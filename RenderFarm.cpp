@@ -0,0 +1,632 @@
+#include "RenderFarm.h"
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cmath>
+#include <cstdlib>
+
+#include "Shader.h"
+#include "SceneLoader.h"
+#include "BezierSurface.h"
+#include "SoftwareRasterizer.h"
+#include "GlAccounting.h"
+
+
+//Viewer rotation the interactive mode starts with, so thumbnails look the same
+static const float DEFAULT_ROTATION = -30.0f;
+
+
+bool readRenderManifest(const char* manifestFile, std::vector<RenderJob>& jobs)
+{
+    std::ifstream manifest(manifestFile);
+    if(!manifest)
+    {
+        std::cout << "Failed to open the manifest " << manifestFile << std::endl;
+        return false;
+    }
+    int width = 256;
+    int height = 256;
+    int samples = 10;
+    GlBudget budget;
+    std::string line;
+    int lineNumber = 0;
+    while(std::getline(manifest, line))
+    {
+        lineNumber++;
+        std::istringstream lineStream(line);
+        std::string command;
+        if(!(lineStream >> command) || command[0] == '#')
+        {
+            continue;
+        }
+        RenderJob job;
+        bool ok = true;
+        if(command == "size")
+        {
+            ok = (lineStream >> width >> height) && width > 0 && height > 0;
+        }
+        else if(command == "samples")
+        {
+            ok = (lineStream >> samples) && samples >= 2;
+        }
+        else if(command == "budget")
+        {
+            std::string spec;
+            budget = GlBudget();
+            ok = (lineStream >> spec) && parseGlBudget(spec, budget);
+        }
+        else if(command == "view")
+        {
+            ok = (bool)(lineStream >> job.sceneFile >> job.outputFile >> job.eye.x >> job.eye.y >> job.eye.z
+                                   >> job.target.x >> job.target.y >> job.target.z >> job.fov);
+            job.width = width;
+            job.height = height;
+            job.samples = samples;
+            job.budget = budget;
+            if(ok)
+            {
+                jobs.push_back(job);
+            }
+        }
+        else if(command == "turntable")
+        {
+            std::string prefix;
+            int views;
+            float radius, eyeHeight;
+            ok = (lineStream >> job.sceneFile >> prefix >> views >> radius >> eyeHeight >> job.fov) && views > 0;
+            job.target = glm::vec3(0.0f);
+            job.width = width;
+            job.height = height;
+            job.samples = samples;
+            job.budget = budget;
+            for(int k = 0; ok && k < views; ++k)
+            {
+                float angle = glm::radians(360.0f * k / views);
+                job.eye = glm::vec3(radius * std::sin(angle), eyeHeight, radius * std::cos(angle));
+                job.outputFile = prefix + "_" + std::to_string(k) + ".ppm";
+                jobs.push_back(job);
+            }
+        }
+        else
+        {
+            ok = false;
+        }
+        if(!ok)
+        {
+            std::cout << manifestFile << ":" << lineNumber << ": can not read \"" << line << "\"" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//Projection * view of a job
+static glm::mat4 jobPV(const RenderJob& job)
+{
+    glm::mat4 view = glm::lookAt(job.eye, job.target, glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(glm::radians(job.fov), (float)job.width / job.height, 0.1f, 100.0f);
+    return projection * view;
+}
+
+
+//Model matrix of every patch, row by row: the layout of the interactive mode at its default size
+static std::vector<glm::mat4> patchModels(const ControlGrid& grid)
+{
+    float s = layoutPatchSize(grid, 1.0f);
+    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), glm::radians(DEFAULT_ROTATION), glm::vec3(1.0, 0.0, 0.0));
+    std::vector<glm::mat4> models;
+    for(const glm::vec3& translation : layoutTranslations(grid, 1.0f))
+    {
+        models.push_back(glm::scale(glm::translate(rotation, translation), glm::vec3(s, s, 1.0)));
+    }
+    return models;
+}
+
+
+bool writePPM(const std::string& fileName, int width, int height, const std::vector<unsigned char>& pixels)
+{
+    std::ofstream image(fileName, std::ios::binary);
+    image << "P6\n" << width << " " << height << "\n255\n";
+    for(int row = height - 1; row >= 0; --row)
+    {
+        image.write((const char*)&pixels[(size_t)row * width * 3], (size_t)width * 3);
+    }
+    if(!image)
+    {
+        std::cout << "Failed to write " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool readPPM(const std::string& fileName, int& width, int& height, std::vector<unsigned char>& pixels)
+{
+    std::ifstream image(fileName, std::ios::binary);
+    std::string magic;
+    int maxValue;
+    if(!(image >> magic >> width >> height >> maxValue) || magic != "P6" || maxValue != 255 || width <= 0 || height <= 0)
+    {
+        std::cout << "Failed to read " << fileName << ", only binary 8 bit PPM is supported" << std::endl;
+        return false;
+    }
+    image.get(); //Single whitespace before the pixels
+    pixels.resize((size_t)width * height * 3);
+    for(int row = height - 1; row >= 0; --row)
+    {
+        image.read((char*)&pixels[(size_t)row * width * 3], (size_t)width * 3);
+    }
+    return (bool)image;
+}
+
+
+int compareImages(const char* fileA, const char* fileB, int tolerance)
+{
+    int widthA, heightA, widthB, heightB;
+    std::vector<unsigned char> a, b;
+    if(!readPPM(fileA, widthA, heightA, a) || !readPPM(fileB, widthB, heightB, b))
+    {
+        return EXIT_FAILURE;
+    }
+    if(widthA != widthB || heightA != heightB)
+    {
+        std::cout << "Sizes differ: " << widthA << "x" << heightA << " and " << widthB << "x" << heightB << std::endl;
+        return EXIT_FAILURE;
+    }
+    int maxDifference = 0;
+    double totalDifference = 0.0;
+    size_t numOver = 0;
+    for(size_t p = 0; p < a.size(); p += 3)
+    {
+        int difference = 0;
+        for(int k = 0; k < 3; ++k)
+        {
+            difference = std::max(difference, std::abs((int)a[p + k] - (int)b[p + k]));
+        }
+        maxDifference = std::max(maxDifference, difference);
+        totalDifference += difference;
+        numOver += difference > tolerance;
+    }
+    size_t numPixels = a.size() / 3;
+    double overPercent = 100.0 * numOver / numPixels;
+    std::cout << "Max difference " << maxDifference << ", mean " << totalDifference / numPixels << ", "
+              << overPercent << "% of the pixels over " << tolerance << std::endl;
+    //Edges rasterised a little differently are expected, whole regions are not
+    return overPercent <= 1.0 ? 0 : EXIT_FAILURE;
+}
+
+
+struct JobTiming
+{
+    double load; //Reading and uploading the scene, 0 if the worker had it already
+    double render; //Drawing, up to the GPU finishing
+    double readback;
+    double write;
+    GlFrameStats gl; //GL work of the whole job, scene upload included
+};
+
+
+/*
+    Everything one worker needs to render on its own context. Shaders, the sample mesh and the
+    framebuffer live as long as the worker, the scene until a job needs another one.
+*/
+class OffscreenRenderer
+{
+public:
+    explicit OffscreenRenderer(GLFWwindow* context)
+        : context(context), fbo(0), colorBuffer(0), depthBuffer(0), width(0), height(0), VAO(0), VBO(0), EBO(0),
+          numIndices(0), indexType(GL_UNSIGNED_SHORT), meshSamples(0)
+    {
+    }
+
+    //Makes the context current on the calling thread and creates the objects every job shares
+    void setup()
+    {
+        glfwMakeContextCurrent(context);
+        glEnable(GL_DEPTH_TEST);
+        glGenFramebuffers(1, &fbo);
+        glGenRenderbuffers(1, &colorBuffer);
+        glGenRenderbuffers(1, &depthBuffer);
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+    }
+
+
+    void release()
+    {
+        releaseControlGrid(scene.grid);
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteBuffers(1, &VBO);
+        glDeleteBuffers(1, &EBO);
+        glDeleteRenderbuffers(1, &colorBuffer);
+        glDeleteRenderbuffers(1, &depthBuffer);
+        glDeleteFramebuffers(1, &fbo);
+        shaders.clear();
+        glfwMakeContextCurrent(nullptr);
+    }
+
+    //Returns false if the scene can not be read or the image not written
+    bool render(const RenderJob& job, JobTiming& timing)
+    {
+        glc::takeFrameStats();
+        auto start = std::chrono::steady_clock::now();
+        if(job.sceneFile != scene.fileName)
+        {
+            releaseControlGrid(scene.grid);
+            scene = Scene();
+            if(!parseScene(job.sceneFile.c_str(), scene))
+            {
+                scene = Scene();
+                return false;
+            }
+            if(!uploadControlGrid(scene.grid))
+            {
+                scene = Scene();
+                return false;
+            }
+        }
+        //A new sample mesh counts as loading, its upload is not drawing the image
+        setSampleMesh(job.samples);
+        auto loaded = std::chrono::steady_clock::now();
+
+        resize(job.width, job.height);
+        glc::bindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, width, height);
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        drawScene(job);
+        glFinish();
+        auto rendered = std::chrono::steady_clock::now();
+
+        std::vector<unsigned char> pixels((size_t)width * height * 3);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+        glc::bindFramebuffer(GL_FRAMEBUFFER, 0);
+        auto readBack = std::chrono::steady_clock::now();
+
+        if(!writePPM(job.outputFile, width, height, pixels))
+        {
+            return false;
+        }
+        auto written = std::chrono::steady_clock::now();
+
+        timing.load = std::chrono::duration<double>(loaded - start).count();
+        timing.render = std::chrono::duration<double>(rendered - loaded).count();
+        timing.readback = std::chrono::duration<double>(readBack - rendered).count();
+        timing.write = std::chrono::duration<double>(written - readBack).count();
+        timing.gl = glc::takeFrameStats();
+        return true;
+    }
+
+private:
+    //All patches of a job are drawn with the same samples, only their control points differ
+    void setSampleMesh(int samples)
+    {
+        if(samples == meshSamples)
+        {
+            return;
+        }
+        meshSamples = samples;
+        std::vector<glm::u16vec2> uv;
+        std::vector<uint32_t> indices;
+        buildSampleMesh(samples, uv, indices, false);
+        glc::bindVertexArray(VAO);
+        glc::bindBuffer(GL_ARRAY_BUFFER, VBO);
+        glc::bufferData(GL_ARRAY_BUFFER, sizeof(glm::u16vec2) * uv.size(), uv.data(), GL_STATIC_DRAW);
+        glc::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        if(uv.size() <= 65536)
+        {
+            std::vector<GLushort> shortIndices(indices.begin(), indices.end());
+            glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * shortIndices.size(), shortIndices.data(), GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_SHORT;
+        }
+        else
+        {
+            glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.data(), GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_INT;
+        }
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(glm::u16vec2), (void*)0);
+        glc::bindVertexArray(0);
+        glc::bindBuffer(GL_ARRAY_BUFFER, 0);
+        numIndices = (GLsizei)indices.size();
+    }
+
+    void resize(int w, int h)
+    {
+        if(w == width && h == height)
+        {
+            return;
+        }
+        width = w;
+        height = h;
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cout << "Offscreen framebuffer of " << width << "x" << height << " is incomplete" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    //Same variants as the interactive mode, compiled once per worker
+    Shader& getShader(const ControlGrid& grid)
+    {
+        std::string defines = patchShaderDefines(grid.degreeU, grid.degreeV, isRational(grid));
+        auto it = shaders.find(defines);
+        if(it == shaders.end())
+        {
+            it = shaders.emplace(std::piecewise_construct, std::forward_as_tuple(defines),
+                                 std::forward_as_tuple("Shaders/bezier/bezier.vert", "Shaders/bezier/bezier.frag", nullptr, defines)).first;
+        }
+        return it->second;
+    }
+
+    void drawScene(const RenderJob& job)
+    {
+        const ControlGrid& grid = scene.grid;
+        if(numPatchesX(grid) == 0 || numPatchesY(grid) == 0)
+        {
+            return;
+        }
+        Shader& shader = getShader(grid);
+        shader.use();
+        shader.setMat4("PV", jobPV(job));
+        shader.setVec3("eyePos", job.eye);
+        shader.setInt("numLights", (int)scene.lightPositions.size());
+        if(!scene.lightPositions.empty())
+        {
+            shader.setVec3Array("lightPositions", (int)scene.lightPositions.size(), scene.lightPositions[0]);
+            shader.setVec3Array("lightIntensities", (int)scene.lightIntensities.size(), scene.lightIntensities[0]);
+        }
+        shader.setInt("gridStride", grid.numPx);
+        shader.setInt("controlHeights", 0);
+        shader.setInt("controlWeights", 1);
+        bindControlGrid(grid);
+        glc::bindVertexArray(VAO);
+
+        std::vector<glm::mat4> models = patchModels(grid);
+        for(int i = 0; i < numPatchesY(grid); ++i)
+        {
+            for(int j = 0; j < numPatchesX(grid); ++j)
+            {
+                shader.setMat4("modelMat", models[i * numPatchesX(grid) + j]);
+                shader.setInt("gridOffset", patchOffset(grid, i, j));
+                glc::drawElements(GL_TRIANGLES, numIndices, indexType, 0);
+            }
+        }
+        glc::bindVertexArray(0);
+    }
+
+private:
+    GLFWwindow* context;
+    GLuint fbo;
+    GLuint colorBuffer;
+    GLuint depthBuffer;
+    int width;
+    int height;
+    //Sample mesh
+    GLuint VAO;
+    GLuint VBO;
+    GLuint EBO;
+    GLsizei numIndices;
+    GLenum indexType;
+    int meshSamples; //0 until the first job
+    std::map<std::string, Shader> shaders;
+    Scene scene; //Last scene, kept for the next job
+};
+
+
+/*
+    CPU backend: jobs run one after the other and each image uses every thread, so the frame
+    time itself scales with the cores
+*/
+static int runSoftwareRenderFarm(const std::vector<RenderJob>& jobs, int numThreads)
+{
+    SoftwareRasterizer rasterizer(numThreads);
+    int meshSamples = 0;
+    Scene scene;
+    std::vector<glm::mat4> models;
+    std::vector<unsigned char> pixels;
+    size_t numRendered = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(const RenderJob& job : jobs)
+    {
+        auto jobStart = std::chrono::steady_clock::now();
+        if(job.sceneFile != scene.fileName)
+        {
+            scene = Scene();
+            if(!parseScene(job.sceneFile.c_str(), scene))
+            {
+                scene = Scene();
+                std::cout << "skipped " << job.outputFile << std::endl;
+                continue;
+            }
+            models = patchModels(scene.grid);
+        }
+        if(job.samples != meshSamples)
+        {
+            rasterizer.setSampleMesh(job.samples);
+            meshSamples = job.samples;
+        }
+        double load = std::chrono::duration<double>(std::chrono::steady_clock::now() - jobStart).count();
+
+        RasterView view = { jobPV(job), job.eye, job.width, job.height };
+        RasterStats stats = rasterizer.render(scene.grid, models, scene.lightPositions, scene.lightIntensities, view, pixels);
+        auto written = std::chrono::steady_clock::now();
+        if(!writePPM(job.outputFile, job.width, job.height, pixels))
+        {
+            std::cout << "skipped " << job.outputFile << std::endl;
+            continue;
+        }
+        double write = std::chrono::duration<double>(std::chrono::steady_clock::now() - written).count();
+        numRendered++;
+        std::cout << job.outputFile << ": load " << load * 1000.0 << " ms, render " << stats.seconds * 1000.0
+                  << " ms (vertices " << stats.vertexSeconds * 1000.0 << ", binning " << stats.binSeconds * 1000.0
+                  << ", raster " << stats.rasterSeconds * 1000.0 << ", " << stats.numTriangles << " triangles), write "
+                  << write * 1000.0 << " ms" << std::endl;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << numRendered << " images on " << rasterizer.getNumThreads() << " threads in " << seconds << " s, "
+              << numRendered / seconds << " images/s" << std::endl;
+    return numRendered == jobs.size() ? 0 : EXIT_FAILURE;
+}
+
+
+int runRenderFarm(const char* manifestFile, int numWorkers, bool software)
+{
+    std::vector<RenderJob> jobs;
+    if(!readRenderManifest(manifestFile, jobs))
+    {
+        return EXIT_FAILURE;
+    }
+    if(software)
+    {
+        return runSoftwareRenderFarm(jobs, numWorkers);
+    }
+    //Views of one scene are rendered one after the other by one worker
+    std::vector<std::vector<RenderJob>> groups;
+    std::map<std::string, size_t> groupOfScene;
+    for(const RenderJob& job : jobs)
+    {
+        auto it = groupOfScene.find(job.sceneFile);
+        if(it == groupOfScene.end())
+        {
+            it = groupOfScene.emplace(job.sceneFile, groups.size()).first;
+            groups.emplace_back();
+        }
+        groups[it->second].push_back(job);
+    }
+    if(numWorkers <= 0)
+    {
+        numWorkers = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    numWorkers = std::max(1, std::min(numWorkers, (int)groups.size()));
+
+    //Windows have to be created on the main thread. They are never shown, rendering goes to framebuffers.
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    #ifdef __APPLE__
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    #endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    std::vector<GLFWwindow*> contexts;
+    for(int w = 0; w < numWorkers; ++w)
+    {
+        GLFWwindow* context = glfwCreateWindow(1, 1, "Render worker", NULL, NULL);
+        if(context == nullptr)
+        {
+            break;
+        }
+        contexts.push_back(context);
+    }
+    if(contexts.empty())
+    {
+        std::cout << "Failed to create an offscreen context" << std::endl;
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    //Function pointers are the same for every context of the driver
+    glfwMakeContextCurrent(contexts[0]);
+    if(GLEW_OK != glewInit())
+    {
+        std::cout << "Failed to initialize GLEW" << std::endl;
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+    std::error_code error;
+    std::filesystem::create_directories("shader_cache", error);
+    Shader::setupCompilation(error ? "" : "shader_cache");
+    glfwMakeContextCurrent(nullptr);
+
+    std::cout << "Rendering " << jobs.size() << " images of " << groups.size() << " scenes on "
+              << contexts.size() << " workers" << std::endl;
+    bool accounting = isGlAccountingEnabled();
+    if(!accounting && std::any_of(jobs.begin(), jobs.end(), [](const RenderJob& job) { return hasGlBudget(job.budget); }))
+    {
+        std::cout << "Built without GL_ACCOUNTING, the GL budgets of the manifest are not checked" << std::endl;
+    }
+    std::mutex printMutex;
+    std::atomic<size_t> nextGroup(0);
+    std::atomic<size_t> numRendered(0);
+    std::atomic<size_t> numOverBudget(0);
+    auto start = std::chrono::steady_clock::now();
+    auto worker = [&](int w)
+    {
+        OffscreenRenderer renderer(contexts[w]);
+        renderer.setup();
+        for(size_t g = nextGroup++; g < groups.size(); g = nextGroup++)
+        {
+            for(const RenderJob& job : groups[g])
+            {
+                JobTiming timing;
+                bool ok = renderer.render(job, timing);
+                std::lock_guard<std::mutex> lock(printMutex);
+                if(!ok)
+                {
+                    std::cout << "[" << w << "] skipped " << job.outputFile << std::endl;
+                    continue;
+                }
+                numRendered++;
+                std::cout << "[" << w << "] " << job.outputFile << ": load " << timing.load * 1000.0
+                          << " ms, render " << timing.render * 1000.0 << " ms, readback " << timing.readback * 1000.0
+                          << " ms, write " << timing.write * 1000.0 << " ms" << std::endl;
+                if(accounting)
+                {
+                    std::cout << "[" << w << "]   GL: ";
+                    printGlStats(std::cout, timing.gl);
+                    std::cout << std::endl;
+                    std::string violations;
+                    if(!checkGlBudget(timing.gl, job.budget, violations))
+                    {
+                        numOverBudget++;
+                        std::cout << "[" << w << "]   over the GL budget: " << violations << std::endl;
+                    }
+                }
+            }
+        }
+        renderer.release();
+    };
+    std::vector<std::thread> threads;
+    for(int w = 0; w < (int)contexts.size(); ++w)
+    {
+        threads.emplace_back(worker, w);
+    }
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << numRendered << " images in " << seconds << " s, " << numRendered / seconds << " images/s" << std::endl;
+    if(numOverBudget > 0)
+    {
+        std::cout << numOverBudget << " images went over their GL budget" << std::endl;
+    }
+
+    glfwTerminate();
+    return numRendered == jobs.size() && numOverBudget == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#ifndef RENDER_FARM_H
+#define RENDER_FARM_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+#include "GlAccounting.h"
+
+
+//One image of one scene
+struct RenderJob
+{
+    std::string sceneFile;
+    std::string outputFile; //Binary PPM
+    glm::vec3 eye;
+    glm::vec3 target;
+    float fov; //Vertical, in degrees
+    int width;
+    int height;
+    int samples; //Sample mesh resolution
+    GlBudget budget; //GL work allowed for rendering the image
+};
+
+/*
+    Reads a manifest. Every line is one of
+        size <width> <height>                       applies to the lines below it
+        samples <n>                                 sample mesh resolution of the lines below it
+        budget <counter>=<limit>,...                GL budget of the lines below it, see parseGlBudget()
+        view <scene> <image> <eye xyz> <target xyz> <fov>
+        turntable <scene> <image prefix> <views> <radius> <height> <fov>
+    Turntables circle the y axis looking at the origin and write <prefix>_<k>.ppm.
+    Empty lines and lines starting with # are skipped. Returns false if the file can not be read.
+*/
+bool readRenderManifest(const char* manifestFile, std::vector<RenderJob>& jobs);
+
+/*
+    Renders every job of the manifest with numWorkers threads, each with its own offscreen
+    context (0 picks one per core). Views of the same scene go to the same worker, so scenes are
+    read and uploaded once, and shaders are compiled once per worker. With software set the
+    SoftwareRasterizer renders instead, on numWorkers threads per image and without GL.
+    Prints the timings of every job and the overall images per second. Built with GL_ACCOUNTING,
+    also the GL work of every job, and images over their budget fail the run. Returns the process exit code.
+*/
+int runRenderFarm(const char* manifestFile, int numWorkers, bool software = false);
+
+//Binary 8 bit PPM. pixels are RGB rows from the bottom, like glReadPixels returns them.
+bool writePPM(const std::string& fileName, int width, int height, const std::vector<unsigned char>& pixels);
+bool readPPM(const std::string& fileName, int& width, int& height, std::vector<unsigned char>& pixels);
+/*
+    Prints the largest and mean per pixel difference of two images and the share of pixels
+    differing by more than tolerance. Returns 0 if that share is at most 1%.
+*/
+int compareImages(const char* fileA, const char* fileB, int tolerance);
+
+#endif
@@ -0,0 +1,365 @@
+#include "SceneLoader.h"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+#else
+#include <filesystem>
+#endif
+
+
+//How often the loader thread looks at the watched file when there is nothing to read
+static const std::chrono::milliseconds WATCH_INTERVAL(250);
+
+
+bool parseScene(const char* fileName, Scene& scene)
+{
+    std::ifstream fileStream(fileName);
+    if(!fileStream)
+    {
+        std::cout << "Failed to open the scene file " << fileName << std::endl;
+        return false;
+    }
+    scene.fileName = fileName;
+    //Number of point lights
+    int numPointLights = 0;
+    fileStream >> numPointLights;
+    //Initialize the points lights
+    scene.lightPositions.resize(std::max(numPointLights, 0));
+    scene.lightIntensities.resize(std::max(numPointLights, 0));
+    for(int i = 0; i < numPointLights; ++i)
+    {
+        fileStream >> scene.lightPositions[i].x;
+        fileStream >> scene.lightPositions[i].y;
+        fileStream >> scene.lightPositions[i].z;
+        fileStream >> scene.lightIntensities[i].x;
+        fileStream >> scene.lightIntensities[i].y;
+        fileStream >> scene.lightIntensities[i].z;
+    }
+    //Number of CP's. Optionally followed by the patch degrees along u and v, and by the word
+    //"rational" if a grid of weights follows the grid of control points.
+    ControlGrid& grid = scene.grid;
+    fileStream >> grid.numPy >> grid.numPx;
+    if(!fileStream || grid.numPx < 0 || grid.numPy < 0)
+    {
+        std::cout << "Failed to read the header of the scene file " << fileName << std::endl;
+        return false;
+    }
+    std::string patchLine;
+    std::getline(fileStream, patchLine);
+    std::istringstream patchStream(patchLine);
+    if(!(patchStream >> grid.degreeU >> grid.degreeV))
+    {
+        grid.degreeU = grid.degreeV = 3;
+    }
+    std::string rationalFlag;
+    bool rational = (patchStream >> rationalFlag) && rationalFlag == "rational";
+    if(!getPatchEvaluator(grid.degreeU, grid.degreeV, rational))
+    {
+        std::cout << "Unsupported patch degrees " << grid.degreeU << " x " << grid.degreeV << ", at most "
+                  << MAX_PATCH_DEGREE << " is supported along each axis" << std::endl;
+        return false;
+    }
+    //The layout divides by the number of patches
+    if(numPatchesX(grid) < 1 || numPatchesY(grid) < 1)
+    {
+        std::cout << "The control grid of " << fileName << " has no whole patch" << std::endl;
+        return false;
+    }
+    //Now read the Control Points, only their heights are kept
+    grid.heights.resize((size_t)grid.numPy * grid.numPx);
+    for(float& z : grid.heights)
+    {
+        fileStream >> z;
+    }
+    //And their weights
+    grid.weights.clear();
+    if(rational)
+    {
+        grid.weights.resize(grid.heights.size());
+        for(float& w : grid.weights)
+        {
+            fileStream >> w;
+        }
+    }
+    //A file that is still being written ends early
+    if(fileStream.fail())
+    {
+        std::cout << "The scene file " << fileName << " ends before all control points are read" << std::endl;
+        return false;
+    }
+
+    //Each (degreeV + 1) x (degreeU + 1) subblock represents a Bezier Surface. The surfaces only
+    //refer to their block, evaluators lay the XY coordinates out uniformly.
+    int numBezierX = numPatchesX(grid);
+    int numBezierY = numPatchesY(grid);
+    scene.surfaces.clear();
+    scene.surfaces.reserve((size_t)numBezierX * numBezierY);
+    for(int i = 0; i < numBezierY; ++i)
+    {
+        for(int j = 0; j < numBezierX; ++j)
+        {
+            BezierSurface surf;
+            surf.gridOffset = patchOffset(grid, i, j);
+            scene.surfaces.push_back(surf);
+        }
+    }
+    return true;
+}
+
+
+bool writeScene(const char* fileName, const Scene& scene)
+{
+    std::ofstream out(fileName);
+    if(!out)
+    {
+        std::cout << "Failed to open " << fileName << " for writing" << std::endl;
+        return false;
+    }
+    const ControlGrid& grid = scene.grid;
+    out << scene.lightPositions.size() << "\n";
+    for(size_t i = 0; i < scene.lightPositions.size(); ++i)
+    {
+        const glm::vec3& p = scene.lightPositions[i];
+        const glm::vec3& c = scene.lightIntensities[i];
+        out << p.x << " " << p.y << " " << p.z << " " << c.x << " " << c.y << " " << c.z << "\n";
+    }
+    out << grid.numPy << " " << grid.numPx;
+    if(grid.degreeU != 3 || grid.degreeV != 3 || isRational(grid))
+    {
+        out << " " << grid.degreeU << " " << grid.degreeV << (isRational(grid) ? " rational" : "");
+    }
+    out << "\n";
+    //Rows are formatted into one buffer, large grids spend most of their time here. 9 significant
+    //digits read back as the same float.
+    std::string line;
+    char number[32];
+    auto writeRows = [&](const std::vector<float>& values)
+    {
+        for(int i = 0; i < grid.numPy; ++i)
+        {
+            line.clear();
+            for(int j = 0; j < grid.numPx; ++j)
+            {
+                int length = std::snprintf(number, sizeof(number), j == 0 ? "%.9g" : " %.9g", values[(size_t)i * grid.numPx + j]);
+                line.append(number, length);
+            }
+            line += '\n';
+            out.write(line.data(), line.size());
+        }
+    };
+    writeRows(grid.heights);
+    if(isRational(grid))
+    {
+        writeRows(grid.weights);
+    }
+    if(!out)
+    {
+        std::cout << "Failed to write " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+SceneLoader::SceneLoader(std::function<void()> finished)
+    : inotifyFd(-1), watchFd(-1), lastWriteTime(0), hasRequest(false), busy(false), finished(finished), quit(false)
+{
+#ifdef __linux__
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd < 0)
+    {
+        std::cout << "inotify is not available, scene files will not be reloaded on change" << std::endl;
+    }
+#endif
+    loader = std::thread(&SceneLoader::loaderLoop, this);
+}
+
+
+SceneLoader::~SceneLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeLoader.notify_all();
+    loader.join();
+    closeWatch();
+#ifdef __linux__
+    if(inotifyFd >= 0)
+    {
+        close(inotifyFd);
+    }
+#endif
+}
+
+
+void SceneLoader::load(const std::string& fileName)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requestedFile = fileName;
+        hasRequest = true;
+    }
+    wakeLoader.notify_all();
+}
+
+
+std::unique_ptr<Scene> SceneLoader::takeLoaded()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::move(loaded);
+}
+
+
+bool SceneLoader::isLoading() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return hasRequest || busy;
+}
+
+
+void SceneLoader::loaderLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!quit)
+    {
+        if(!hasRequest)
+        {
+            wakeLoader.wait_for(lock, WATCH_INTERVAL);
+        }
+        if(quit)
+        {
+            break;
+        }
+
+        std::string fileName;
+        if(hasRequest)
+        {
+            fileName = requestedFile;
+            hasRequest = false;
+        }
+        else
+        {
+            lock.unlock();
+            bool changed = !watchedFile.empty() && watchedFileChanged();
+            lock.lock();
+            //A request that came in meanwhile is handled next round
+            if(!changed || hasRequest)
+            {
+                continue;
+            }
+            fileName = watchedFile;
+            std::cout << "Scene file " << fileName << " changed, reloading" << std::endl;
+        }
+        busy = true;
+        lock.unlock();
+
+        if(fileName != watchedFile)
+        {
+            watchFile(fileName);
+        }
+        std::unique_ptr<Scene> scene(new Scene);
+        bool ok = parseScene(fileName.c_str(), *scene);
+
+        lock.lock();
+        busy = false;
+        if(ok)
+        {
+            //Replaces a scene the GL thread has not taken yet
+            loaded = std::move(scene);
+            if(finished)
+            {
+                lock.unlock();
+                finished();
+                lock.lock();
+            }
+        }
+    }
+}
+
+
+void SceneLoader::watchFile(const std::string& fileName)
+{
+    closeWatch();
+    watchedFile = fileName;
+#ifdef __linux__
+    if(inotifyFd < 0)
+    {
+        return;
+    }
+    //Editors often save by writing a new file and renaming it over the old one, which a
+    //watch on the file itself would not survive. So the directory is watched instead.
+    size_t slash = fileName.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : fileName.substr(0, slash + 1);
+    watchFd = inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if(watchFd < 0)
+    {
+        std::cout << "Failed to watch " << directory << " for changes" << std::endl;
+    }
+#else
+    std::error_code error;
+    lastWriteTime = (long long)std::filesystem::last_write_time(fileName, error).time_since_epoch().count();
+#endif
+}
+
+
+bool SceneLoader::watchedFileChanged()
+{
+#ifdef __linux__
+    if(watchFd < 0)
+    {
+        return false;
+    }
+    size_t slash = watchedFile.find_last_of('/');
+    std::string name = slash == std::string::npos ? watchedFile : watchedFile.substr(slash + 1);
+    //Drain every pending event, several writes in a row cause a single reload
+    bool changed = false;
+    alignas(inotify_event) char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+    ssize_t length;
+    while((length = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+    {
+        for(char* p = buffer; p < buffer + length; )
+        {
+            const inotify_event* event = (const inotify_event*)p;
+            if(event->wd == watchFd && event->len > 0 && name == event->name)
+            {
+                changed = true;
+            }
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+    return changed;
+#else
+    std::error_code error;
+    long long writeTime = (long long)std::filesystem::last_write_time(watchedFile, error).time_since_epoch().count();
+    if(error || writeTime == lastWriteTime)
+    {
+        return false;
+    }
+    lastWriteTime = writeTime;
+    return true;
+#endif
+}
+
+
+void SceneLoader::closeWatch()
+{
+#ifdef __linux__
+    if(watchFd >= 0)
+    {
+        inotify_rm_watch(inotifyFd, watchFd);
+    }
+#endif
+    watchFd = -1;
+    watchedFile.clear();
+}
@@ -0,0 +1,86 @@
+#pragma once
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "BezierSurface.h"
+#include "ControlGrid.h"
+
+
+//Everything a scene file holds, read without touching OpenGL
+struct Scene
+{
+    std::string fileName;
+    std::vector<glm::vec3> lightPositions;
+    std::vector<glm::vec3> lightIntensities;
+    ControlGrid grid;
+    //One surface per patch, row by row. Only gridOffset is set, the placement depends on the
+    //viewer settings and is done when the scene is put on screen.
+    std::vector<BezierSurface> surfaces;
+};
+
+/*
+    Reads a scene file: the point lights, then "numPy numPx [degreeU degreeV [rational]]",
+    the heights of the control points and the weights if the patches are rational.
+    Returns false and prints the reason if the file can not be read.
+*/
+bool parseScene(const char* fileName, Scene& scene);
+//Writes the lights and the grid of a scene in the format parseScene() reads. Prints the reason if it fails.
+bool writeScene(const char* fileName, const Scene& scene);
+
+
+/*
+    Reads scene files on a background thread so the window keeps rendering meanwhile. The file
+    of the last request is watched and read again whenever it is rewritten on disk.
+    Finished scenes are handed to the GL thread through takeLoaded(); a scene that failed to
+    parse is dropped, so the previous one stays on screen. finished is called on the loader
+    thread whenever a scene is ready to be taken, to wake a sleeping render loop.
+*/
+class SceneLoader
+{
+public:
+    explicit SceneLoader(std::function<void()> finished);
+    ~SceneLoader();
+
+    //Reads the file in the background and watches it from then on. Replaces a request that has not started yet.
+    void load(const std::string& fileName);
+    //Latest scene finished since the last call, null if there is none
+    std::unique_ptr<Scene> takeLoaded();
+    //True while a file is being read
+    bool isLoading() const;
+
+private:
+    void loaderLoop();
+    //Watcher, loader thread only
+    void watchFile(const std::string& fileName);
+    bool watchedFileChanged();
+    void closeWatch();
+
+private:
+    //Loader thread only
+    std::string watchedFile;
+    int inotifyFd;
+    int watchFd;
+    long long lastWriteTime; //Polling fallback where inotify is not available
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeLoader;
+    std::string requestedFile;
+    bool hasRequest;
+    bool busy;
+    std::unique_ptr<Scene> loaded;
+    std::function<void()> finished;
+    bool quit;
+    std::thread loader;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include "SceneUpdater.h"
+
+#include <chrono>
+
+#include "BezierSurface.h"
+
+
+static std::shared_ptr<const SampleMesh> buildMesh(int samples)
+{
+    std::shared_ptr<SampleMesh> mesh = std::make_shared<SampleMesh>();
+    mesh->samples = samples;
+    buildSampleMesh(samples, mesh->uv, mesh->indices, true);
+    if(mesh->uv.size() <= 65536)
+    {
+        mesh->shortIndices.assign(mesh->indices.begin(), mesh->indices.end());
+    }
+    return mesh;
+}
+
+static std::shared_ptr<const SceneLayout> buildLayout(const ControlGrid& grid, float coordMultiplier, uint64_t sceneId)
+{
+    std::shared_ptr<SceneLayout> layout = std::make_shared<SceneLayout>();
+    layout->sceneId = sceneId;
+    layout->coordMultiplier = coordMultiplier;
+    float s = layoutPatchSize(grid, coordMultiplier);
+    layout->scaling = glm::vec3(s, s, 1.0);
+    layout->translations = layoutTranslations(grid, coordMultiplier);
+    return layout;
+}
+
+
+SceneUpdater::SceneUpdater(int numSamples, float coordMultiplier, std::function<void()> published)
+    : middle(1), back(0), front(2), updateMs(0.0), published(published), requestedSamples(numSamples),
+      requestedMultiplier(coordMultiplier), requestedSceneId(0), changed(true), quit(false)
+{
+    updater = std::thread(&SceneUpdater::updateLoop, this);
+}
+
+
+SceneUpdater::~SceneUpdater()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeUpdater.notify_one();
+    updater.join();
+}
+
+
+void SceneUpdater::setSamples(int numSamples)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requestedSamples = numSamples;
+        changed = true;
+    }
+    wakeUpdater.notify_one();
+}
+
+
+void SceneUpdater::setCoordMultiplier(float coordMultiplier)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requestedMultiplier = coordMultiplier;
+        changed = true;
+    }
+    wakeUpdater.notify_one();
+}
+
+
+void SceneUpdater::setScene(const ControlGrid& grid, uint64_t sceneId)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requestedShape.numPx = grid.numPx;
+        requestedShape.numPy = grid.numPy;
+        requestedShape.degreeU = grid.degreeU;
+        requestedShape.degreeV = grid.degreeV;
+        requestedSceneId = sceneId;
+        changed = true;
+    }
+    wakeUpdater.notify_one();
+}
+
+
+const SceneSnapshot& SceneUpdater::acquire()
+{
+    if(middle.load(std::memory_order_acquire) & FRESH)
+    {
+        front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+    }
+    return slots[front];
+}
+
+
+double SceneUpdater::lastUpdateMs() const
+{
+    return updateMs.load();
+}
+
+
+void SceneUpdater::publish(const SceneSnapshot& snapshot)
+{
+    slots[back] = snapshot;
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+    if(published)
+    {
+        published();
+    }
+}
+
+
+void SceneUpdater::updateLoop()
+{
+    SceneSnapshot current;
+    for(;;)
+    {
+        int samples;
+        float multiplier;
+        ControlGrid shape;
+        uint64_t sceneId;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeUpdater.wait(lock, [this]() { return changed || quit; });
+            if(quit)
+            {
+                return;
+            }
+            samples = requestedSamples;
+            multiplier = requestedMultiplier;
+            shape = requestedShape;
+            sceneId = requestedSceneId;
+            changed = false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        //Only rebuild what the settings changed, the rest is shared with the previous snapshot
+        if(!current.mesh || current.mesh->samples != samples)
+        {
+            current.mesh = buildMesh(samples);
+        }
+        if(!current.layout || current.layout->sceneId != sceneId || current.layout->coordMultiplier != multiplier)
+        {
+            current.layout = buildLayout(shape, multiplier, sceneId);
+        }
+        ++current.version;
+        updateMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        publish(current);
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#ifndef SCENE_UPDATER_H
+#define SCENE_UPDATER_H
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+#include "ControlGrid.h"
+
+
+//Sample mesh every patch is drawn with, staged in the form it is uploaded in
+struct SampleMesh
+{
+    int samples;
+    std::vector<glm::u16vec2> uv;
+    std::vector<uint32_t> indices;
+    std::vector<GLushort> shortIndices; //The indices as 16 bits, empty if the vertices do not fit
+};
+
+//Placement of the patches of one scene, as layoutBezierSurfaces() computes it
+struct SceneLayout
+{
+    uint64_t sceneId;
+    float coordMultiplier;
+    glm::vec3 scaling;
+    std::vector<glm::vec3> translations; //Row major patch order
+};
+
+//State the render thread draws from. Parts that did not change are shared between snapshots.
+struct SceneSnapshot
+{
+    uint64_t version = 0; //0 until the first snapshot is published
+    std::shared_ptr<const SampleMesh> mesh;
+    std::shared_ptr<const SceneLayout> layout;
+};
+
+
+/*
+    Runs scene updates on a thread of their own so that input handling never stalls the render
+    loop. Input handlers post the new settings and return; the update thread rebuilds what they
+    change (the sample mesh with its vertex cache order and 16 bit indices, the layout of the
+    patches) and publishes an immutable snapshot through a triple buffer. The render thread takes
+    the newest snapshot with one atomic exchange, without locking, and only uploads what changed.
+    published is called on the update thread after every snapshot, to wake a sleeping render loop.
+*/
+class SceneUpdater
+{
+public:
+    SceneUpdater(int numSamples, float coordMultiplier, std::function<void()> published);
+    ~SceneUpdater();
+
+    //Any thread. Only the latest values are built if several arrive during one update.
+    void setSamples(int numSamples);
+    void setCoordMultiplier(float coordMultiplier);
+    //Lays out the patches of the grid (only its dimensions are kept), tagged with sceneId
+    void setScene(const ControlGrid& grid, uint64_t sceneId);
+
+    //Render thread only. Newest published snapshot, valid until the next call.
+    const SceneSnapshot& acquire();
+    //Duration of the last update on the update thread
+    double lastUpdateMs() const;
+
+private:
+    void updateLoop();
+    void publish(const SceneSnapshot& snapshot);
+
+private:
+    //Triple buffer. The writer fills slots[back] and exchanges it with middle, the reader
+    //exchanges front with middle when middle holds a snapshot it has not seen.
+    static constexpr int FRESH = 4;
+    SceneSnapshot slots[3];
+    std::atomic<int> middle; //Slot index, | FRESH while it is unseen
+    int back; //Update thread only
+    int front; //Render thread only
+    std::atomic<double> updateMs;
+    std::function<void()> published;
+
+    std::mutex mutex;
+    std::condition_variable wakeUpdater;
+    int requestedSamples;
+    float requestedMultiplier;
+    ControlGrid requestedShape;
+    uint64_t requestedSceneId;
+    bool changed;
+    bool quit;
+    std::thread updater;
+};
+
+#endif
@@ -1,7 +1,53 @@
 #include "Shader.h"
+#include "GlAccounting.h"
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+std::string Shader::binaryCacheDirectory;
+std::string Shader::driverString;
+bool Shader::parallelCompile = false;
+
+//FNV-1a, stable across runs and platforms unlike std::hash
+static uint64_t hashString(const std::string& s)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : s)
+	{
+		hash = (hash ^ c) * 1099511628211ull;
+	}
+	return hash;
+}
+
+void Shader::setupCompilation(const std::string& cacheDirectory)
+{
+	//Let the driver compile on as many threads as it likes
+	parallelCompile = GLEW_KHR_parallel_shader_compile;
+	if (parallelCompile)
+	{
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+
+	//Some drivers support no binary formats at all
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	binaryCacheDirectory = numFormats > 0 ? cacheDirectory : "";
+	const GLubyte* vendor = glGetString(GL_VENDOR);
+	const GLubyte* renderer = glGetString(GL_RENDERER);
+	const GLubyte* version = glGetString(GL_VERSION);
+	driverString.clear();
+	for (const GLubyte* s : { vendor, renderer, version })
+	{
+		driverString += s != nullptr ? (const char*)s : "";
+		driverString += "\n";
+	}
+}
 
 //Going to read shaders from the files
-Shader::Shader(const char * vertexPath, const char * fragmentPath, const char* geometryPath)
+Shader::Shader(const char * vertexPath, const char * fragmentPath, const char* geometryPath, const std::string& defines,
+			   const std::vector<std::string>& captureVaryings)
 {
 	//Retrieve and store the shader codes
 	std::string vertexCode;
@@ -18,17 +64,19 @@ Shader::Shader(const char * vertexPath, const char * fragmentPath, const char* g
 	{
 		//Open the files
 		vShaderFile.open(vertexPath);
-		fShaderFile.open(fragmentPath);
 		std::stringstream vShaderStream, fShaderStream;
 		//Read file's buffer contents into the streams
 		vShaderStream << vShaderFile.rdbuf();
-		fShaderStream << fShaderFile.rdbuf();
-		//Close the files
 		vShaderFile.close();
-		fShaderFile.close();
-		//Extract the strings from the streams
 		vertexCode = vShaderStream.str();
-		fragmentCode = fShaderStream.str();
+		//A compute program has no fragment stage
+		if (fragmentPath != nullptr)
+		{
+			fShaderFile.open(fragmentPath);
+			fShaderStream << fShaderFile.rdbuf();
+			fShaderFile.close();
+			fragmentCode = fShaderStream.str();
+		}
 		//If present, also load the geometry shader
 		if (geometryPath != nullptr)
 		{
@@ -45,118 +93,256 @@ Shader::Shader(const char * vertexPath, const char * fragmentPath, const char* g
 		std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ->" << fail.what() << std::endl;
 	}
 
+	//Build the requested variant
+	if (!defines.empty())
+	{
+		vertexCode = insertDefines(vertexCode, defines);
+		if (fragmentPath != nullptr)
+		{
+			fragmentCode = insertDefines(fragmentCode, defines);
+		}
+		if (geometryPath != nullptr)
+		{
+			geometryCode = insertDefines(geometryCode, defines);
+		}
+	}
+
+	name = std::string(vertexPath) + (fragmentPath != nullptr ? std::string(", ") + fragmentPath : "") + (geometryPath != nullptr ? std::string(", ") + geometryPath : "");
+	ID = glCreateProgram();
+	vertex = fragment = geometry = 0;
+	built = false;
+
+	//Programs linked on an earlier run are loaded from the cache, keyed by the final sources
+	if (!binaryCacheDirectory.empty())
+	{
+		std::string key = driverString + vertexCode + fragmentCode + geometryCode;
+		for (const std::string& varying : captureVaryings)
+		{
+			key += varying + "\n";
+		}
+		std::ostringstream path;
+		path << binaryCacheDirectory << "/" << std::hex << hashString(key) << ".bin";
+		binaryPath = path.str();
+		if (loadProgramBinary())
+		{
+			built = true;
+			return;
+		}
+	}
+
 	const char* vShaderCode = vertexCode.c_str();
 	const char* fShaderCode = fragmentCode.c_str();
 	//COMPILE THE SHADERS
-	GLuint vertex, fragment;
-	//Vertex Shader Compilation
-	vertex = glCreateShader(GL_VERTEX_SHADER);
+	//Statuses are not queried here, that would wait for the compiler. finishBuild() checks them.
+	//Vertex Shader Compilation, or the only stage of a compute program
+	vertex = glCreateShader(fragmentPath != nullptr ? GL_VERTEX_SHADER : GL_COMPUTE_SHADER);
 	glShaderSource(vertex, 1, &vShaderCode, NULL);
 	glCompileShader(vertex);
-	//Check errors
-	checkCompileErrors(vertex, "VERTEX");
 
 	//Compile the fragment shader
-	fragment = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragment, 1, &fShaderCode, NULL);
-	glCompileShader(fragment);
-	//Check errors
-	checkCompileErrors(fragment, "FRAGMENT");
+	if (fragmentPath != nullptr)
+	{
+		fragment = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(fragment, 1, &fShaderCode, NULL);
+		glCompileShader(fragment);
+	}
 	//If present compile the geometry shader
-	GLuint geometry;
 	if (geometryPath != nullptr)
 	{
 		const char* gShaderCode = geometryCode.c_str();
 		geometry = glCreateShader(GL_GEOMETRY_SHADER);
 		glShaderSource(geometry, 1, &gShaderCode, NULL);
 		glCompileShader(geometry);
-		checkCompileErrors(geometry, "GEOMETRY");
 	}
 	//Create the shader program
-	ID = glCreateProgram();
 	glAttachShader(ID, vertex);
-	glAttachShader(ID, fragment);
+	if (fragment != 0)
+	{
+		glAttachShader(ID, fragment);
+	}
 	if (geometryPath != nullptr)
 	{
 		glAttachShader(ID, geometry);
 	}
+	if (!captureVaryings.empty())
+	{
+		std::vector<const char*> names;
+		for (const std::string& varying : captureVaryings)
+		{
+			names.push_back(varying.c_str());
+		}
+		glTransformFeedbackVaryings(ID, (GLsizei)names.size(), names.data(), GL_INTERLEAVED_ATTRIBS);
+	}
+	if (!binaryPath.empty())
+	{
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 	glLinkProgram(ID);
+}
+
+bool Shader::isReady() const
+{
+	if (built || !parallelCompile)
+	{
+		return true;
+	}
+	GLint done = GL_FALSE;
+	glGetProgramiv(ID, GL_COMPLETION_STATUS_KHR, &done);
+	return done == GL_TRUE;
+}
+
+void Shader::finishBuild()
+{
+	//Check errors
+	bool success = checkCompileErrors(vertex, fragment != 0 ? "VERTEX" : "COMPUTE");
+	if (fragment != 0)
+	{
+		success = checkCompileErrors(fragment, "FRAGMENT") && success;
+	}
+	if (geometry != 0)
+	{
+		success = checkCompileErrors(geometry, "GEOMETRY") && success;
+	}
 	//Check linking errors
-	checkCompileErrors(ID, "PROGRAM");
+	success = checkCompileErrors(ID, "PROGRAM") && success;
+	if (success && !binaryPath.empty())
+	{
+		saveProgramBinary();
+	}
 
 	//After linking the program we dont need shaders anymore.
 	glDeleteShader(vertex);
-	glDeleteShader(fragment);
-	if (geometryPath != nullptr)
+	if (fragment != 0)
+	{
+		glDeleteShader(fragment);
+	}
+	if (geometry != 0)
 	{
 		glDeleteShader(geometry);
 	}
+	vertex = fragment = geometry = 0;
+	built = true;
+}
+
+bool Shader::loadProgramBinary()
+{
+	std::ifstream file(binaryPath, std::ios::binary);
+	GLenum format;
+	if (!file.read((char*)&format, sizeof(format)))
+	{
+		return false;
+	}
+	std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	glProgramBinary(ID, format, binary.data(), (GLsizei)binary.size());
+	//A driver update can reject old binaries, the sources are compiled again then
+	GLint success = GL_FALSE;
+	glGetProgramiv(ID, GL_LINK_STATUS, &success);
+	return success == GL_TRUE;
+}
 
+void Shader::saveProgramBinary() const
+{
+	GLint length = 0;
+	glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+	{
+		return;
+	}
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(ID, length, NULL, &format, binary.data());
+	//Written to a temporary file first, so that a job running at the same time never reads half a binary
+	uint64_t unique = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint64_t)(uintptr_t)this;
+	std::string tempPath = binaryPath + ".tmp" + std::to_string((unsigned long long)unique);
+	{
+		std::ofstream file(tempPath, std::ios::binary);
+		file.write((const char*)&format, sizeof(format));
+		file.write(binary.data(), binary.size());
+		if (!file)
+		{
+			std::cout << "Failed to write the program binary " << binaryPath << std::endl;
+			return;
+		}
+	}
+	//Fails where renaming over an existing file is not allowed, the other job's binary is as good
+	if (std::rename(tempPath.c_str(), binaryPath.c_str()) != 0)
+	{
+		std::remove(tempPath.c_str());
+	}
 }
 
 void Shader::use()
 {
-	glUseProgram(ID);
+	if (!built)
+	{
+		finishBuild();
+	}
+	glc::useProgram(ID);
 }
 
 void Shader::setBool(const std::string & name, bool value) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+	glc::uniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
 }
 
 void Shader::setInt(const std::string & name, int value) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+	glc::uniform1i(glGetUniformLocation(ID, name.c_str()), value);
 }
 
 void Shader::setFloat(const std::string & name, float value) const
 {
-	glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+	glc::uniform1f(glGetUniformLocation(ID, name.c_str()), value);
 }
 
 void Shader::setVec2(const std::string & name, const glm::vec2& value) const
 {
-	glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glc::uniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
 }
 
 void Shader::setVec2(const std::string & name, float x, float y) const
 {
-	glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+	glc::uniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
 }
 
 void Shader::setVec3(const std::string & name, const glm::vec3 & value) const
 {
-	glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glc::uniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
 }
 
 void Shader::setVec3(const std::string & name, float x, float y, float z) const
 {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+	glc::uniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
 }
 
 void Shader::setVec3Array(const std::string &name, int count, const glm::vec3 &value) const
 {
-    glUniform3fv(glGetUniformLocation(ID, name.c_str()), count, &value[0]);
+    glc::uniform3fv(glGetUniformLocation(ID, name.c_str()), count, &value[0]);
+}
+
+void Shader::setFloatArray(const std::string& name, int count, const float* values) const
+{
+	glc::uniform1fv(glGetUniformLocation(ID, name.c_str()), count, values);
 }
 
 void Shader::setVec4(const std::string & name, const glm::vec4 & value) const
 {
-	glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+	glc::uniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
 }
 
 void Shader::setVec4(const std::string & name, float x, float y, float z, float w) const
 {
-	glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+	glc::uniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
 }
 
 void Shader::setMat3(const std::string & name, const glm::mat3 & matrix) const
 {
-	glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+	glc::uniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
 }
 
 void Shader::setMat4(const std::string & name, const glm::mat4 & matrix) const
 {
-	glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+	glc::uniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
 }
 
 GLuint Shader::getID() const
@@ -164,7 +350,23 @@ GLuint Shader::getID() const
 	return ID;
 }
 
-void Shader::checkCompileErrors(GLuint IDtoCheck, std::string type) const
+std::string Shader::insertDefines(const std::string& code, const std::string& defines) const
+{
+	//#version has to stay the first statement, so the defines go right after its line
+	size_t versionPos = code.find("#version");
+	if (versionPos == std::string::npos)
+	{
+		return defines + code;
+	}
+	size_t lineEnd = code.find('\n', versionPos);
+	if (lineEnd == std::string::npos)
+	{
+		return code + "\n" + defines;
+	}
+	return code.substr(0, lineEnd + 1) + defines + code.substr(lineEnd + 1);
+}
+
+bool Shader::checkCompileErrors(GLuint IDtoCheck, std::string type) const
 {
 	int success;
 	char infoLog[1024];
@@ -175,7 +377,7 @@ void Shader::checkCompileErrors(GLuint IDtoCheck, std::string type) const
 		if (!success)
 		{
 			glGetShaderInfoLog(IDtoCheck, 1024, NULL, infoLog);
-			std::cout << "ERROR::SHADER_COMPILATION_ERROR of type " << type << "\n" << infoLog << std::endl;
+			std::cout << "ERROR::SHADER_COMPILATION_ERROR of type " << type << " in " << name << "\n" << infoLog << std::endl;
 		}
 	}
 	else
@@ -185,9 +387,10 @@ void Shader::checkCompileErrors(GLuint IDtoCheck, std::string type) const
 		if (!success)
 		{
 			glGetProgramInfoLog(IDtoCheck, 1024, NULL, infoLog);
-			std::cout << "ERROR::PROGRAM_LINKING_ERROR of type " << type << "\n" << infoLog << std::endl;
+			std::cout << "ERROR::PROGRAM_LINKING_ERROR of type " << type << " in " << name << "\n" << infoLog << std::endl;
 		}
 
 	}
+	return success != 0;
 }
 
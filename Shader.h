@@ -8,6 +8,7 @@
 
 
 #include <string>
+#include <vector>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -16,9 +17,19 @@
 class Shader
 {
 public:
-	// constructor reads and builds the shader
-	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr);
-	// use/activate the shader
+	// call once after the context is created. Linked programs are cached in binaryCacheDirectory
+	// (empty disables the cache) and compiles run on driver threads where KHR_parallel_shader_compile exists
+	static void setupCompilation(const std::string& binaryCacheDirectory);
+	// constructor reads the shader and starts building it, or loads the cached binary of the same sources.
+	// It does not wait for the compile, so several shaders and other work can overlap with it
+	// defines are inserted right after the #version line of every stage, to build variants of the same sources
+	// captureVaryings are the outputs recorded (interleaved) when the program is used with transform feedback
+	// without a fragmentPath, vertexPath is built as a compute program (GL 4.3)
+	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const std::string& defines = "",
+		   const std::vector<std::string>& captureVaryings = std::vector<std::string>());
+	// true once the program can be used without blocking on the compiler
+	bool isReady() const;
+	// use/activate the shader. The first call waits for the build and reports its errors
 	void use();
 	// utility uniform functions. Note that to call these functions, first you have to activate the shader program
 	void setBool(const std::string &name, bool value) const;
@@ -29,16 +40,33 @@ public:
 	void setVec3(const std::string& name, const glm::vec3& value) const;
 	void setVec3(const std::string& name, float x, float y, float z) const;
     void setVec3Array(const std::string& name, int count, const glm::vec3& value) const;
+	void setFloatArray(const std::string& name, int count, const float* values) const;
 	void setVec4(const std::string& name, const glm::vec4& value) const;
 	void setVec4(const std::string& name, float x, float y, float z, float w) const;
 	void setMat3(const std::string& name, const glm::mat3& matrix) const;
 	void setMat4(const std::string& name, const glm::mat4& matrix) const;
 	GLuint getID() const;
 private:
-	void checkCompileErrors(GLuint shader, std::string type) const;
+	std::string insertDefines(const std::string& code, const std::string& defines) const;
+	bool checkCompileErrors(GLuint shader, std::string type) const;
+	// waits for the compile and link, reports errors and stores the binary
+	void finishBuild();
+	bool loadProgramBinary();
+	void saveProgramBinary() const;
 private:
 	// the program ID
 	GLuint ID;
+	// stages while the build is in flight
+	GLuint vertex;
+	GLuint fragment;
+	GLuint geometry;
+	bool built;
+	std::string name; // source files, for the error messages
+	std::string binaryPath; // cache file of this program, empty if the cache is off
+
+	static std::string binaryCacheDirectory;
+	static std::string driverString; // binaries are only valid for the driver that made them
+	static bool parallelCompile;
 
 };
 
@@ -13,6 +13,16 @@ uniform vec3 eyePos;
 uniform vec3 lightPositions[5];
 uniform vec3 lightIntensities[5];
 uniform int numLights; //Actual number of lights in the scene
+uniform int reducedShading; //Set while progressive refinement draws a moving camera: first light, no highlights
+
+//Surface analysis (see SurfaceAnalysis.h). With colorMode 0 the material is plain grey,
+//otherwise the analysed value is colour mapped into the reflectances.
+uniform int colorMode;
+uniform samplerBuffer analysisValues; //analysisSamples x analysisSamples values per patch
+uniform int analysisOffset; //First value of this patch
+uniform int analysisSamples;
+uniform float analysisRange; //Values of this magnitude get the full colour
+uniform int seamMask; //Edges of this patch that are not G1, bits as in PatchEdge
 
 
 out vec4 FragColor;
@@ -21,6 +31,7 @@ out vec4 FragColor;
 //Ins
 in vec4 fragWorldPos;
 in vec3 fragWorldNor;
+in vec2 fragUV;
 
 vec3 computeLightColor(int lightIndex)
 {
@@ -38,18 +49,52 @@ vec3 computeLightColor(int lightIndex)
     
     vec3 I = lightIntensities[lightIndex];
     vec3 diffuseColor = I * kd * max(0, NdotL);
-    vec3 specularColor = I * ks * pow(max(0, NdotH), phongExponent);
+    vec3 specularColor = reducedShading != 0 ? vec3(0.0) : I * ks * pow(max(0, NdotH), phongExponent);
 
     float distToLightSq = dot(lightPos - vec3(fragWorldPos), lightPos - vec3(fragWorldPos));
     return (diffuseColor + specularColor) / distToLightSq;
 }
 
+//Bilinear between the analysed samples around fragUV
+float analysisValue()
+{
+    vec2 st = clamp(fragUV, 0.0, 1.0) * float(analysisSamples - 1);
+    ivec2 k = min(ivec2(st), ivec2(analysisSamples - 2));
+    vec2 f = st - vec2(k);
+    int i = analysisOffset + k.y * analysisSamples + k.x;
+    float top = mix(texelFetch(analysisValues, i).r, texelFetch(analysisValues, i + 1).r, f.x);
+    float bottom = mix(texelFetch(analysisValues, i + analysisSamples).r, texelFetch(analysisValues, i + analysisSamples + 1).r, f.x);
+    return mix(top, bottom, f.y);
+}
+
+//Diverging map: blue for negative, white for 0, red for positive
+vec3 colorMap(float x)
+{
+    x = clamp(x, -1.0, 1.0);
+    vec3 white = vec3(1.0);
+    return x < 0.0 ? mix(white, vec3(0.2, 0.3, 1.0), -x) : mix(white, vec3(1.0, 0.15, 0.1), x);
+}
+
+bool nearFlaggedSeam()
+{
+    const float width = 0.02;
+    return ((seamMask & 1) != 0 && fragUV.y < width) || ((seamMask & 2) != 0 && fragUV.y > 1.0 - width)
+        || ((seamMask & 4) != 0 && fragUV.x < width) || ((seamMask & 8) != 0 && fragUV.x > 1.0 - width);
+}
+
 void main()
 {
+    if(colorMode != 0)
+    {
+        vec3 mapped = nearFlaggedSeam() ? vec3(1.0, 0.0, 1.0) : colorMap(analysisValue() / analysisRange);
+        ka *= mapped;
+        kd *= mapped;
+    }
     vec3 ambientColor = Iamb * ka;
     //Loop over every light and accumulate the color
     vec3 c = vec3(0.0f);
-    for(int i = 0; i < numLights; ++i)
+    int shadedLights = reducedShading != 0 ? min(numLights, 1) : numLights;
+    for(int i = 0; i < shadedLights; ++i)
     {
         c += computeLightColor(i);
     }
@@ -1,111 +1,175 @@
 #version 410 core
 layout (location = 0) in vec2 uv_in;
 
+//The application prepends the defines of the patch variant (see patchShaderDefines()).
+//Defaults are the bicubic variant.
+#ifndef DEGREE_U
+#define DEGREE_U 3
+#define DEGREE_V 3
+#define RATIONAL 0
+#define INIT_BINOMIALS n_choose_u[0] = 1.0; n_choose_u[1] = 3.0; n_choose_u[2] = 3.0; n_choose_u[3] = 1.0; n_choose_v[0] = 1.0; n_choose_v[1] = 3.0; n_choose_v[2] = 3.0; n_choose_v[3] = 1.0;
+#endif
+
+//Set for the variant that fills the evaluation cache
+#ifndef CAPTURE
+#define CAPTURE 0
+#endif
+
+//Set for the variant drawn with multi draw indirect (see IndirectRenderer): every draw is one
+//instance whose attributes are the patch's record, in place of the per patch uniforms
+#ifndef INDIRECT
+#define INDIRECT 0
+#endif
+
+#define NU (DEGREE_U + 1)
+#define NV (DEGREE_V + 1)
 
 //Prestore n_choose_i's as we know them already.
 //int n_choose_i[4] = int[4](1, 3, 3, 1); //This initialization did not work on Windows Machine I tried
-int n_choose_i[4]; //Just declare here for compatibility
+float n_choose_u[NU]; //Just declare here for compatibility
+float n_choose_v[NV];
 
 //Uniforms
 uniform mat4 modelMat;
 uniform mat4 PV;
-uniform vec3 P[16]; //Control points. Layout is row major.
+//Heightfield control grid shared by all patches (see ControlGrid). Only z is stored,
+//x and y are reconstructed from the position in the patch's block.
+uniform samplerBuffer controlHeights;
+uniform samplerBuffer controlWeights; //Only read by rational variants
+uniform int gridOffset; //Top left control point of this patch
+uniform int gridStride; //Number of control points in a row of the grid
+#if INDIRECT
+layout (location = 1) in int patchGridOffset;
+layout (location = 2) in vec3 patchTranslation;
+uniform mat4 sceneMat; //Rotation of the whole scene
+uniform vec3 patchScaling;
+#endif
+int patchStart; //gridOffset of the patch being drawn
 
 //Outs
 out vec4 fragWorldPos;
 out vec3 fragWorldNor;
+out vec2 fragUV; //Looks up the surface analysis
+#if CAPTURE
+//Evaluation cache: the patch frame position and normal are captured with transform feedback
+out vec3 capturedPos;
+out vec3 capturedNor;
+#endif
 
 
-float bern(int i, float t)
+//pow(0, 0) is undefined in GLSL, so integer powers are computed by hand
+float ipow(float x, int e)
 {
-    return n_choose_i[i] * pow(t, i) * pow(1-t, 3-i);
+    float r = 1.0;
+    for(int k = 0; k < e; ++k)
+    {
+        r *= x;
+    }
+    return r;
 }
 
-
-vec3 eval_bezier()
+float bern(float c, int n, int i, float t)
 {
-    float u = uv_in[0];
-    float v = uv_in[1];
-    //Go over the Control Points and compute Bernstein Polynomials
-    vec3 p = vec3(0.0); //Must initalize, otherwise it does not work lol
-    for(int i = 0; i < 4; ++i) //along v
-    {
-        for(int j = 0; j < 4; ++j) //along u
-        {
-            p += bern(i, v) * bern(j, u) * P[4*i + j];
-        }
-    }
-    
-    return p;
+    return c * ipow(t, i) * ipow(1 - t, n - i);
 }
 
-vec3 eval_dU()
+float dBern(float c, int n, int i, float t)
 {
-    float u = uv_in[0];
-    float v = uv_in[1];
-    vec3 vCurve[4]; //v curve values
-    //Evaluate the constant scalars of the dU's
-    for(int j = 0; j < 4; ++j)
+    float d = 0.0;
+    if(i > 0)
     {
-        //Evaluate the curve along P
-        vec3 p = vec3(0.0f);
-        for(int i = 0; i < 4; ++i)
-        {
-            p += bern(i, v) * P[4*i + j];     
-        }
-
-        vCurve[j] = p;
+        d += i * ipow(t, i - 1) * ipow(1 - t, n - i);
     }
-
-    //Compute dU:
-    return -3 * (1 - u) * (1 - u) * vCurve[0] + 
-    (3 * (1 - u) * (1 - u) - 6 * u * (1 - u)) * vCurve[1] + 
-    (6 * u * (1 - u) - 3 * u * u) * vCurve[2] + 
-    3 * u * u * vCurve[3]; 
+    if(i < n)
+    {
+        d -= (n - i) * ipow(t, i) * ipow(1 - t, n - i - 1);
+    }
+    return c * d;
 }
 
 
-vec3 eval_dV()
+/*
+    Evaluates the homogeneous point and its u and v derivatives in one pass.
+    For polynomial patches w stays 1 and its derivatives stay 0.
+*/
+void eval_bezier(out vec3 p, out vec3 dU, out vec3 dV)
 {
     float u = uv_in[0];
     float v = uv_in[1];
-    vec3 uCurve[4]; //u curve values
-    //Evaluate the constant scalars of the dV's
-    for(int i = 0; i < 4; ++i)
+    float Bu[NU], dBu[NU], Bv[NV], dBv[NV];
+    for(int j = 0; j < NU; ++j)
+    {
+        Bu[j] = bern(n_choose_u[j], DEGREE_U, j, u);
+        dBu[j] = dBern(n_choose_u[j], DEGREE_U, j, u);
+    }
+    for(int i = 0; i < NV; ++i)
+    {
+        Bv[i] = bern(n_choose_v[i], DEGREE_V, i, v);
+        dBv[i] = dBern(n_choose_v[i], DEGREE_V, i, v);
+    }
+
+    //Go over the Control Points and accumulate the Bernstein Polynomials
+    vec3 H = vec3(0.0); //Must initalize, otherwise it does not work lol
+    vec3 Hu = vec3(0.0);
+    vec3 Hv = vec3(0.0);
+    float w = 1.0;
+    float wu = 0.0;
+    float wv = 0.0;
+#if RATIONAL
+    w = 0.0;
+#endif
+    for(int i = 0; i < NV; ++i) //along v
     {
-        //Evaluate the curve along P
-        vec3 p = vec3(0.0f);
-        for(int j = 0; j < 4; ++j)
+        for(int j = 0; j < NU; ++j) //along u
         {
-            p += bern(j, u) * P[4*i + j];
+            int k = patchStart + i * gridStride + j;
+            vec3 P = vec3(float(j) / float(DEGREE_U) - 0.5, 0.5 - float(i) / float(DEGREE_V), texelFetch(controlHeights, k).r);
+#if RATIONAL
+            float cw = texelFetch(controlWeights, k).r;
+            w += Bv[i] * Bu[j] * cw;
+            wu += Bv[i] * dBu[j] * cw;
+            wv += dBv[i] * Bu[j] * cw;
+#else
+            float cw = 1.0;
+#endif
+            vec3 cp = cw * P;
+            H += Bv[i] * Bu[j] * cp;
+            Hu += Bv[i] * dBu[j] * cp;
+            Hv += dBv[i] * Bu[j] * cp;
         }
-
-        uCurve[i] = p;
     }
 
-    return -3 * (1 - v) * (1 - v) * uCurve[0] + 
-    (3 * (1 - v) * (1 - v) - 6 * v * (1 - v)) * uCurve[1] + 
-    (6 * v * (1 - v) - 3 * v * v) * uCurve[2] + 
-    3 * v * v * uCurve[3]; 
-
+    //Quotient rule on H / w
+    p = H / w;
+    dU = (Hu - wu * p) / w;
+    dV = (Hv - wv * p) / w;
 }
 
 void main()
 {
-    //Initialize the global array 
-    n_choose_i[0] = 1;
-    n_choose_i[1] = 3;
-    n_choose_i[2] = 3;
-    n_choose_i[3] = 1;
-
-    vec3 p = eval_bezier();
-    //p = vec3(uv_in-0.5, 0.0);
-    vec3 dU = eval_dU();
-    vec3 dV = eval_dV();
+    //Initialize the global arrays
+    INIT_BINOMIALS
+#if INDIRECT
+    patchStart = patchGridOffset;
+    //Translate then scale, as renderBezierSurface() builds it
+    mat4 model = sceneMat * mat4(vec4(patchScaling.x, 0.0, 0.0, 0.0), vec4(0.0, patchScaling.y, 0.0, 0.0),
+                                 vec4(0.0, 0.0, patchScaling.z, 0.0), vec4(patchTranslation, 1.0));
+#else
+    patchStart = gridOffset;
+    mat4 model = modelMat;
+#endif
+
+    vec3 p, dU, dV;
+    eval_bezier(p, dU, dV);
     vec3 n = normalize(cross(dV, dU));
+#if CAPTURE
+    capturedPos = p;
+    capturedNor = n;
+#endif
 
-    fragWorldPos = modelMat * vec4(p, 1.0);
-	fragWorldNor = inverse(transpose(mat3x3(modelMat))) * n;
+    fragWorldPos = model * vec4(p, 1.0);
+	fragWorldNor = inverse(transpose(mat3x3(model))) * n;
+    fragUV = uv_in;
 
-    gl_Position = PV * modelMat * vec4(p, 1.0);
+    gl_Position = PV * model * vec4(p, 1.0);
 }
@@ -0,0 +1,23 @@
+#version 410 core
+//Positions and normals evaluated by bezier.vert into the evaluation cache, in the patch frame
+layout (location = 0) in vec3 pos_in;
+layout (location = 1) in vec3 nor_in;
+
+//Uniforms
+uniform mat4 modelMat;
+uniform mat4 PV;
+
+//Outs
+out vec4 fragWorldPos;
+out vec3 fragWorldNor;
+out vec2 fragUV; //Unused: surfaces coloured by the analysis are drawn through bezier.vert
+
+
+void main()
+{
+    fragWorldPos = modelMat * vec4(pos_in, 1.0);
+	fragWorldNor = inverse(transpose(mat3x3(modelMat))) * nor_in;
+    fragUV = vec2(0.0);
+
+    gl_Position = PV * modelMat * vec4(pos_in, 1.0);
+}
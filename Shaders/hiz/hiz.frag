@@ -0,0 +1,25 @@
+#version 410 core
+//One level of the Hi-Z pyramid: the farthest depth of the 2x2 texels of the level above.
+//The depth texture is limited to the source level, so lod 0 is that level.
+
+uniform sampler2D sourceDepth;
+
+
+void main()
+{
+    ivec2 sourceSize = textureSize(sourceDepth, 0);
+    ivec2 lastTexel = sourceSize - 1;
+    ivec2 source = 2 * ivec2(gl_FragCoord.xy);
+    //The last texel of an odd row or column has no pair in this level and is folded into the
+    //texel next to it, so level L still covers every pixel under texel (x >> L, y >> L)
+    ivec2 last = min(source + 1 + ivec2(equal(source + 2, lastTexel)), lastTexel);
+    float farthest = 0.0;
+    for(int y = source.y; y <= last.y; ++y)
+    {
+        for(int x = source.x; x <= last.x; ++x)
+        {
+            farthest = max(farthest, texelFetch(sourceDepth, ivec2(x, y), 0).r);
+        }
+    }
+    gl_FragDepth = farthest;
+}
@@ -0,0 +1,8 @@
+#version 410 core
+//One triangle over the whole target, no vertex buffer needed
+
+void main()
+{
+    vec2 corner = vec2((gl_VertexID & 1) != 0 ? 3.0 : -1.0, (gl_VertexID & 2) != 0 ? 3.0 : -1.0);
+    gl_Position = vec4(corner, 0.0, 1.0);
+}
@@ -0,0 +1,350 @@
+#include "SoftwareRasterizer.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "BezierSurface.h"
+
+
+//Constants of bezier.frag
+static const glm::vec3 AMBIENT_INTENSITY(0.8f, 0.8f, 0.8f);
+static const glm::vec3 KA(0.3f, 0.3f, 0.3f);
+static const glm::vec3 KD(0.8f, 0.8f, 0.8f);
+static const glm::vec3 KS(0.8f, 0.8f, 0.8f);
+static const float PHONG_EXPONENT = 400.0f;
+//Clear color of the GL path
+static const glm::vec3 CLEAR_COLOR(0.1f, 0.1f, 0.1f);
+
+
+//Runs task(t) for t in [0, numThreads), t = 0 on the calling thread
+template<typename Task>
+static void runOnThreads(int numThreads, const Task& task)
+{
+    std::vector<std::thread> threads;
+    for(int t = 1; t < numThreads; ++t)
+    {
+        threads.emplace_back(task, t);
+    }
+    task(0);
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+SoftwareRasterizer::SoftwareRasterizer(int numThreads)
+    : numThreads(numThreads), tilesX(0), tilesY(0)
+{
+    if(this->numThreads <= 0)
+    {
+        this->numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    setSampleMesh(10);
+}
+
+
+void SoftwareRasterizer::setSampleMesh(int numSamples)
+{
+    buildSampleMesh(numSamples, uv, indices, false);
+}
+
+
+int SoftwareRasterizer::getNumThreads() const
+{
+    return numThreads;
+}
+
+
+RasterStats SoftwareRasterizer::render(const ControlGrid& grid, const std::vector<glm::mat4>& models,
+                                       const std::vector<glm::vec3>& lightPositions, const std::vector<glm::vec3>& lightIntensities,
+                                       const RasterView& view, std::vector<unsigned char>& rgb)
+{
+    RasterStats stats = {};
+    stats.numThreads = numThreads;
+    auto start = std::chrono::steady_clock::now();
+    int numPatches = numPatchesX(grid) * numPatchesY(grid);
+    rgb.resize((size_t)view.width * view.height * 3);
+
+    //1. Vertices, split by patches
+    auto stageStart = std::chrono::steady_clock::now();
+    vertices.resize((size_t)numPatches * uv.size());
+    runOnThreads(numThreads, [&](int t)
+    {
+        shadeVertices(grid, models, view, numPatches * t / numThreads, numPatches * (t + 1) / numThreads);
+    });
+    stats.vertexSeconds = secondsSince(stageStart);
+
+    //2. Bins, split by triangles. Thread t gets the t-th range, so walking the bins of the
+    //threads in order walks the triangles in submission order.
+    stageStart = std::chrono::steady_clock::now();
+    tilesX = (view.width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (view.height + TILE_SIZE - 1) / TILE_SIZE;
+    bins.resize(numThreads);
+    for(std::vector<std::vector<uint32_t>>& threadBins : bins)
+    {
+        threadBins.resize((size_t)tilesX * tilesY);
+        for(std::vector<uint32_t>& bin : threadBins)
+        {
+            bin.clear();
+        }
+    }
+    size_t numTriangles = (size_t)numPatches * (indices.size() / 3);
+    runOnThreads(numThreads, [&](int t)
+    {
+        binTriangles(view, t, numTriangles * t / numThreads, numTriangles * (t + 1) / numThreads);
+    });
+    for(const std::vector<std::vector<uint32_t>>& threadBins : bins)
+    {
+        for(const std::vector<uint32_t>& bin : threadBins)
+        {
+            stats.numTriangles += bin.size();
+        }
+    }
+    stats.binSeconds = secondsSince(stageStart);
+
+    //3. Tiles, handed out one at a time since their costs differ a lot
+    stageStart = std::chrono::steady_clock::now();
+    std::atomic<int> nextTile(0);
+    runOnThreads(numThreads, [&](int /*t*/)
+    {
+        for(int tile = nextTile++; tile < tilesX * tilesY; tile = nextTile++)
+        {
+            rasterizeTile(tile, view, lightPositions, lightIntensities, rgb);
+        }
+    });
+    stats.rasterSeconds = secondsSince(stageStart);
+    stats.seconds = secondsSince(start);
+    return stats;
+}
+
+
+void SoftwareRasterizer::shadeVertices(const ControlGrid& grid, const std::vector<glm::mat4>& models, const RasterView& view, int first, int last)
+{
+    HeightfieldEvaluator evaluate = getHeightfieldEvaluator(grid.degreeU, grid.degreeV, isRational(grid));
+    int numBezierX = numPatchesX(grid);
+    for(int patch = first; patch < last; ++patch)
+    {
+        const glm::mat4& model = models[patch];
+        glm::mat3 normalMatrix = glm::inverse(glm::transpose(glm::mat3(model)));
+        int offset = patchOffset(grid, patch / numBezierX, patch % numBezierX);
+        const float* Z = &grid.heights[offset];
+        const float* W = isRational(grid) ? &grid.weights[offset] : nullptr;
+        RasterVertex* out = &vertices[(size_t)patch * uv.size()];
+        for(size_t k = 0; k < uv.size(); ++k)
+        {
+            //Same steps as bezier.vert
+            SurfaceDerivatives d = evaluate(Z, W, grid.numPx, uv[k].x / 65535.0f, uv[k].y / 65535.0f);
+            glm::vec3 n = glm::normalize(glm::cross(d.dV, d.dU));
+            glm::vec4 world = model * glm::vec4(d.p, 1.0f);
+            glm::vec4 clip = view.PV * world;
+            RasterVertex& v = out[k];
+            v.worldPos = glm::vec3(world);
+            v.worldNor = normalMatrix * n;
+            v.behindEye = clip.w <= 1e-6f;
+            v.invW = v.behindEye ? 0.0f : 1.0f / clip.w;
+            //Viewport transform, window y grows downwards
+            v.x = (clip.x * v.invW * 0.5f + 0.5f) * view.width;
+            v.y = (0.5f - clip.y * v.invW * 0.5f) * view.height;
+            v.z = clip.z * v.invW * 0.5f + 0.5f;
+        }
+    }
+}
+
+
+const SoftwareRasterizer::RasterVertex& SoftwareRasterizer::vertexOf(uint32_t triangle, int corner) const
+{
+    size_t trianglesPerPatch = indices.size() / 3;
+    size_t patch = triangle / trianglesPerPatch;
+    size_t local = triangle % trianglesPerPatch;
+    return vertices[patch * uv.size() + indices[3*local + corner]];
+}
+
+
+void SoftwareRasterizer::binTriangles(const RasterView& view, int thread, size_t first, size_t last)
+{
+    std::vector<std::vector<uint32_t>>& threadBins = bins[thread];
+    for(size_t t = first; t < last; ++t)
+    {
+        const RasterVertex& a = vertexOf((uint32_t)t, 0);
+        const RasterVertex& b = vertexOf((uint32_t)t, 1);
+        const RasterVertex& c = vertexOf((uint32_t)t, 2);
+        if(a.behindEye || b.behindEye || c.behindEye)
+        {
+            continue;
+        }
+        //Entirely in front of the near or behind the far plane
+        if((a.z < 0.0f && b.z < 0.0f && c.z < 0.0f) || (a.z > 1.0f && b.z > 1.0f && c.z > 1.0f))
+        {
+            continue;
+        }
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if(area == 0.0f)
+        {
+            continue;
+        }
+        //Pixels whose centers can be covered
+        int minX = std::max(0, (int)std::floor(std::min({ a.x, b.x, c.x }) - 0.5f));
+        int maxX = std::min(view.width - 1, (int)std::ceil(std::max({ a.x, b.x, c.x }) - 0.5f));
+        int minY = std::max(0, (int)std::floor(std::min({ a.y, b.y, c.y }) - 0.5f));
+        int maxY = std::min(view.height - 1, (int)std::ceil(std::max({ a.y, b.y, c.y }) - 0.5f));
+        if(minX > maxX || minY > maxY)
+        {
+            continue;
+        }
+        for(int ty = minY / TILE_SIZE; ty <= maxY / TILE_SIZE; ++ty)
+        {
+            for(int tx = minX / TILE_SIZE; tx <= maxX / TILE_SIZE; ++tx)
+            {
+                threadBins[ty * tilesX + tx].push_back((uint32_t)t);
+            }
+        }
+    }
+}
+
+
+//Blinn-Phong of bezier.frag
+static glm::vec3 shade(const glm::vec3& pos, const glm::vec3& nor, const glm::vec3& eye,
+                       const std::vector<glm::vec3>& lightPositions, const std::vector<glm::vec3>& lightIntensities)
+{
+    glm::vec3 c(0.0f);
+    glm::vec3 N = glm::normalize(nor);
+    glm::vec3 V = glm::normalize(eye - pos);
+    for(size_t i = 0; i < lightPositions.size(); ++i)
+    {
+        glm::vec3 toLight = lightPositions[i] - pos;
+        glm::vec3 L = glm::normalize(toLight);
+        glm::vec3 H = glm::normalize(L + V);
+        float NdotL = glm::dot(N, L);
+        float NdotH = glm::dot(N, H);
+        glm::vec3 diffuseColor = lightIntensities[i] * KD * std::max(0.0f, NdotL);
+        glm::vec3 specularColor = lightIntensities[i] * KS * std::pow(std::max(0.0f, NdotH), PHONG_EXPONENT);
+        c += (diffuseColor + specularColor) / glm::dot(toLight, toLight);
+    }
+    return c + AMBIENT_INTENSITY * KA;
+}
+
+
+void SoftwareRasterizer::rasterizeTile(int tile, const RasterView& view, const std::vector<glm::vec3>& lightPositions,
+                                       const std::vector<glm::vec3>& lightIntensities, std::vector<unsigned char>& rgb) const
+{
+    int x0 = (tile % tilesX) * TILE_SIZE;
+    int y0 = (tile / tilesX) * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, view.width);
+    int y1 = std::min(y0 + TILE_SIZE, view.height);
+    //Depth rows are padded by LANES, the last lanes of a row can be tested without a bounds check
+    float depth[TILE_SIZE * DEPTH_STRIDE];
+    glm::vec3 color[TILE_SIZE * TILE_SIZE];
+    std::fill(depth, depth + TILE_SIZE * DEPTH_STRIDE, 1.0f);
+    std::fill(color, color + TILE_SIZE * TILE_SIZE, CLEAR_COLOR);
+
+    for(const std::vector<std::vector<uint32_t>>& threadBins : bins)
+    {
+        for(uint32_t triangle : threadBins[tile])
+        {
+            const RasterVertex* v[3] = { &vertexOf(triangle, 0), &vertexOf(triangle, 1), &vertexOf(triangle, 2) };
+            float area = (v[1]->x - v[0]->x) * (v[2]->y - v[0]->y) - (v[1]->y - v[0]->y) * (v[2]->x - v[0]->x);
+            //Both windings are drawn, make the edge functions positive inside
+            if(area < 0.0f)
+            {
+                std::swap(v[1], v[2]);
+                area = -area;
+            }
+            //Edge k is opposite vertex k: E_k(x, y) = A_k x + B_k y + C_k
+            float A[3], B[3], C[3];
+            int topLeft[3];
+            for(int k = 0; k < 3; ++k)
+            {
+                const RasterVertex& p = *v[(k + 1) % 3];
+                const RasterVertex& q = *v[(k + 2) % 3];
+                A[k] = p.y - q.y;
+                B[k] = q.x - p.x;
+                C[k] = p.x * q.y - p.y * q.x;
+                //Pixels exactly on a shared edge belong to one triangle only
+                topLeft[k] = (A[k] < 0.0f) || (A[k] == 0.0f && B[k] < 0.0f);
+            }
+            float invArea = 1.0f / area;
+
+            int minX = std::max(x0, (int)std::floor(std::min({ v[0]->x, v[1]->x, v[2]->x }) - 0.5f));
+            int maxX = std::min(x1 - 1, (int)std::ceil(std::max({ v[0]->x, v[1]->x, v[2]->x }) - 0.5f));
+            int minY = std::max(y0, (int)std::floor(std::min({ v[0]->y, v[1]->y, v[2]->y }) - 0.5f));
+            int maxY = std::min(y1 - 1, (int)std::ceil(std::max({ v[0]->y, v[1]->y, v[2]->y }) - 0.5f));
+            for(int y = minY; y <= maxY; ++y)
+            {
+                float py = y + 0.5f;
+                for(int xs = minX; xs <= maxX; xs += LANES)
+                {
+                    //Edge functions and depth of LANES pixels in lockstep. Tests are combined with bitwise
+                    //ands so the loop has no branches and vectorizes, lanes past maxX read the row's padding.
+                    const float* depthRow = &depth[(y - y0) * DEPTH_STRIDE + (xs - x0)];
+                    float l[3][LANES];
+                    float z[LANES];
+                    int inside[LANES];
+                    int any = 0;
+                    for(int lane = 0; lane < LANES; ++lane)
+                    {
+                        float px = xs + lane + 0.5f;
+                        float e0 = A[0] * px + B[0] * py + C[0];
+                        float e1 = A[1] * px + B[1] * py + C[1];
+                        float e2 = A[2] * px + B[2] * py + C[2];
+                        l[0][lane] = e0 * invArea;
+                        l[1][lane] = e1 * invArea;
+                        l[2][lane] = e2 * invArea;
+                        z[lane] = l[0][lane] * v[0]->z + l[1][lane] * v[1]->z + l[2][lane] * v[2]->z;
+                        int in = (xs + lane <= maxX)
+                                 & ((e0 > 0.0f) | ((e0 == 0.0f) & topLeft[0]))
+                                 & ((e1 > 0.0f) | ((e1 == 0.0f) & topLeft[1]))
+                                 & ((e2 > 0.0f) | ((e2 == 0.0f) & topLeft[2]))
+                                 & (z[lane] >= 0.0f) & (z[lane] <= 1.0f) & (z[lane] < depthRow[lane]);
+                        inside[lane] = in;
+                        any |= in;
+                    }
+                    if(!any)
+                    {
+                        continue;
+                    }
+                    for(int lane = 0; lane < LANES; ++lane)
+                    {
+                        if(!inside[lane])
+                        {
+                            continue;
+                        }
+                        //Perspective correct weights
+                        float w0 = l[0][lane] * v[0]->invW;
+                        float w1 = l[1][lane] * v[1]->invW;
+                        float w2 = l[2][lane] * v[2]->invW;
+                        float invSum = 1.0f / (w0 + w1 + w2);
+                        glm::vec3 pos = (w0 * v[0]->worldPos + w1 * v[1]->worldPos + w2 * v[2]->worldPos) * invSum;
+                        glm::vec3 nor = (w0 * v[0]->worldNor + w1 * v[1]->worldNor + w2 * v[2]->worldNor) * invSum;
+                        int d = (y - y0) * TILE_SIZE + (xs + lane - x0);
+                        depth[(y - y0) * DEPTH_STRIDE + (xs + lane - x0)] = z[lane];
+                        color[d] = shade(pos, nor, view.eye, lightPositions, lightIntensities);
+                    }
+                }
+            }
+        }
+    }
+
+    //Tiles do not overlap, so they write the image without locking. Rows from the bottom.
+    for(int y = y0; y < y1; ++y)
+    {
+        unsigned char* row = &rgb[((size_t)(view.height - 1 - y) * view.width + x0) * 3];
+        for(int x = x0; x < x1; ++x)
+        {
+            const glm::vec3& c = color[(y - y0) * TILE_SIZE + (x - x0)];
+            for(int k = 0; k < 3; ++k)
+            {
+                *row++ = (unsigned char)std::lround(std::min(std::max(c[k], 0.0f), 1.0f) * 255.0f);
+            }
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+#ifndef SOFTWARE_RASTERIZER_H
+#define SOFTWARE_RASTERIZER_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "ControlGrid.h"
+
+
+struct RasterView
+{
+    glm::mat4 PV;
+    glm::vec3 eye;
+    int width;
+    int height;
+};
+
+struct RasterStats
+{
+    int numThreads;
+    size_t numTriangles; //Triangles that reached the bins
+    double vertexSeconds; //Patch evaluation and projection
+    double binSeconds;
+    double rasterSeconds;
+    double seconds;
+};
+
+
+/*
+    CPU backend for the patch renderer. Produces the image the GL path does: the same sample
+    mesh, the same evaluators (BezierPatch, through the grid's HeightfieldEvaluator) and the
+    Blinn-Phong model of bezier.frag. Each frame runs in three parallel stages:
+      1. vertices: every sample of every patch is evaluated, lit data is kept in world space
+      2. binning: triangles are sorted into screen tiles, each thread fills its own bins in
+         submission order so the result does not depend on the thread count
+      3. raster: threads take whole tiles and walk their triangles with edge functions over
+         LANES pixels at a time, with a depth test and perspective correct interpolation
+    Triangles crossing the near plane are dropped rather than clipped.
+*/
+class SoftwareRasterizer
+{
+public:
+    //0 threads picks one per core
+    explicit SoftwareRasterizer(int numThreads = 0);
+
+    void setSampleMesh(int numSamples);
+    int getNumThreads() const;
+    /*
+        Draws patch (i, j) of the grid with models[i * numPatchesX(grid) + j]. rgb receives
+        width * height RGB8 pixels, rows from the bottom like glReadPixels.
+    */
+    RasterStats render(const ControlGrid& grid, const std::vector<glm::mat4>& models,
+                       const std::vector<glm::vec3>& lightPositions, const std::vector<glm::vec3>& lightIntensities,
+                       const RasterView& view, std::vector<unsigned char>& rgb);
+
+private:
+    static constexpr int TILE_SIZE = 32;
+    static constexpr int LANES = 8;
+    static constexpr int DEPTH_STRIDE = TILE_SIZE + LANES;
+
+    struct RasterVertex
+    {
+        float x; //Window coordinates, y down
+        float y;
+        float z; //Depth in [0, 1]
+        float invW;
+        glm::vec3 worldPos;
+        glm::vec3 worldNor;
+        bool behindEye;
+    };
+
+    void shadeVertices(const ControlGrid& grid, const std::vector<glm::mat4>& models, const RasterView& view, int first, int last);
+    void binTriangles(const RasterView& view, int thread, size_t first, size_t last);
+    void rasterizeTile(int tile, const RasterView& view, const std::vector<glm::vec3>& lightPositions,
+                       const std::vector<glm::vec3>& lightIntensities, std::vector<unsigned char>& rgb) const;
+    const RasterVertex& vertexOf(uint32_t triangle, int corner) const;
+
+private:
+    int numThreads;
+    //Sample mesh shared by all patches
+    std::vector<glm::u16vec2> uv;
+    std::vector<uint32_t> indices;
+    //Per frame, reused between frames
+    std::vector<RasterVertex> vertices; //numPatches * uv.size()
+    int tilesX;
+    int tilesY;
+    std::vector<std::vector<std::vector<uint32_t>>> bins; //[thread][tile] triangle ids
+};
+
+#endif
@@ -0,0 +1,328 @@
+#include "SurfaceAnalysis.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "BezierPatch.h"
+
+
+static const int PATCHES_PER_TASK = 64;
+
+
+//Values, first and second derivatives of the basis functions at every sample, function major
+struct BasisTable
+{
+    int order;
+    std::vector<float> B;
+    std::vector<float> dB;
+    std::vector<float> d2B;
+};
+
+template<int N>
+static void tabulate(int samples, BasisTable& table)
+{
+    table.order = N + 1;
+    table.B.resize((N + 1) * samples);
+    table.dB.resize((N + 1) * samples);
+    table.d2B.resize((N + 1) * samples);
+    for(int a = 0; a < samples; ++a)
+    {
+        float B[N + 1], dB[N + 1], d2B[N + 1];
+        BernsteinBasis<N>::evaluate(a / float(samples - 1), B, dB, d2B);
+        for(int j = 0; j <= N; ++j)
+        {
+            table.B[j * samples + a] = B[j];
+            table.dB[j * samples + a] = dB[j];
+            table.d2B[j * samples + a] = d2B[j];
+        }
+    }
+}
+
+static_assert(MAX_PATCH_DEGREE == 5, "tabulateBasis() dispatches on every supported degree");
+
+static void tabulateBasis(int degree, int samples, BasisTable& table)
+{
+    switch(degree)
+    {
+        case 1: tabulate<1>(samples, table); break;
+        case 2: tabulate<2>(samples, table); break;
+        case 3: tabulate<3>(samples, table); break;
+        case 4: tabulate<4>(samples, table); break;
+        default: tabulate<5>(samples, table); break;
+    }
+}
+
+
+//Homogeneous channels of a control point: w * x, w * y, w * z and w
+static const int CHANNELS = 4;
+
+//Per thread buffers of analyzePatch()
+struct AnalysisScratch
+{
+    std::vector<float> control; //[row][column][channel]
+    std::vector<float> rows; //[derivative along u][row][channel][sample along u]
+    std::vector<float> sums; //[H, Hu, Hv, Huu, Huv, Hvv][channel][sample along u]
+};
+
+//Positions (in the layout, so neighbours compare directly) and unit normals along the edges
+struct EdgeSamples
+{
+    std::vector<glm::vec3> positions; //[patch][edge][sample]
+    std::vector<glm::vec3> normals;
+    std::vector<char> valid; //False where the normal is undefined
+};
+
+//Index of a PatchEdge bit in EdgeSamples
+enum EdgeSlot { SLOT_TOP, SLOT_BOTTOM, SLOT_LEFT, SLOT_RIGHT };
+
+
+static void analyzePatch(const ControlGrid& grid, int patch, float s, const BasisTable& basisU, const BasisTable& basisV,
+                         int n, AnalysisScratch& scratch, SurfaceAnalysis& result, EdgeSamples& edges)
+{
+    int NU = grid.degreeU + 1;
+    int NV = grid.degreeV + 1;
+    int i = patch / numPatchesX(grid);
+    int j = patch % numPatchesX(grid);
+    int offset = patchOffset(grid, i, j);
+    bool rational = isRational(grid);
+
+    //Control points in the scene frame, x and y as layoutBezierSurfaces() scales them
+    float* control = scratch.control.data();
+    for(int r = 0; r < NV; ++r)
+    {
+        for(int c = 0; c < NU; ++c)
+        {
+            float w = rational ? grid.weights[offset + r * grid.numPx + c] : 1.0f;
+            float* cp = &control[(r * NU + c) * CHANNELS];
+            cp[0] = w * s * (c / float(grid.degreeU) - 0.5f);
+            cp[1] = w * s * (0.5f - r / float(grid.degreeV));
+            cp[2] = w * grid.heights[offset + r * grid.numPx + c];
+            cp[3] = w;
+        }
+    }
+
+    //Along u: every control row against the value, first and second derivative tables
+    const std::vector<float>* tablesU[3] = { &basisU.B, &basisU.dB, &basisU.d2B };
+    float* rows = scratch.rows.data();
+    std::fill(scratch.rows.begin(), scratch.rows.end(), 0.0f);
+    for(int d = 0; d < 3; ++d)
+    {
+        for(int r = 0; r < NV; ++r)
+        {
+            for(int c = 0; c < NU; ++c)
+            {
+                const float* basis = &(*tablesU[d])[c * n];
+                for(int ch = 0; ch < CHANNELS; ++ch)
+                {
+                    float coefficient = control[(r * NU + c) * CHANNELS + ch];
+                    float* out = &rows[((d * NV + r) * CHANNELS + ch) * n];
+                    for(int a = 0; a < n; ++a)
+                    {
+                        out[a] += coefficient * basis[a];
+                    }
+                }
+            }
+        }
+    }
+
+    //Along v, one row of samples at a time
+    float* sums = scratch.sums.data();
+    size_t patchBase = (size_t)patch * n * n;
+    glm::vec3 layout(j * s, -i * s, 0.0f);
+    for(int b = 0; b < n; ++b)
+    {
+        std::fill(scratch.sums.begin(), scratch.sums.end(), 0.0f);
+        for(int r = 0; r < NV; ++r)
+        {
+            float bv = basisV.B[r * n + b];
+            float dbv = basisV.dB[r * n + b];
+            float d2bv = basisV.d2B[r * n + b];
+            for(int ch = 0; ch < CHANNELS; ++ch)
+            {
+                const float* T0 = &rows[((0 * NV + r) * CHANNELS + ch) * n];
+                const float* T1 = &rows[((1 * NV + r) * CHANNELS + ch) * n];
+                const float* T2 = &rows[((2 * NV + r) * CHANNELS + ch) * n];
+                float* H = &sums[(0 * CHANNELS + ch) * n];
+                float* Hu = &sums[(1 * CHANNELS + ch) * n];
+                float* Hv = &sums[(2 * CHANNELS + ch) * n];
+                float* Huu = &sums[(3 * CHANNELS + ch) * n];
+                float* Huv = &sums[(4 * CHANNELS + ch) * n];
+                float* Hvv = &sums[(5 * CHANNELS + ch) * n];
+                for(int a = 0; a < n; ++a)
+                {
+                    H[a] += bv * T0[a];
+                    Hu[a] += bv * T1[a];
+                    Huu[a] += bv * T2[a];
+                    Hv[a] += dbv * T0[a];
+                    Huv[a] += dbv * T1[a];
+                    Hvv[a] += d2bv * T0[a];
+                }
+            }
+        }
+
+        float* gaussian = &result.gaussian[patchBase + (size_t)b * n];
+        float* mean = &result.mean[patchBase + (size_t)b * n];
+        for(int a = 0; a < n; ++a)
+        {
+            auto channel = [&](int k, int ch){ return sums[(k * CHANNELS + ch) * n + a]; };
+            auto vec = [&](int k){ return glm::vec3(channel(k, 0), channel(k, 1), channel(k, 2)); };
+            //Quotient rule on H / w, as in BezierPatch::evaluate()
+            float invW = 1.0f / channel(0, 3);
+            float wu = channel(1, 3), wv = channel(2, 3);
+            glm::vec3 p = vec(0) * invW;
+            glm::vec3 Su = (vec(1) - wu * p) * invW;
+            glm::vec3 Sv = (vec(2) - wv * p) * invW;
+            glm::vec3 Suu = (vec(3) - 2.0f * wu * Su - channel(3, 3) * p) * invW;
+            glm::vec3 Suv = (vec(4) - wu * Sv - wv * Su - channel(4, 3) * p) * invW;
+            glm::vec3 Svv = (vec(5) - 2.0f * wv * Sv - channel(5, 3) * p) * invW;
+
+            //Fundamental forms
+            glm::vec3 normal = glm::cross(Sv, Su);
+            float length2 = glm::dot(normal, normal);
+            bool valid = length2 > 1e-20f;
+            normal *= valid ? 1.0f / std::sqrt(length2) : 0.0f;
+            float E = glm::dot(Su, Su), F = glm::dot(Su, Sv), G = glm::dot(Sv, Sv);
+            float L = glm::dot(Suu, normal), M = glm::dot(Suv, normal), N = glm::dot(Svv, normal);
+            float det = E * G - F * F;
+            float invDet = valid && det > 0.0f ? 1.0f / det : 0.0f;
+            gaussian[a] = (L * N - M * M) * invDet;
+            mean[a] = 0.5f * (E * N - 2.0f * F * M + G * L) * invDet;
+
+            //Edge samples for the seams
+            auto record = [&](EdgeSlot slot, int k)
+            {
+                size_t e = ((size_t)patch * 4 + slot) * n + k;
+                edges.positions[e] = p + layout;
+                edges.normals[e] = normal;
+                edges.valid[e] = valid;
+            };
+            if(b == 0) record(SLOT_TOP, a);
+            if(b == n - 1) record(SLOT_BOTTOM, a);
+            if(a == 0) record(SLOT_LEFT, b);
+            if(a == n - 1) record(SLOT_RIGHT, b);
+        }
+    }
+}
+
+
+//Compares edge slotA of patch A with edge slotB of patch B, sample by sample
+static void compareEdges(const EdgeSamples& edges, int n, int patchA, EdgeSlot slotA, int patchB, EdgeSlot slotB,
+                         float& maxGap, float& maxAngle)
+{
+    maxGap = 0.0f;
+    maxAngle = 0.0f;
+    for(int k = 0; k < n; ++k)
+    {
+        size_t a = ((size_t)patchA * 4 + slotA) * n + k;
+        size_t b = ((size_t)patchB * 4 + slotB) * n + k;
+        maxGap = std::max(maxGap, glm::length(edges.positions[a] - edges.positions[b]));
+        if(edges.valid[a] && edges.valid[b])
+        {
+            float cosine = std::max(-1.0f, std::min(1.0f, glm::dot(edges.normals[a], edges.normals[b])));
+            maxAngle = std::max(maxAngle, glm::degrees(std::acos(cosine)));
+        }
+    }
+}
+
+
+//Magnitude below which 95% of the values are
+static float robustRange(const std::vector<float>& values)
+{
+    if(values.empty())
+    {
+        return 1.0f;
+    }
+    std::vector<float> magnitudes(values.size());
+    std::transform(values.begin(), values.end(), magnitudes.begin(), [](float x){ return std::fabs(x); });
+    auto percentile = magnitudes.begin() + (magnitudes.size() - 1) * 95 / 100;
+    std::nth_element(magnitudes.begin(), percentile, magnitudes.end());
+    return std::max(*percentile, 1e-6f);
+}
+
+
+SurfaceAnalysis analyzeSurface(const ControlGrid& grid, int samples, int numThreads, float gapTolerance, float angleTolerance)
+{
+    auto start = std::chrono::steady_clock::now();
+    SurfaceAnalysis result;
+    int n = std::max(samples, 2);
+    result.samples = n;
+    result.numThreads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+    int numX = numPatchesX(grid);
+    int numY = numPatchesY(grid);
+    int numPatches = numX * numY;
+    result.gaussian.resize((size_t)numPatches * n * n);
+    result.mean.resize((size_t)numPatches * n * n);
+    result.seamMask.assign(numPatches, 0);
+
+    BasisTable basisU, basisV;
+    tabulateBasis(grid.degreeU, n, basisU);
+    tabulateBasis(grid.degreeV, n, basisV);
+    EdgeSamples edges;
+    edges.positions.resize((size_t)numPatches * 4 * n);
+    edges.normals.resize((size_t)numPatches * 4 * n);
+    edges.valid.resize((size_t)numPatches * 4 * n);
+    float s = layoutPatchSize(grid, 1.0f);
+
+    //Patches are handed out in blocks, every patch writes its own part of the arrays
+    std::atomic<int> nextPatch(0);
+    auto work = [&]()
+    {
+        AnalysisScratch scratch;
+        scratch.control.resize(basisU.order * basisV.order * CHANNELS);
+        scratch.rows.resize(3 * basisV.order * CHANNELS * n);
+        scratch.sums.resize(6 * CHANNELS * n);
+        for(int first = nextPatch.fetch_add(PATCHES_PER_TASK); first < numPatches; first = nextPatch.fetch_add(PATCHES_PER_TASK))
+        {
+            int last = std::min(first + PATCHES_PER_TASK, numPatches);
+            for(int patch = first; patch < last; ++patch)
+            {
+                analyzePatch(grid, patch, s, basisU, basisV, n, scratch, result, edges);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for(int t = 1; t < result.numThreads; ++t)
+    {
+        threads.emplace_back(work);
+    }
+    work();
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    //Seams, in a fixed order
+    for(int i = 0; i < numY; ++i)
+    {
+        for(int j = 0; j < numX; ++j)
+        {
+            int patch = i * numX + j;
+            for(int side = 0; side < 2; ++side)
+            {
+                bool alongU = side == 1;
+                if((alongU && i + 1 == numY) || (!alongU && j + 1 == numX))
+                {
+                    continue;
+                }
+                int neighbour = alongU ? patch + numX : patch + 1;
+                SeamFlag seam = { patch, neighbour, alongU, 0.0f, 0.0f };
+                compareEdges(edges, n, patch, alongU ? SLOT_BOTTOM : SLOT_RIGHT, neighbour, alongU ? SLOT_TOP : SLOT_LEFT,
+                             seam.maxGap, seam.maxAngle);
+                if(seam.maxGap > gapTolerance || seam.maxAngle > angleTolerance)
+                {
+                    result.seams.push_back(seam);
+                    result.seamMask[patch] |= alongU ? EDGE_BOTTOM : EDGE_RIGHT;
+                    result.seamMask[neighbour] |= alongU ? EDGE_TOP : EDGE_LEFT;
+                }
+            }
+        }
+    }
+
+    result.gaussianRange = robustRange(result.gaussian);
+    result.meanRange = robustRange(result.mean);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef SURFACE_ANALYSIS_H
+#define SURFACE_ANALYSIS_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "ControlGrid.h"
+
+
+//Edges of a patch, bits of SurfaceAnalysis::seamMask
+enum PatchEdge
+{
+    EDGE_TOP = 1,    //v = 0
+    EDGE_BOTTOM = 2, //v = 1
+    EDGE_LEFT = 4,   //u = 0
+    EDGE_RIGHT = 8   //u = 1
+};
+
+
+//Shared edge of two neighbouring patches that is not G1
+struct SeamFlag
+{
+    int patchA; //Row major patch index, A is left of or above B
+    int patchB;
+    bool alongU; //true: A's bottom meets B's top, false: A's right meets B's left
+    float maxGap; //Largest distance between matching edge samples
+    float maxAngle; //Largest angle between the two normals, in degrees
+};
+
+
+struct SurfaceAnalysis
+{
+    int samples; //Per side of every patch, at u, v = k / (samples - 1)
+    //samples * samples values per patch, patches row major, then v rows, then u
+    std::vector<float> gaussian;
+    std::vector<float> mean;
+    //95th percentile of the magnitudes, a range for colour maps that outliers do not flatten
+    float gaussianRange;
+    float meanRange;
+    std::vector<SeamFlag> seams;
+    std::vector<uint8_t> seamMask; //Per patch, PatchEdge bits of its flagged edges
+    int numThreads;
+    double seconds;
+};
+
+
+/*
+    Gaussian and mean curvature on a samples x samples grid of every patch, and the seams
+    between neighbouring patches whose positions differ by more than gapTolerance or whose
+    normals differ by more than angleTolerance degrees.
+    Everything is in the scene frame of the default layout (layoutPatchSize(grid, 1)), the mean
+    curvature is signed for the normal the shaders use, cross(dV, dU). The basis values are the
+    same for every patch, so they are tabulated once and each patch is two small contractions
+    over rows of samples, which the compiler vectorises. Patches are spread over numThreads
+    threads (0 picks one per core).
+*/
+SurfaceAnalysis analyzeSurface(const ControlGrid& grid, int samples = 16, int numThreads = 0,
+                               float gapTolerance = 1e-4f, float angleTolerance = 1.0f);
+
+#endif
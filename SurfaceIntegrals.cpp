@@ -0,0 +1,195 @@
+#include "SurfaceIntegrals.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "BezierPatch.h"
+
+
+static const int PATCHES_PER_TASK = 16;
+static const int MAX_DEPTH = 8;
+
+//8 point Gauss-Legendre rule on [-1, 1], symmetric pairs
+static const int GAUSS_POINTS = 8;
+static const double GAUSS_NODES[GAUSS_POINTS] = {
+    -0.9602898564975363, -0.7966664774136267, -0.5255324099163290, -0.1834346424956498,
+     0.1834346424956498,  0.5255324099163290,  0.7966664774136267,  0.9602898564975363
+};
+static const double GAUSS_WEIGHTS[GAUSS_POINTS] = {
+    0.1012285362903763, 0.2223810344533745, 0.3137066458778873, 0.3626837833783620,
+    0.3626837833783620, 0.3137066458778873, 0.2223810344533745, 0.1012285362903763
+};
+
+
+struct Estimate
+{
+    double area;
+    double volume;
+    double absVolume; //Of |z|, the scale volume errors are measured against
+};
+
+
+class PatchIntegrator
+{
+public:
+    size_t numEvaluations;
+
+    PatchIntegrator(const ControlGrid& grid, HeightfieldEvaluator evaluate, float s, double tolerance)
+        : numEvaluations(0), grid(grid), evaluate(evaluate), s(s), tolerance(tolerance)
+    {
+    }
+
+    PatchIntegral integrate(int patch)
+    {
+        int offset = patchOffset(grid, patch / numPatchesX(grid), patch % numPatchesX(grid));
+        Z = &grid.heights[offset];
+        W = isRational(grid) ? &grid.weights[offset] : nullptr;
+        PatchIntegral result = {};
+        result.converged = true;
+        Estimate whole = rule(0.0, 0.0, 1.0);
+        areaScale = whole.area;
+        volumeScale = whole.absVolume;
+        refine(0.0, 0.0, 1.0, whole, 0, result);
+        return result;
+    }
+
+private:
+    //Gauss-Legendre over the square [u0, u0 + size] x [v0, v0 + size]
+    Estimate rule(double u0, double v0, double size)
+    {
+        Estimate e = { 0.0, 0.0, 0.0 };
+        double half = 0.5 * size;
+        for(int b = 0; b < GAUSS_POINTS; ++b)
+        {
+            float v = (float)(v0 + half * (GAUSS_NODES[b] + 1.0));
+            for(int a = 0; a < GAUSS_POINTS; ++a)
+            {
+                float u = (float)(u0 + half * (GAUSS_NODES[a] + 1.0));
+                SurfaceDerivatives d = evaluate(Z, W, grid.numPx, u, v);
+                //To the scene frame: x and y scale with the layout, z does not
+                glm::vec3 dU(s * d.dU.x, s * d.dU.y, d.dU.z);
+                glm::vec3 dV(s * d.dV.x, s * d.dV.y, d.dV.z);
+                double weight = GAUSS_WEIGHTS[a] * GAUSS_WEIGHTS[b];
+                double jacobianXY = std::fabs((double)dU.x * dV.y - (double)dU.y * dV.x);
+                e.area += weight * glm::length(glm::cross(dU, dV));
+                e.volume += weight * d.p.z * jacobianXY;
+                e.absVolume += weight * std::fabs(d.p.z) * jacobianXY;
+            }
+        }
+        numEvaluations += GAUSS_POINTS * GAUSS_POINTS;
+        //The rule is on [-1, 1]^2
+        double scale = half * half;
+        e.area *= scale;
+        e.volume *= scale;
+        e.absVolume *= scale;
+        return e;
+    }
+
+    //Children are visited in a fixed order so every run sums the same numbers the same way
+    void refine(double u0, double v0, double size, const Estimate& coarse, int depth, PatchIntegral& result)
+    {
+        double half = 0.5 * size;
+        Estimate children[4] = {
+            rule(u0, v0, half), rule(u0 + half, v0, half),
+            rule(u0, v0 + half, half), rule(u0 + half, v0 + half, half)
+        };
+        double area = 0.0, volume = 0.0;
+        for(const Estimate& child : children)
+        {
+            area += child.area;
+            volume += child.volume;
+        }
+        double areaError = std::fabs(area - coarse.area);
+        double volumeError = std::fabs(volume - coarse.volume);
+        //The tolerance of a region is its share of the patch's
+        double share = size * size * tolerance;
+        bool accepted = areaError <= share * areaScale && volumeError <= share * volumeScale;
+        if(accepted || depth + 1 >= MAX_DEPTH)
+        {
+            result.area += area;
+            result.volume += volume;
+            result.areaError += areaError;
+            result.volumeError += volumeError;
+            result.numRegions += 4;
+            result.converged = result.converged && accepted;
+            return;
+        }
+        refine(u0, v0, half, children[0], depth + 1, result);
+        refine(u0 + half, v0, half, children[1], depth + 1, result);
+        refine(u0, v0 + half, half, children[2], depth + 1, result);
+        refine(u0 + half, v0 + half, half, children[3], depth + 1, result);
+    }
+
+private:
+    const ControlGrid& grid;
+    HeightfieldEvaluator evaluate;
+    float s;
+    double tolerance;
+    const float* Z;
+    const float* W;
+    double areaScale;
+    double volumeScale;
+};
+
+
+SurfaceIntegrals integrateSurface(const ControlGrid& grid, double tolerance, int numThreads)
+{
+    auto start = std::chrono::steady_clock::now();
+    SurfaceIntegrals result = {};
+    //Below float precision the subdivision would only stop at its depth limit
+    result.tolerance = tolerance >= MIN_INTEGRATION_TOLERANCE ? tolerance : MIN_INTEGRATION_TOLERANCE;
+    tolerance = result.tolerance;
+    result.numThreads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+    int numPatches = numPatchesX(grid) * numPatchesY(grid);
+    result.patches.resize(numPatches);
+    HeightfieldEvaluator evaluate = getHeightfieldEvaluator(grid.degreeU, grid.degreeV, isRational(grid));
+    float s = layoutPatchSize(grid, 1.0f);
+
+    std::atomic<int> nextPatch(0);
+    std::atomic<size_t> numEvaluations(0);
+    auto work = [&]()
+    {
+        PatchIntegrator integrator(grid, evaluate, s, tolerance);
+        for(int first = nextPatch.fetch_add(PATCHES_PER_TASK); first < numPatches; first = nextPatch.fetch_add(PATCHES_PER_TASK))
+        {
+            int last = std::min(first + PATCHES_PER_TASK, numPatches);
+            for(int patch = first; patch < last; ++patch)
+            {
+                result.patches[patch] = integrator.integrate(patch);
+            }
+        }
+        numEvaluations += integrator.numEvaluations;
+    };
+    std::vector<std::thread> threads;
+    for(int t = 1; t < result.numThreads; ++t)
+    {
+        threads.emplace_back(work);
+    }
+    work();
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    //Compensated sums in patch order: the same totals whichever thread did which patch
+    double areaCompensation = 0.0, volumeCompensation = 0.0;
+    auto kahanAdd = [](double& sum, double& compensation, double value)
+    {
+        double y = value - compensation;
+        double t = sum + y;
+        compensation = (t - sum) - y;
+        sum = t;
+    };
+    for(const PatchIntegral& patch : result.patches)
+    {
+        kahanAdd(result.area, areaCompensation, patch.area);
+        kahanAdd(result.volume, volumeCompensation, patch.volume);
+        result.numUnconverged += patch.converged ? 0 : 1;
+    }
+    result.numEvaluations = numEvaluations;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
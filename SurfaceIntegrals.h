@@ -0,0 +1,52 @@
+#pragma once
+#ifndef SURFACE_INTEGRALS_H
+#define SURFACE_INTEGRALS_H
+
+#include <vector>
+#include <cstddef>
+
+#include "ControlGrid.h"
+
+
+struct PatchIntegral
+{
+    double area;
+    double volume; //Signed, of the region between the surface and z = 0
+    double areaError; //Sum of the differences between the accepted estimates and their refinements
+    double volumeError;
+    int numRegions; //Leaves of the adaptive subdivision
+    bool converged; //False if the subdivision hit its depth limit first
+};
+
+
+//The evaluators work in single precision, tighter tolerances are raised to this
+const double MIN_INTEGRATION_TOLERANCE = 1e-7;
+
+
+struct SurfaceIntegrals
+{
+    std::vector<PatchIntegral> patches; //Row major patch order
+    double tolerance; //The one integrated to, after raising it to MIN_INTEGRATION_TOLERANCE
+    double area;
+    double volume;
+    size_t numEvaluations;
+    int numUnconverged;
+    int numThreads;
+    double seconds;
+};
+
+
+/*
+    Surface area and volume under the heightfield of every patch, in the scene frame of the
+    default layout (layoutPatchSize(grid, 1)). Both are integrated over (u, v) from the analytic
+    derivatives of the grid's evaluators:
+        area = integral of |dU x dV|, volume = integral of z * |dU.x dV.y - dU.y dV.x|
+    with tensor product Gauss-Legendre rules. A region is split into four until its estimate and
+    the sum of its four children agree to tolerance, relative to the whole patch. Tolerances below
+    MIN_INTEGRATION_TOLERANCE (or not a number) are raised to it. Patches are
+    spread over numThreads threads (0 picks one per core) but the totals are summed in patch
+    order, so the results do not depend on the thread count.
+*/
+SurfaceIntegrals integrateSurface(const ControlGrid& grid, double tolerance = 1e-6, int numThreads = 0);
+
+#endif
@@ -0,0 +1,608 @@
+#include "TilePager.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <iostream>
+#include <cstring>
+
+#include "BezierPatch.h"
+
+
+static const char TILED_MAGIC[4] = { 'B', 'Z', 'T', '1' };
+
+
+static size_t tileFloats(const TiledGridHeader& header)
+{
+    return (size_t)header.tilePatches * (header.degreeU + 1) * header.tilePatches * (header.degreeV + 1);
+}
+
+
+static size_t tilesOffset(const TiledGridHeader& header)
+{
+    return sizeof(TiledGridHeader) + sizeof(float) * 6 * header.numLights;
+}
+
+
+/*
+    Checks the grid shape of a header before anything divides or indexes by it, as parseScene()
+    does: degrees the evaluators support and at least one whole patch. Prints the reason if not.
+*/
+static bool checkGridShape(const TiledGridHeader& header, const char* fileName)
+{
+    if(header.numLights < 0 || header.numPx < 0 || header.numPy < 0)
+    {
+        std::cout << "Failed to read the header of " << fileName << std::endl;
+        return false;
+    }
+    if(!getPatchEvaluator(header.degreeU, header.degreeV, header.rational != 0))
+    {
+        std::cout << "Unsupported patch degrees " << header.degreeU << " x " << header.degreeV << " in " << fileName
+                  << ", at most " << MAX_PATCH_DEGREE << " is supported along each axis" << std::endl;
+        return false;
+    }
+    if(header.numPx / (header.degreeU + 1) < 1 || header.numPy / (header.degreeV + 1) < 1)
+    {
+        std::cout << "The control grid of " << fileName << " has no whole patch" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool writeTiledControlGrid(const char* sceneFile, const char* tiledFile, int tilePatches)
+{
+    std::ifstream in(sceneFile);
+    std::ofstream out(tiledFile, std::ios::binary);
+    if(!in || !out || tilePatches < 1)
+    {
+        std::cout << "Failed to convert " << sceneFile << " into " << tiledFile << std::endl;
+        return false;
+    }
+
+    //Same header as parseScene() reads
+    TiledGridHeader header;
+    std::memcpy(header.magic, TILED_MAGIC, 4);
+    header.numLights = -1;
+    in >> header.numLights;
+    if(!in || header.numLights < 0)
+    {
+        std::cout << "Failed to read the header of the scene file " << sceneFile << std::endl;
+        return false;
+    }
+    std::vector<float> lights(6 * header.numLights);
+    for(float& value : lights)
+    {
+        in >> value;
+    }
+    header.numPx = header.numPy = -1;
+    in >> header.numPy >> header.numPx;
+    std::string patchLine;
+    std::getline(in, patchLine);
+    std::istringstream patchStream(patchLine);
+    if(!(patchStream >> header.degreeU >> header.degreeV))
+    {
+        header.degreeU = header.degreeV = 3;
+    }
+    std::string rationalFlag;
+    header.rational = (patchStream >> rationalFlag) && rationalFlag == "rational";
+    if(!in || !checkGridShape(header, sceneFile))
+    {
+        return false;
+    }
+    header.tilePatches = tilePatches;
+    int patchesX = header.numPx / (header.degreeU + 1);
+    int patchesY = header.numPy / (header.degreeV + 1);
+    header.numTilesX = (patchesX + tilePatches - 1) / tilePatches;
+    header.numTilesY = (patchesY + tilePatches - 1) / tilePatches;
+    header.zMin = std::numeric_limits<float>::max();
+    header.zMax = -std::numeric_limits<float>::max();
+
+    //Header is rewritten at the end once the height range is known
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)lights.data(), sizeof(float) * lights.size());
+
+    //Reads one grid (heights or weights) band by band and writes its tiles
+    int tileWidth = tilePatches * (header.degreeU + 1);
+    int tileHeight = tilePatches * (header.degreeV + 1);
+    int bandWidth = header.numTilesX * tileWidth;
+    int usedWidth = patchesX * (header.degreeU + 1); //Columns that belong to a patch
+    int usedHeight = patchesY * (header.degreeV + 1);
+    std::vector<float> band((size_t)tileHeight * bandWidth);
+    std::vector<float> row(header.numPx);
+    auto convertGrid = [&](bool heights)
+    {
+        int rowsRead = 0;
+        for(int ty = 0; ty < header.numTilesY; ++ty)
+        {
+            std::fill(band.begin(), band.end(), heights ? 0.0f : 1.0f);
+            for(int r = 0; r < tileHeight && rowsRead < usedHeight; ++r, ++rowsRead)
+            {
+                for(float& value : row)
+                {
+                    in >> value;
+                }
+                std::copy(row.begin(), row.begin() + usedWidth, band.begin() + (size_t)r * bandWidth);
+                if(heights)
+                {
+                    auto range = std::minmax_element(row.begin(), row.begin() + usedWidth);
+                    header.zMin = std::min(header.zMin, *range.first);
+                    header.zMax = std::max(header.zMax, *range.second);
+                }
+            }
+            for(int tx = 0; tx < header.numTilesX; ++tx)
+            {
+                for(int r = 0; r < tileHeight; ++r)
+                {
+                    out.write((const char*)&band[(size_t)r * bandWidth + (size_t)tx * tileWidth], sizeof(float) * tileWidth);
+                }
+            }
+        }
+        //Rows below the last full patch are not part of any patch but still have to be consumed
+        for(; rowsRead < header.numPy; ++rowsRead)
+        {
+            for(float& value : row)
+            {
+                in >> value;
+            }
+        }
+    };
+    convertGrid(true);
+    if(header.rational)
+    {
+        convertGrid(false);
+    }
+    if(!in)
+    {
+        std::cout << "Scene file " << sceneFile << " ended before the control grid did" << std::endl;
+        return false;
+    }
+
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+    return (bool)out;
+}
+
+
+TilePager::TilePager(const char* tiledFile, size_t hostBudgetBytes, size_t gpuBudgetBytes)
+    :
+    path(tiledFile),
+    open(false),
+    hostBudget(hostBudgetBytes),
+    gpuBudget(gpuBudgetBytes),
+    frame(0),
+    gpuBytes(0),
+    stats(),
+    reading(0),
+    hostBytes(0),
+    quit(false)
+{
+    std::ifstream file(tiledFile, std::ios::binary);
+    file.read((char*)&header, sizeof(header));
+    if(!file || std::memcmp(header.magic, TILED_MAGIC, 4) != 0)
+    {
+        std::cout << "ERROR::TILE_PAGER::NOT_A_TILED_GRID " << tiledFile << std::endl;
+        return;
+    }
+    if(!checkGridShape(header, tiledFile))
+    {
+        return;
+    }
+    //The tiling has to cover the patches exactly as writeTiledControlGrid() cut them
+    int patchesX = header.numPx / (header.degreeU + 1);
+    int patchesY = header.numPy / (header.degreeV + 1);
+    if(header.tilePatches < 1 || header.numTilesX != (patchesX + header.tilePatches - 1) / header.tilePatches ||
+       header.numTilesY != (patchesY + header.tilePatches - 1) / header.tilePatches)
+    {
+        std::cout << "ERROR::TILE_PAGER::CORRUPT_TILING " << tiledFile << std::endl;
+        return;
+    }
+    //Lights and tiles have to be in the file, in doubles so that garbage counts can not overflow
+    file.seekg(0, std::ios::end);
+    double numBlocks = (double)header.numTilesX * header.numTilesY * (header.rational ? 2 : 1);
+    if((double)tilesOffset(header) + numBlocks * tileFloats(header) * sizeof(float) > (double)file.tellg())
+    {
+        std::cout << "ERROR::TILE_PAGER::TRUNCATED " << tiledFile << std::endl;
+        return;
+    }
+    file.seekg(sizeof(header));
+    //Every tile is uploaded as a grid of its own
+    if(tileFloats(header) > maxControlGridPoints())
+    {
+        std::cout << "Tiles of " << tileFloats(header) << " points do not fit a texture buffer of " << maxControlGridPoints()
+                  << " texels, convert the scene again with fewer patches per tile" << std::endl;
+        return;
+    }
+    std::vector<float> lights(6 * header.numLights);
+    file.read((char*)lights.data(), sizeof(float) * lights.size());
+    if(!file)
+    {
+        std::cout << "ERROR::TILE_PAGER::NOT_A_TILED_GRID " << tiledFile << std::endl;
+        return;
+    }
+    for(int i = 0; i < header.numLights; ++i)
+    {
+        lightPositions.push_back(glm::vec3(lights[6*i], lights[6*i + 1], lights[6*i + 2]));
+        lightIntensities.push_back(glm::vec3(lights[6*i + 3], lights[6*i + 4], lights[6*i + 5]));
+    }
+
+    int numTiles = header.numTilesX * header.numTilesY;
+    isResident.assign(numTiles, 0);
+    inFlight.assign(numTiles, 0);
+    open = true;
+    loader = std::thread(&TilePager::loaderLoop, this);
+}
+
+
+TilePager::~TilePager()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeLoader.notify_all();
+    if(loader.joinable())
+    {
+        loader.join();
+    }
+    for(std::unique_ptr<Tile>& tile : resident)
+    {
+        releaseControlGrid(tile->grid);
+    }
+}
+
+
+bool TilePager::isOpen() const
+{
+    return open;
+}
+
+
+const TiledGridHeader& TilePager::getHeader() const
+{
+    return header;
+}
+
+
+const std::vector<glm::vec3>& TilePager::getLightPositions() const
+{
+    return lightPositions;
+}
+
+
+const std::vector<glm::vec3>& TilePager::getLightIntensities() const
+{
+    return lightIntensities;
+}
+
+
+size_t TilePager::tileBytes() const
+{
+    return sizeof(float) * tileFloats(header) * (header.rational ? 2 : 1);
+}
+
+
+std::vector<TileRequest> TilePager::selectTiles(const glm::mat4& PVM, const glm::vec3& origin, float patchSize) const
+{
+    std::vector<TileRequest> requests;
+    if(open)
+    {
+        selectTiles(PVM, origin, patchSize, 0, 0, header.numTilesX, header.numTilesY, requests);
+    }
+    return requests;
+}
+
+
+void TilePager::selectTiles(const glm::mat4& PVM, const glm::vec3& origin, float patchSize,
+                            int x0, int y0, int x1, int y1, std::vector<TileRequest>& requests) const
+{
+    //Bounds of the tile range in the model frame. Heights of tiles that are not loaded are not
+    //known, so the range of the whole grid is used.
+    int patchesX = header.numPx / (header.degreeU + 1);
+    int patchesY = header.numPy / (header.degreeV + 1);
+    int j0 = x0 * header.tilePatches;
+    int j1 = std::min(x1 * header.tilePatches, patchesX) - 1;
+    int i0 = y0 * header.tilePatches;
+    int i1 = std::min(y1 * header.tilePatches, patchesY) - 1;
+    glm::vec3 bmin(origin.x + (j0 - 0.5f) * patchSize, origin.y - (i1 + 0.5f) * patchSize, header.zMin);
+    glm::vec3 bmax(origin.x + (j1 + 0.5f) * patchSize, origin.y - (i0 - 0.5f) * patchSize, header.zMax);
+
+    //Clip the corners. Out if all of them are outside the same plane.
+    int outside[6] = { 0, 0, 0, 0, 0, 0 };
+    bool behindEye = false;
+    glm::vec2 ndcMin(std::numeric_limits<float>::max());
+    glm::vec2 ndcMax(-std::numeric_limits<float>::max());
+    for(int c = 0; c < 8; ++c)
+    {
+        glm::vec3 corner((c & 1) ? bmax.x : bmin.x, (c & 2) ? bmax.y : bmin.y, (c & 4) ? bmax.z : bmin.z);
+        glm::vec4 clip = PVM * glm::vec4(corner, 1.0f);
+        outside[0] += clip.x < -clip.w;
+        outside[1] += clip.x > clip.w;
+        outside[2] += clip.y < -clip.w;
+        outside[3] += clip.y > clip.w;
+        outside[4] += clip.z < -clip.w;
+        outside[5] += clip.z > clip.w;
+        if(clip.w <= 1e-6f)
+        {
+            behindEye = true;
+            continue;
+        }
+        glm::vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+    for(int p = 0; p < 6; ++p)
+    {
+        if(outside[p] == 8)
+        {
+            return;
+        }
+    }
+
+    if(x1 - x0 == 1 && y1 - y0 == 1)
+    {
+        TileRequest request;
+        request.tileIndex = y0 * header.numTilesX + x0;
+        if(behindEye)
+        {
+            //Straddles the eye plane, so it is right in front of the camera
+            request.priority = 1.0f;
+        }
+        else
+        {
+            ndcMin = glm::max(ndcMin, glm::vec2(-1.0f));
+            ndcMax = glm::min(ndcMax, glm::vec2(1.0f));
+            glm::vec2 extent = glm::max(ndcMax - ndcMin, glm::vec2(0.0f));
+            request.priority = extent.x * extent.y / 4.0f;
+        }
+        requests.push_back(request);
+        return;
+    }
+
+    //Split into quadrants. Ranges of width 1 are only split along the other axis.
+    int xm = (x0 + x1 + 1) / 2;
+    int ym = (y0 + y1 + 1) / 2;
+    int xs[3] = { x0, xm, x1 };
+    int ys[3] = { y0, ym, y1 };
+    for(int a = 0; a < 2; ++a)
+    {
+        for(int b = 0; b < 2; ++b)
+        {
+            if(xs[b] < xs[b + 1] && ys[a] < ys[a + 1])
+            {
+                selectTiles(PVM, origin, patchSize, xs[b], ys[a], xs[b + 1], ys[a + 1], requests);
+            }
+        }
+    }
+}
+
+
+void TilePager::request(std::vector<TileRequest> requests)
+{
+    ++frame;
+    //Only as many tiles as the budgets hold are worth asking for, the rest would thrash
+    size_t capacity = std::max<size_t>(1, std::min(hostBudget, gpuBudget) / tileBytes());
+    std::sort(requests.begin(), requests.end(),
+        [](const TileRequest& a, const TileRequest& b) { return a.priority > b.priority; });
+    if(requests.size() > capacity)
+    {
+        requests.resize(capacity);
+    }
+
+    std::vector<TileRequest> missing;
+    uint64_t hits = 0;
+    for(const TileRequest& r : requests)
+    {
+        if(isResident[r.tileIndex])
+        {
+            ++hits;
+        }
+        else
+        {
+            missing.push_back(r);
+        }
+    }
+    for(std::unique_ptr<Tile>& tile : resident)
+    {
+        for(const TileRequest& r : requests)
+        {
+            if(r.tileIndex == tile->tileY * header.numTilesX + tile->tileX)
+            {
+                tile->lastUsedFrame = frame;
+                break;
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.hits += hits;
+        queue.clear();
+        for(auto it = missing.rbegin(); it != missing.rend(); ++it)
+        {
+            if(!inFlight[it->tileIndex])
+            {
+                queue.push_back(*it);
+            }
+        }
+    }
+    wakeLoader.notify_one();
+}
+
+
+void TilePager::update(int maxUploads)
+{
+    std::vector<std::unique_ptr<Tile>> ready;
+    bool waiting;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int count = std::min<int>(maxUploads, (int)loaded.size());
+        for(int i = 0; i < count; ++i)
+        {
+            ready.push_back(std::move(loaded[i]));
+        }
+        loaded.erase(loaded.begin(), loaded.begin() + count);
+        waiting = !queue.empty();
+    }
+
+    for(std::unique_ptr<Tile>& tile : ready)
+    {
+        //Make room on the GPU first. Tiles wanted this frame are never evicted.
+        evict(hostBudget, gpuBudget - std::min(gpuBudget, tileBytes()));
+        int index = tile->tileY * header.numTilesX + tile->tileX;
+        uploadControlGrid(tile->grid);
+        gpuBytes += ::hostBytes(tile->grid);
+        tile->lastUsedFrame = frame;
+        isResident[index] = 1;
+        resident.push_back(std::move(tile));
+        std::lock_guard<std::mutex> lock(mutex);
+        inFlight[index] = 0;
+    }
+
+    //Keep room for the next read if the loader has work, otherwise just stay within the budgets
+    evict(hostBudget - (waiting ? std::min(hostBudget, tileBytes()) : 0), gpuBudget);
+    wakeLoader.notify_one();
+}
+
+
+void TilePager::evict(size_t hostTarget, size_t gpuTarget)
+{
+    while(true)
+    {
+        size_t host;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            host = hostBytes;
+        }
+        if(host <= hostTarget && gpuBytes <= gpuTarget)
+        {
+            return;
+        }
+        auto lru = resident.end();
+        for(auto it = resident.begin(); it != resident.end(); ++it)
+        {
+            if((*it)->lastUsedFrame < frame && (lru == resident.end() || (*it)->lastUsedFrame < (*lru)->lastUsedFrame))
+            {
+                lru = it;
+            }
+        }
+        if(lru == resident.end())
+        {
+            return;
+        }
+        Tile& tile = **lru;
+        size_t bytes = ::hostBytes(tile.grid);
+        isResident[tile.tileY * header.numTilesX + tile.tileX] = 0;
+        releaseControlGrid(tile.grid);
+        gpuBytes -= bytes;
+        resident.erase(lru);
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.evictions;
+        hostBytes -= bytes;
+    }
+}
+
+
+const std::list<std::unique_ptr<Tile>>& TilePager::getResidentTiles() const
+{
+    return resident;
+}
+
+
+TilePagerStats TilePager::getStats() const
+{
+    //Misses are counted by the loader, so the copy is taken under the lock
+    std::lock_guard<std::mutex> lock(mutex);
+    TilePagerStats s = stats;
+    s.residentTiles = resident.size();
+    s.gpuBytes = gpuBytes;
+    s.pendingTiles = queue.size() + loaded.size() + reading;
+    s.hostBytes = hostBytes;
+    return s;
+}
+
+
+bool TilePager::hasPendingTiles() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return reading > 0 || !loaded.empty() || (!queue.empty() && hostBytes + tileBytes() <= hostBudget);
+}
+
+
+void TilePager::loaderLoop()
+{
+    std::ifstream file(path, std::ios::binary);
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true)
+    {
+        //Wait for work that fits into the host budget
+        wakeLoader.wait(lock, [this]
+        {
+            return quit || (!queue.empty() && hostBytes + tileBytes() <= hostBudget);
+        });
+        if(quit)
+        {
+            return;
+        }
+        TileRequest r = queue.back();
+        queue.pop_back();
+        inFlight[r.tileIndex] = 1;
+        hostBytes += tileBytes();
+        ++reading;
+        ++stats.misses;
+
+        lock.unlock();
+        std::unique_ptr<Tile> tile = readTile(file, r.tileIndex);
+        lock.lock();
+
+        --reading;
+        if(!tile)
+        {
+            //Not resident and not in flight, the next frame that wants the tile requests it again
+            hostBytes -= tileBytes();
+            inFlight[r.tileIndex] = 0;
+            ++stats.readFailures;
+            continue;
+        }
+        loaded.push_back(std::move(tile));
+    }
+}
+
+
+std::unique_ptr<Tile> TilePager::readTile(std::ifstream& file, int tileIndex) const
+{
+    std::unique_ptr<Tile> tile(new Tile());
+    tile->tileX = tileIndex % header.numTilesX;
+    tile->tileY = tileIndex / header.numTilesX;
+    int patchesX = header.numPx / (header.degreeU + 1);
+    int patchesY = header.numPy / (header.degreeV + 1);
+    tile->firstPatchI = tile->tileY * header.tilePatches;
+    tile->firstPatchJ = tile->tileX * header.tilePatches;
+    tile->numPatchesI = std::min(header.tilePatches, patchesY - tile->firstPatchI);
+    tile->numPatchesJ = std::min(header.tilePatches, patchesX - tile->firstPatchJ);
+    tile->lastUsedFrame = 0;
+
+    ControlGrid& grid = tile->grid;
+    grid.numPx = header.tilePatches * (header.degreeU + 1);
+    grid.numPy = header.tilePatches * (header.degreeV + 1);
+    grid.degreeU = header.degreeU;
+    grid.degreeV = header.degreeV;
+    size_t count = tileFloats(header);
+    size_t numTiles = (size_t)header.numTilesX * header.numTilesY;
+    grid.heights.resize(count);
+    file.clear();
+    file.seekg(tilesOffset(header) + sizeof(float) * count * tileIndex);
+    file.read((char*)grid.heights.data(), sizeof(float) * count);
+    if(header.rational)
+    {
+        grid.weights.resize(count);
+        file.seekg(tilesOffset(header) + sizeof(float) * count * (numTiles + tileIndex));
+        file.read((char*)grid.weights.data(), sizeof(float) * count);
+    }
+    if(!file)
+    {
+        std::cout << "ERROR::TILE_PAGER::READ_FAILED tile " << tileIndex << std::endl;
+        return nullptr;
+    }
+    return tile;
+}
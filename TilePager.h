@@ -0,0 +1,156 @@
+#pragma once
+#ifndef TILE_PAGER_H
+#define TILE_PAGER_H
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "ControlGrid.h"
+
+
+/*
+    Tiled control grid file. The grid is cut into tiles of tilePatches x tilePatches patches.
+    Every tile is stored as its own row major block of heights (partial tiles at the border are
+    padded), so a tile is one contiguous read. Layout: header, lights (6 floats each), the
+    height blocks of all tiles in row major tile order, then the weight blocks for rational grids.
+*/
+struct TiledGridHeader
+{
+    char magic[4];
+    int32_t numPx;
+    int32_t numPy;
+    int32_t degreeU;
+    int32_t degreeV;
+    int32_t rational;
+    int32_t tilePatches;
+    int32_t numTilesX;
+    int32_t numTilesY;
+    int32_t numLights;
+    float zMin; //Height range of the whole grid, bounds tiles that are not loaded yet
+    float zMax;
+};
+
+/*
+    Converts a scene file (the format parseScene() reads) into a tiled file. Streams one band of
+    tiles at a time, so the grid never has to fit in memory. Returns false on failure.
+*/
+bool writeTiledControlGrid(const char* sceneFile, const char* tiledFile, int tilePatches);
+
+
+struct Tile
+{
+    int tileX;
+    int tileY;
+    //Patches of the whole grid this tile holds
+    int firstPatchI;
+    int firstPatchJ;
+    int numPatchesI;
+    int numPatchesJ;
+    ControlGrid grid; //Only this tile's block. Patch offsets are relative to it.
+    uint64_t lastUsedFrame;
+};
+
+struct TileRequest
+{
+    int tileIndex;
+    float priority; //Screen coverage. Larger is loaded first.
+};
+
+struct TilePagerStats
+{
+    uint64_t hits; //Requests for tiles that were resident
+    uint64_t misses; //Requests for tiles that had to be read
+    uint64_t evictions;
+    uint64_t readFailures; //Reads that failed, the tile was dropped and can be requested again
+    size_t residentTiles;
+    size_t pendingTiles; //Requested and not resident yet
+    size_t hostBytes;
+    size_t gpuBytes;
+};
+
+
+/*
+    Keeps the tiles around the camera of a tiled control grid resident. Every frame the renderer
+    hands in the tiles it wants with their screen coverage; missing ones are read on a background
+    thread in coverage order and uploaded on the GL thread a few per frame. Least recently used
+    tiles are evicted to stay within the host and GPU memory budgets.
+*/
+class TilePager
+{
+public:
+    TilePager(const char* tiledFile, size_t hostBudgetBytes, size_t gpuBudgetBytes);
+    ~TilePager();
+
+    bool isOpen() const;
+    const TiledGridHeader& getHeader() const;
+    const std::vector<glm::vec3>& getLightPositions() const;
+    const std::vector<glm::vec3>& getLightIntensities() const;
+
+    /*
+        Tiles intersecting the view, with their screen coverage as priority. The grid is laid out
+        like layoutBezierSurfaces() does it: patch (i, j) is a square of side patchSize centered
+        at origin + (j * patchSize, -i * patchSize, 0) in the model frame.
+    */
+    std::vector<TileRequest> selectTiles(const glm::mat4& PVM, const glm::vec3& origin, float patchSize) const;
+    //Replaces the wanted set of the frame. Resident tiles among them are marked used.
+    void request(std::vector<TileRequest> requests);
+    //GL thread: uploads at most maxUploads loaded tiles and evicts over the budgets
+    void update(int maxUploads);
+    //Tiles that are ready to be drawn
+    const std::list<std::unique_ptr<Tile>>& getResidentTiles() const;
+    TilePagerStats getStats() const;
+    /*
+        True while tiles are being read or wait for their upload, or are requested with room in
+        the host budget to read them. Requests that wait for room only move on with the next
+        request, so they do not count.
+    */
+    bool hasPendingTiles() const;
+
+private:
+    void loaderLoop();
+    //nullptr if the tile could not be read
+    std::unique_ptr<Tile> readTile(std::ifstream& file, int tileIndex) const;
+    size_t tileBytes() const;
+    void selectTiles(const glm::mat4& PVM, const glm::vec3& origin, float patchSize,
+                     int x0, int y0, int x1, int y1, std::vector<TileRequest>& requests) const;
+    //Evicts least recently used tiles that are not wanted this frame until under both targets
+    void evict(size_t hostTarget, size_t gpuTarget);
+
+private:
+    std::string path;
+    bool open;
+    TiledGridHeader header;
+    std::vector<glm::vec3> lightPositions;
+    std::vector<glm::vec3> lightIntensities;
+    size_t hostBudget;
+    size_t gpuBudget;
+    uint64_t frame;
+
+    //GL thread only
+    std::list<std::unique_ptr<Tile>> resident; //Uploaded tiles
+    std::vector<char> isResident; //Per tile index
+    size_t gpuBytes;
+    TilePagerStats stats;
+
+    //Shared with the loader thread
+    mutable std::mutex mutex;
+    std::condition_variable wakeLoader;
+    std::vector<TileRequest> queue; //Sorted by ascending priority, the loader takes from the back
+    std::vector<char> inFlight; //Per tile index, set while being read or waiting for upload
+    int reading; //Tiles the loader is reading right now
+    std::vector<std::unique_ptr<Tile>> loaded; //Read and waiting for upload
+    size_t hostBytes;
+    bool quit;
+    std::thread loader;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/type_precision.hpp>
 
 
 
@@ -11,6 +12,22 @@
 #include "Utilities.h"
 #include "Shader.h"
 #include "Camera.h"
+#include "BezierSurface.h"
+#include "ClosestPointQuery.h"
+#include "TilePager.h"
+#include "SceneLoader.h"
+#include "MeshOptimizer.h"
+#include "GpuTimer.h"
+#include "RenderFarm.h"
+#include "FrameCapture.h"
+#include "SurfaceAnalysis.h"
+#include "SurfaceIntegrals.h"
+#include "IndirectRenderer.h"
+#include "SceneUpdater.h"
+#include "GlAccounting.h"
+#include "HeightmapFit.h"
+#include "HiZPyramid.h"
+#include "ProgressiveRenderer.h"
 
 
 //Utility Headers
@@ -20,6 +37,13 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <tuple>
+#include <cstdlib>
+#include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
 
 
 
@@ -39,25 +63,113 @@ std::vector<glm::vec3> lightPositions;
 std::vector<glm::vec3> lightIntensities;
 
 
-struct BezierSurface
-{
-    glm::vec3 P[16]; //Control points
-    std::vector<glm::vec2> uv; //Sample points' (u, v) coordinates
-    std::vector<glm::ivec3> tris;
-    glm::vec3 translation;
-    glm::vec3 scaling; //Scaling of each Bezier Surface is the same but anyway
-    //OpenGL Params
-    GLuint VAO;
-    GLuint VBO;
-    GLuint EBO;
-};
-
-
 //Scene Properies
 std::vector<BezierSurface> bezierSurfaces;
-int numPx; //Number of horizontal control points
-int numPy; //Number of vertical control points
-std::vector<std::vector<float>> CP;
+ControlGrid controlGrid; //Heights (and weights) of every control point, shared by the surfaces
+//Shader variant of every patch type the scene uses, keyed by patchShaderDefines()
+std::map<std::string, Shader> bezierShaders;
+//Variants of the scene on screen, looked up once per scene rather than on every draw. They point
+//into bezierShaders, whose nodes never move.
+Shader* sceneShader = nullptr;
+Shader* sceneCaptureShader = nullptr;
+Shader* sceneIndirectShader = nullptr;
+
+//All patches share one triangulation since they only differ by their control points
+GLuint meshVAO = 0;
+GLuint meshVBO = 0;
+GLuint meshEBO = 0;
+GLenum meshIndexType = GL_UNSIGNED_SHORT;
+//Scene updates: the sample mesh and the layout are rebuilt on the updater's thread, the render
+//loop takes its newest snapshot every frame and uploads or applies what changed
+std::unique_ptr<SceneUpdater> sceneUpdater;
+const SceneSnapshot* snapshot = nullptr; //Taken at the start of the frame
+std::shared_ptr<const SampleMesh> uploadedMesh;
+std::shared_ptr<const SceneLayout> appliedLayout;
+uint64_t sceneId = 0; //Scene on screen, tags the layouts
+uint64_t lastSceneId = 0;
+
+//Paged mode: the control grid stays on disk and only tiles around the camera are resident.
+std::unique_ptr<TilePager> tilePager;
+double lastPagerReport = 0.0;
+
+//Scene files are read in the background. A finished scene is uploaded while the current one
+//stays on screen, then the two are swapped once its layout has been published.
+std::unique_ptr<SceneLoader> sceneLoader;
+std::unique_ptr<Scene> pendingScene;
+uint64_t pendingSceneId = 0;
+bool showingLoading = false;
+
+//Evaluation cache: every patch is evaluated once into a buffer of positions and normals, and
+//frames draw that buffer with a pass-through shader until the patch changes. C toggles it.
+bool useEvaluationCache = true;
+std::unique_ptr<Shader> cachedShader;
+//Evaluations per frame, a new scene or mesh spreads them over a few frames
+const int CACHE_EVALUATIONS_PER_FRAME = 64;
+bool cacheBehind = false; //Out of date caches were left for the next frame
+std::unique_ptr<GpuTimer> surfaceTimer; //GPU time of drawing the surfaces
+double lastTimerReport = 0.0;
+//Frame capture: V starts and stops it, frames go to captures/ in captureFormat
+std::unique_ptr<FrameCapture> frameCapture;
+CaptureFormat captureFormat = CaptureFormat::PPM;
+std::string captureName;
+double lastCaptureReport = 0.0;
+double captureFrameSeconds = 0.0; //Frame time since the last report
+//Surface analysis: M cycles the material between plain, Gaussian curvature and mean curvature.
+//The analysis runs when first shown for a scene, the shown values live in a texture buffer.
+int analysisMode = 0;
+int uploadedAnalysisMode = 0;
+std::unique_ptr<SurfaceAnalysis> surfaceAnalysis;
+GLuint analysisBuffer = 0;
+GLuint analysisTexture = 0;
+//GPU driven drawing: G switches to culling, level selection and one multi draw indirect on the GPU.
+//The patch records are rebuilt when the layout changes, the level meshes when numSamples does.
+bool useIndirect = false;
+std::unique_ptr<IndirectRenderer> indirectRenderer;
+bool indirectPatchesDirty = true;
+int indirectSamples = 0;
+double lastIndirectReport = 0.0;
+//Occlusion culling: H switches it (or --occlusion). Every frame first draws the patches visible
+//in the last one, builds a Hi-Z pyramid of their depth and tests every patch's bounds against
+//it, then draws the visible ones not drawn yet. GPU culling tests on the GPU, the per patch
+//path reads the coarse levels back and tests on the CPU.
+bool useOcclusion = false;
+std::unique_ptr<HiZPyramid> hiZPyramid;
+std::vector<std::pair<glm::vec3, glm::vec3>> patchBoxes; //Scene frame bounds of every patch, for the CPU test
+std::vector<uint8_t> patchVisible; //Per patch, visible in the last frame
+bool patchBoxesDirty = true;
+int occlusionFrames = 0; //Frames since the last report, and the share of the patches in view they occluded
+double occludedShareSum = 0.0;
+double lastOcclusionReport = 0.0;
+//Progressive refinement: P switches it (or --progressive [budget ms]). While the camera is dragged
+//or zoomed the patches are drawn coarse and cheaply shaded, once it stops they refine to the full
+//sample mesh over the next frames, within a time budget per frame (see ProgressiveRenderer).
+bool useProgressive = false;
+double progressiveBudgetMs = 33.0;
+std::unique_ptr<ProgressiveRenderer> progressiveRenderer;
+int progressiveSamples = 0; //Sample mesh the renderer's levels were built below
+double lastCameraMotion = -1.0; //Time of the last drag or scroll
+double progressiveFrameStart = 0.0;
+double lastProgressiveReport = 0.0;
+//On demand rendering: O switches it (or --on-demand). Frames are only drawn after an input,
+//a resize or a scene change marked them dirty, or while something needs frames to progress.
+bool onDemandRendering = false;
+bool frameDirty = true;
+double dirtySince = 0.0; //Time of the oldest change not on screen yet
+double lastIdleReport = 0.0;
+std::clock_t lastIdleCpu = 0;
+int idleFramesDrawn = 0;
+int idleWakeups = 0;
+int latencyCount = 0; //Frames drawn for a change, the rest were continuous frames
+double latencySum = 0.0;
+double latencyMax = 0.0;
+//GL call accounting (built with GL_ACCOUNTING): --gl-budget checks every frame against a
+//budget, --gl-stats writes the counters of every frame to a file
+GlBudget glBudget;
+std::ofstream glStatsFile;
+long long glFrameNumber = 0;
+int framesOverBudget = 0;
+std::string lastBudgetViolation;
+double lastBudgetReport = 0.0;
 float coordMultiplier = 1.0f;
 int numSamples = 10;
 float rotationAngle = -30.0f;
@@ -70,10 +182,45 @@ void updateDeltaTime()
 	lastFrame = currentFrame;
 }
 
+//Marks the frame on screen as out of date
+void requestRedraw()
+{
+	if (!frameDirty)
+	{
+		frameDirty = true;
+		dirtySince = glfwGetTime();
+	}
+	//A refined image is not right anymore either
+	if (progressiveRenderer)
+	{
+		progressiveRenderer->invalidate();
+	}
+}
+
+//The camera counts as moving this long after its last drag or scroll
+bool isCameraMoving()
+{
+	const double MOTION_SETTLE_SECONDS = 0.15;
+	return glfwGetTime() - lastCameraMotion < MOTION_SETTLE_SECONDS;
+}
+
+//Progressive refinement draws patch by patch, GPU culling and occlusion culling take precedence
+bool isProgressiveActive()
+{
+	return useProgressive && !useIndirect && !useOcclusion && !tilePager;
+}
+
 //Callback function in case of resizing the window
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
+	requestRedraw();
+}
+
+//The window was uncovered or needs its contents again
+void window_refresh_callback(GLFWwindow* window)
+{
+	requestRedraw();
 }
 
 
@@ -84,6 +231,8 @@ void mouse_callback(GLFWwindow* window, double xPos, double yPos)
 	if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS)
 	{
 		camera.processMouseMovement(xPos, yPos, GL_TRUE);
+		lastCameraMotion = glfwGetTime();
+		requestRedraw();
 	}
 
 	camera.setLastX(xPos);
@@ -93,6 +242,8 @@ void mouse_callback(GLFWwindow* window, double xPos, double yPos)
 void scroll_callback(GLFWwindow* window, double xOffset, double yOffset)
 {
 	camera.processMouseScroll(yOffset);
+	lastCameraMotion = glfwGetTime();
+	requestRedraw();
 }
 
 
@@ -154,216 +305,1035 @@ void renderTestRectangle(GLuint VAO, Shader shader)
 }
 
 
+//Releases the evaluation cache of the surface
+void releaseOpenGLObjects(BezierSurface& surf)
+{
+    glDeleteVertexArrays(1, &surf.cacheVAO);
+    glDeleteBuffers(1, &surf.cacheVBO);
+    surf.cacheVAO = surf.cacheVBO = 0;
+    surf.cacheValid = false;
+}
+
+
+/*
+    Uploads the sample mesh every patch is drawn with. The updater already built it and staged
+    the 16 bit indices, so this is only the copy into the buffers.
+*/
+void uploadSampleMesh(const SampleMesh& mesh)
+{
+    if(meshVAO == 0)
+    {
+        glGenVertexArrays(1, &meshVAO);
+        glGenBuffers(1, &meshVBO);
+        glGenBuffers(1, &meshEBO);
+    }
+    //Bind VAO
+    glc::bindVertexArray(meshVAO);
+    //Bind VBO and send the data
+    glc::bindBuffer(GL_ARRAY_BUFFER, meshVBO);
+    glc::bufferData(GL_ARRAY_BUFFER, sizeof(glm::u16vec2) * mesh.uv.size(), mesh.uv.data(), GL_STATIC_DRAW);
+    
+    //Bind EBO and send theindices. 16 bit whenever the vertices can be addressed with them.
+    glc::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshEBO);
+    if(!mesh.shortIndices.empty())
+    {
+        glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * mesh.shortIndices.size(), mesh.shortIndices.data(), GL_STATIC_DRAW);
+        meshIndexType = GL_UNSIGNED_SHORT;
+    }
+    else
+    {
+        glc::bufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * mesh.indices.size(), mesh.indices.data(), GL_STATIC_DRAW);
+        meshIndexType = GL_UNSIGNED_INT;
+    }
+    
+    //Configure vertex attributes
+    //UV, normalized so the shader still reads [0, 1]
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(glm::u16vec2), (void*)0);
+    
+    //Data passign and configuration is done
+    glc::bindVertexArray(0);
+    glc::bindBuffer(GL_ARRAY_BUFFER, 0);
+    glc::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+
+glm::vec3 determineBezierTileOffset(const ControlGrid& grid)
+{
+    return layoutOrigin(grid, coordMultiplier);
+}
+
+/*
+    Places the surfaces of the grid (row by row, one per patch) so that the whole grid is
+    centered around the origin and spans coordMultiplier along its longer side.
+*/
+void layoutBezierSurfaces(const ControlGrid& grid, std::vector<BezierSurface>& surfaces)
+{
+    //Scaling of each bezier surface. This is also equal to the side length of each surface.
+    //Each surface has the same length and uniformly squared. So, each surface is actually
+    //a square
+    float s = layoutPatchSize(grid, coordMultiplier);
+    //The same placement the updater publishes, see layoutTranslations()
+    std::vector<glm::vec3> translations = layoutTranslations(grid, coordMultiplier);
+    for(size_t i = 0; i < surfaces.size() && i < translations.size(); ++i)
+    {
+        surfaces[i].scaling = glm::vec3(s, s, 1.0);
+        surfaces[i].translation = translations[i];
+    }
+    indirectPatchesDirty = true;
+    patchBoxesDirty = true;
+}
+
+//Places the surfaces on screen where the updater laid them out
+void applySceneLayout(const std::shared_ptr<const SceneLayout>& layout)
+{
+    for(size_t i = 0; i < bezierSurfaces.size() && i < layout->translations.size(); ++i)
+    {
+        bezierSurfaces[i].scaling = layout->scaling;
+        bezierSurfaces[i].translation = layout->translations[i];
+    }
+    appliedLayout = layout;
+    indirectPatchesDirty = true;
+    patchBoxesDirty = true;
+}
+
+/*
+    Takes the newest snapshot of the updater and brings the GL side up to it: a new sample mesh
+    is uploaded (the surfaces' evaluations go stale with it) and a new layout of the scene on
+    screen is applied, with the time the updater took. Layouts of a scene still loading are left
+    to updateSceneLoading().
+*/
+void updateSceneSnapshot()
+{
+    snapshot = &sceneUpdater->acquire();
+    bool updated = false;
+    if(snapshot->mesh && snapshot->mesh != uploadedMesh)
+    {
+        uploadSampleMesh(*snapshot->mesh);
+        uploadedMesh = snapshot->mesh;
+        for(BezierSurface& surf : bezierSurfaces)
+        {
+            surf.cacheValid = false;
+        }
+        updated = true;
+    }
+    if(snapshot->layout && snapshot->layout != appliedLayout && snapshot->layout->sceneId == sceneId)
+    {
+        applySceneLayout(snapshot->layout);
+        updated = true;
+    }
+    if(updated)
+    {
+        std::cout << "Scene update: " << sceneUpdater->lastUpdateMs() << " ms on the updater thread" << std::endl;
+        requestRedraw();
+    }
+}
+
+//The grid of the scene on screen changed, its variants are looked up again on their next use
+void resetSceneShaders()
+{
+    sceneShader = sceneCaptureShader = sceneIndirectShader = nullptr;
+}
+
+/*
+    Reads the file and creates the surfaces. Does not touch OpenGL.
+*/
+bool loadScene(const char* fileName)
+{
+    Scene scene;
+    if(!parseScene(fileName, scene))
+    {
+        return false;
+    }
+    lightPositions = std::move(scene.lightPositions);
+    lightIntensities = std::move(scene.lightIntensities);
+    controlGrid = std::move(scene.grid);
+    resetSceneShaders();
+    bezierSurfaces = std::move(scene.surfaces);
+    layoutBezierSurfaces(controlGrid, bezierSurfaces);
+    return true;
+}
+
+/*
+    Returns the shader variant generated for the grid's patch type. Variants are compiled
+    the first time a patch type is drawn.
+*/
+Shader& getBezierShader(const ControlGrid& grid, bool capture = false, bool indirect = false)
+{
+    std::string defines = patchShaderDefines(grid.degreeU, grid.degreeV, isRational(grid));
+    if(indirect)
+    {
+        //Variant that takes the patch from instanced attributes
+        defines += "#define INDIRECT 1\n";
+    }
+    std::vector<std::string> captureVaryings;
+    if(capture)
+    {
+        //Variant that fills the evaluation cache
+        defines += "#define CAPTURE 1\n";
+        captureVaryings = { "capturedPos", "capturedNor" };
+    }
+    auto it = bezierShaders.find(defines);
+    if(it == bezierShaders.end())
+    {
+        it = bezierShaders.emplace(std::piecewise_construct, std::forward_as_tuple(defines),
+                                   std::forward_as_tuple("Shaders/bezier/bezier.vert", "Shaders/bezier/bezier.frag", nullptr, defines, captureVaryings)).first;
+    }
+    return it->second;
+}
+
+//Variant of the scene on screen, from getBezierShader() the first time it is used
+Shader& getSceneShader(bool capture = false, bool indirect = false)
+{
+    Shader*& variant = capture ? sceneCaptureShader : indirect ? sceneIndirectShader : sceneShader;
+    if(variant == nullptr)
+    {
+        variant = &getBezierShader(controlGrid, capture, indirect);
+    }
+    return *variant;
+}
+
+/*
+    Evaluates every sample of the surface once with transform feedback into its cache buffer.
+    The capture variant of the shader has to be in use with the surface's uniforms set.
+*/
+void evaluateIntoCache(BezierSurface& surf)
+{
+    if(surf.cacheVAO == 0)
+    {
+        glGenVertexArrays(1, &surf.cacheVAO);
+        glGenBuffers(1, &surf.cacheVBO);
+    }
+    //Position and normal per sample, in the patch frame so that moving the patch keeps them valid
+    glc::bindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, surf.cacheVBO);
+    glc::bufferData(GL_TRANSFORM_FEEDBACK_BUFFER, 2 * sizeof(glm::vec3) * uploadedMesh->uv.size(), NULL, GL_DYNAMIC_COPY);
+    glc::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, surf.cacheVBO);
+    //Each sample once, as a point
+    glc::bindVertexArray(meshVAO);
+    glBeginTransformFeedback(GL_POINTS);
+    glc::drawArrays(GL_POINTS, 0, (GLsizei)uploadedMesh->uv.size());
+    glEndTransformFeedback();
+    glc::bindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+
+    //Drawing the cache takes the sample mesh's triangles
+    glc::bindVertexArray(surf.cacheVAO);
+    glc::bindBuffer(GL_ARRAY_BUFFER, surf.cacheVBO);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+    glc::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshEBO);
+    glc::bindVertexArray(0);
+    glc::bindBuffer(GL_ARRAY_BUFFER, 0);
+    surf.cacheValid = true;
+}
+
+/*
+    Evaluates up to CACHE_EVALUATIONS_PER_FRAME surfaces whose cache is out of date, the rest
+    follow in the next frames. Surfaces without a valid cache, and all of them until the capture
+    variant is compiled, keep being evaluated while drawing.
+*/
+void updateEvaluationCache()
+{
+    Shader* captureShader = nullptr;
+    int evaluations = 0;
+    cacheBehind = false;
+    for(BezierSurface& surf : bezierSurfaces)
+    {
+        if(surf.cacheValid)
+        {
+            continue;
+        }
+        if(evaluations == CACHE_EVALUATIONS_PER_FRAME)
+        {
+            cacheBehind = true;
+            break;
+        }
+        if(captureShader == nullptr)
+        {
+            captureShader = &getSceneShader(true);
+            if(!captureShader->isReady())
+            {
+                return;
+            }
+            captureShader->use();
+            captureShader->setInt("gridStride", controlGrid.numPx);
+            captureShader->setInt("controlHeights", 0);
+            captureShader->setInt("controlWeights", 1);
+            bindControlGrid(controlGrid);
+            //Nothing is drawn, only the vertex outputs are recorded
+            glc::enable(GL_RASTERIZER_DISCARD);
+        }
+        captureShader->setInt("gridOffset", surf.gridOffset);
+        evaluateIntoCache(surf);
+        ++evaluations;
+    }
+    if(captureShader != nullptr)
+    {
+        glc::disable(GL_RASTERIZER_DISCARD);
+    }
+}
+
+/*
+    Takes a scene the loader finished and uploads its control grid, then waits without blocking
+    for its shader variant and its layout. Once both are ready the current scene is released and
+    replaced in one go; updateEvaluationCache() then fills the new surfaces' caches over the next frames.
+*/
+void updateSceneLoading()
+{
+    //Tell in the title that the surfaces on screen are about to change
+    bool loading = sceneLoader->isLoading() || pendingScene;
+    if(loading != showingLoading)
+    {
+        glfwSetWindowTitle(window, loading ? "OpenGL Window (loading)" : "OpenGL Window");
+        showingLoading = loading;
+    }
+
+    if(!pendingScene)
+    {
+        pendingScene = sceneLoader->takeLoaded();
+        if(pendingScene)
+        {
+            //Upload the grid, start compiling the shader variant and have the scene laid out,
+            //all three run alongside the frames of the current scene. A grid too large to
+            //upload is dropped and the current scene stays.
+            if(!uploadControlGrid(pendingScene->grid))
+            {
+                std::cout << "Failed to load " << pendingScene->fileName << std::endl;
+                pendingScene.reset();
+                return;
+            }
+            getBezierShader(pendingScene->grid);
+            pendingSceneId = ++lastSceneId;
+            sceneUpdater->setScene(pendingScene->grid, pendingSceneId);
+        }
+        return;
+    }
+
+    //Do not block on a variant the driver is still compiling, nor on the updater
+    bool laidOut = snapshot->layout && snapshot->layout->sceneId == pendingSceneId;
+    if(!laidOut || !getBezierShader(pendingScene->grid).isReady())
+    {
+        return;
+    }
+
+    //Everything is uploaded, swap the scenes
+    releaseControlGrid(controlGrid);
+    for(BezierSurface& surf : bezierSurfaces)
+    {
+        releaseOpenGLObjects(surf);
+    }
+    lightPositions = std::move(pendingScene->lightPositions);
+    lightIntensities = std::move(pendingScene->lightIntensities);
+    controlGrid = std::move(pendingScene->grid);
+    resetSceneShaders();
+    bezierSurfaces = std::move(pendingScene->surfaces);
+    sceneId = pendingSceneId;
+    applySceneLayout(snapshot->layout);
+    surfaceAnalysis.reset();
+    requestRedraw();
+    std::cout << "Loaded " << pendingScene->fileName << ": " << bezierSurfaces.size() << " patches" << std::endl;
+    pendingScene.reset();
+}
+
+/*
+    Renders a single bezier surface. Levels above 0 are the coarser meshes of progressive
+    refinement, evaluated in bezier.vert.
+*/
+void renderBezierSurface(BezierSurface& surf, Shader& bezierShader, int i, int level = 0, bool reducedShading = false)
+{
+    //Evaluated surfaces only need the pass-through shader. The analysis colours need the
+    //(u, v) of the samples, which only bezier.vert passes on.
+    bool cached = level == 0 && useEvaluationCache && surf.cacheValid && analysisMode == 0;
+    Shader& shader = cached ? *cachedShader : bezierShader;
+    shader.use();
+    glm::mat4 view = camera.getViewMatrix();
+    glm::mat4 projection = glm::perspective(glm::radians(camera.getFov()), (float)SCR_WIDTH / SCR_HEIGHT, 0.1f, 100.0f);
+    glm::mat4 model = glm::mat4(1.0f);
+    //Transformation order: Scale-Translate-Rotate (rotation should be at the end this time)
+    model = glm::rotate(model, glm::radians(rotationAngle), glm::vec3(1.0, 0.0, 0.0));
+    model = glm::translate(model, surf.translation);
+    model = glm::scale(model, surf.scaling);
+    glm::mat4 PV = projection * view;
+    //Set uniforms
+    //Vertex Shader uniforms
+    shader.setMat4("modelMat", model);
+    shader.setMat4("PV", PV);
+    //Fragment Shader uniforms
+    shader.setVec3("eyePos", camera.getPosition());
+    shader.setInt("numLights", (int)lightPositions.size());
+    shader.setVec3Array("lightPositions", (int)lightPositions.size(), lightPositions[0]);
+    shader.setVec3Array("lightIntensities", (int)lightIntensities.size(), lightIntensities[0]);
+    shader.setInt("reducedShading", reducedShading ? 1 : 0);
+    if(cached)
+    {
+        glc::bindVertexArray(surf.cacheVAO);
+    }
+    else
+    {
+        shader.setInt("gridOffset", surf.gridOffset);
+        shader.setInt("gridStride", controlGrid.numPx);
+        shader.setInt("controlHeights", 0);
+        shader.setInt("controlWeights", 1);
+        bindControlGrid(controlGrid);
+        shader.setInt("colorMode", analysisMode);
+        if(analysisMode != 0)
+        {
+            int patch = patchIndex(controlGrid, surf.gridOffset);
+            int samples = surfaceAnalysis->samples;
+            shader.setInt("analysisValues", 2);
+            shader.setInt("analysisOffset", patch * samples * samples);
+            shader.setInt("analysisSamples", samples);
+            shader.setFloat("analysisRange", analysisMode == 1 ? surfaceAnalysis->gaussianRange : surfaceAnalysis->meanRange);
+            shader.setInt("seamMask", surfaceAnalysis->seamMask[patch]);
+            glc::activeTexture(GL_TEXTURE2);
+            glc::bindTexture(GL_TEXTURE_BUFFER, analysisTexture);
+            glc::activeTexture(GL_TEXTURE0);
+        }
+        if(level > 0)
+        {
+            progressiveRenderer->drawLevel(level);
+            return;
+        }
+        glc::bindVertexArray(meshVAO);
+    }
+    glc::drawElements(GL_TRIANGLES, (GLsizei)uploadedMesh->indices.size(), meshIndexType, 0);
+}
+
+/*
+    Draws every surface through the IndirectRenderer, analysis colours and the evaluation cache
+    are not used on this path
+*/
+void renderIndirect()
+{
+    Shader& shader = getSceneShader(false, true);
+    if(bezierSurfaces.empty() || !shader.isReady())
+    {
+        return;
+    }
+    if(indirectPatchesDirty)
+    {
+        indirectRenderer->setPatches(controlGrid, bezierSurfaces);
+        indirectPatchesDirty = false;
+    }
+    if(indirectSamples != numSamples)
+    {
+        indirectRenderer->setLevels(numSamples);
+        indirectSamples = numSamples;
+    }
+    shader.use();
+    glm::mat4 view = camera.getViewMatrix();
+    glm::mat4 projection = glm::perspective(glm::radians(camera.getFov()), (float)SCR_WIDTH / SCR_HEIGHT, 0.1f, 100.0f);
+    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), glm::radians(rotationAngle), glm::vec3(1.0, 0.0, 0.0));
+    glm::mat4 PV = projection * view;
+    shader.setMat4("PV", PV);
+    shader.setVec3("eyePos", camera.getPosition());
+    shader.setInt("numLights", (int)lightPositions.size());
+    shader.setVec3Array("lightPositions", (int)lightPositions.size(), lightPositions[0]);
+    shader.setVec3Array("lightIntensities", (int)lightIntensities.size(), lightIntensities[0]);
+    shader.setInt("gridStride", controlGrid.numPx);
+    shader.setInt("controlHeights", 0);
+    shader.setInt("controlWeights", 1);
+    shader.setInt("colorMode", 0);
+    bindControlGrid(controlGrid);
+    if(useOcclusion)
+    {
+        indirectRenderer->draw(shader, PV, rotation, camera.getPosition(), camera.getFov(), SCR_HEIGHT, CullPass::EARLY);
+        hiZPyramid->build();
+        indirectRenderer->draw(shader, PV, rotation, camera.getPosition(), camera.getFov(), SCR_HEIGHT, CullPass::LATE,
+                               hiZPyramid.get());
+    }
+    else
+    {
+        indirectRenderer->draw(shader, PV, rotation, camera.getPosition(), camera.getFov(), SCR_HEIGHT);
+    }
+
+    //The counters are read back once a second only, reading them stalls until the GPU catches up
+    double now = glfwGetTime();
+    if(now - lastIndirectReport >= 1.0)
+    {
+        lastIndirectReport = now;
+        IndirectStats stats = indirectRenderer->readStats();
+        std::cout << "GPU culling: " << stats.numVisible << " of " << stats.numPatches << " patches visible";
+        if(useOcclusion)
+        {
+            int inView = stats.numVisible + stats.numOccluded;
+            std::cout << ", " << stats.numOccluded << " occluded (" << (inView > 0 ? 100.0 * stats.numOccluded / inView : 0.0)
+                      << "% of those in view)";
+        }
+        std::cout << ", per level";
+        for(size_t l = 0; l < stats.numPerLevel.size(); ++l)
+        {
+            std::cout << " " << stats.levelSamples[l] << "x" << stats.levelSamples[l] << ":" << stats.numPerLevel[l];
+        }
+        std::cout << std::endl;
+    }
+}
+
+/*
+    Draws the surfaces one by one with occlusion culling tested on the CPU, for contexts without
+    compute shaders. The patches visible in the last frame are drawn first, then the coarse
+    levels of the Hi-Z pyramid of their depth are read back and every patch's bounds are tested
+    against them. The visible patches that were not drawn yet are drawn second.
+*/
+void renderOccluded()
+{
+    Shader& shader = getSceneShader();
+    if(patchBoxesDirty)
+    {
+        //A new layout starts with every patch visible, the test sorts them out in the first frame
+        patchBoxes.resize(bezierSurfaces.size());
+        for(size_t i = 0; i < bezierSurfaces.size(); ++i)
+        {
+            patchBounds(controlGrid, bezierSurfaces[i], patchBoxes[i].first, patchBoxes[i].second);
+        }
+        patchVisible.assign(bezierSurfaces.size(), 1);
+        patchBoxesDirty = false;
+    }
+    for(int i = 0; i < bezierSurfaces.size(); ++i)
+    {
+        if(patchVisible[i])
+        {
+            renderBezierSurface(bezierSurfaces[i], shader, i);
+        }
+    }
+
+    hiZPyramid->build();
+    hiZPyramid->readBack();
+    glm::mat4 view = camera.getViewMatrix();
+    glm::mat4 projection = glm::perspective(glm::radians(camera.getFov()), (float)SCR_WIDTH / SCR_HEIGHT, 0.1f, 100.0f);
+    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), glm::radians(rotationAngle), glm::vec3(1.0, 0.0, 0.0));
+    glm::mat4 sceneToClip = projection * view * rotation;
+    int numOccluded = 0, numInView = 0;
+    for(int i = 0; i < bezierSurfaces.size(); ++i)
+    {
+        Occlusion result = hiZPyramid->test(patchBoxes[i].first, patchBoxes[i].second, sceneToClip);
+        bool visible = result == Occlusion::VISIBLE;
+        if(visible && !patchVisible[i])
+        {
+            renderBezierSurface(bezierSurfaces[i], shader, i);
+        }
+        patchVisible[i] = visible;
+        numInView += result != Occlusion::OUTSIDE ? 1 : 0;
+        numOccluded += result == Occlusion::OCCLUDED ? 1 : 0;
+    }
+
+    //The share of every frame is averaged, the last frame's counts are printed with it once a second
+    ++occlusionFrames;
+    occludedShareSum += numInView > 0 ? (double)numOccluded / numInView : 0.0;
+    double now = glfwGetTime();
+    if(now - lastOcclusionReport >= 1.0)
+    {
+        std::cout << "Occlusion culling: " << numOccluded << " of " << numInView << " patches in view occluded ("
+                  << (numInView > 0 ? 100.0 * numOccluded / numInView : 0.0) << "%), " << 100.0 * occludedShareSum / occlusionFrames
+                  << "% on average over " << occlusionFrames << " frames, " << bezierSurfaces.size() - numInView
+                  << " outside the view" << std::endl;
+        lastOcclusionReport = now;
+        occlusionFrames = 0;
+        occludedShareSum = 0.0;
+    }
+}
+
+/*
+    Draws the step of progressive refinement the renderer picks for this frame and shows the
+    newest complete image. The level and the vertex budget are printed once a second.
+*/
+void renderProgressive()
+{
+    Shader& shader = getSceneShader();
+    if(bezierSurfaces.empty() || !uploadedMesh || !shader.isReady())
+    {
+        return;
+    }
+    if(progressiveSamples != uploadedMesh->samples)
+    {
+        progressiveRenderer->setLevels(uploadedMesh->samples);
+        progressiveSamples = uploadedMesh->samples;
+    }
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    progressiveFrameStart = glfwGetTime();
+    ProgressiveStep step = progressiveRenderer->begin(width, height, (int)bezierSurfaces.size(), isCameraMoving());
+    for(int i = step.firstPatch; i < step.firstPatch + step.numPatches; ++i)
+    {
+        renderBezierSurface(bezierSurfaces[i], shader, i, step.level, step.reducedShading);
+    }
+    progressiveRenderer->present(step);
+
+    double now = glfwGetTime();
+    if(now - lastProgressiveReport >= 1.0)
+    {
+        lastProgressiveReport = now;
+        int shownLevel = progressiveRenderer->getShownLevel();
+        std::cout << "Progressive refinement: ";
+        if(shownLevel >= 0)
+        {
+            int samples = progressiveRenderer->getLevelSamples(shownLevel);
+            std::cout << samples << "x" << samples << " on screen, ";
+        }
+        std::cout << (step.reducedShading ? "moving" : progressiveRenderer->isRefining() ? "refining" : "refined") << ", budget "
+                  << (long long)progressiveRenderer->getVertexBudget() << " vertices per frame" << std::endl;
+    }
+}
+
+/*
+    Prints the GPU time of the surface pass once a second
+*/
+void reportSurfaceTime()
+{
+    double now = glfwGetTime();
+    if(now - lastTimerReport < 1.0 || bezierSurfaces.empty())
+    {
+        return;
+    }
+    lastTimerReport = now;
+    double ms = surfaceTimer->takeAverageMs();
+    if(ms >= 0.0)
+    {
+        std::cout << "Surfaces: " << ms << " ms GPU per frame, "
+                  << (useIndirect ? "GPU culling" : useEvaluationCache ? "evaluation cache on" : "evaluation cache off")
+                  << (useOcclusion ? ", occlusion culling" : "") << (isProgressiveActive() ? ", progressive refinement" : "") << std::endl;
+    }
+}
+
+void reportSurfaceAnalysis(const SurfaceAnalysis& analysis)
+{
+    size_t numPatches = analysis.seamMask.size();
+    std::cout << "Surface analysis: " << numPatches << " patches, " << analysis.samples << "x" << analysis.samples
+              << " samples each, " << analysis.numThreads << " threads, " << analysis.seconds << " s" << std::endl;
+    std::cout << "  95% of |K| below " << analysis.gaussianRange << ", of |H| below " << analysis.meanRange << std::endl;
+    std::cout << "  " << analysis.seams.size() << " seams are not G1" << std::endl;
+    //The worst few, by angle
+    std::vector<SeamFlag> worst = analysis.seams;
+    size_t shown = std::min(worst.size(), (size_t)5);
+    std::partial_sort(worst.begin(), worst.begin() + shown, worst.end(),
+                      [](const SeamFlag& a, const SeamFlag& b){ return a.maxAngle > b.maxAngle; });
+    for(size_t k = 0; k < shown; ++k)
+    {
+        std::cout << "    patches " << worst[k].patchA << " and " << worst[k].patchB << (worst[k].alongU ? " (above/below)" : " (left/right)")
+                  << ": normals differ by up to " << worst[k].maxAngle << " degrees, positions by " << worst[k].maxGap << std::endl;
+    }
+}
+
+/*
+    Analyses the current scene the first time its colours are shown and uploads the values of
+    the current mode
+*/
+void updateSurfaceAnalysis()
+{
+    if(analysisMode == 0 || bezierSurfaces.empty())
+    {
+        return;
+    }
+    if(!surfaceAnalysis)
+    {
+        surfaceAnalysis.reset(new SurfaceAnalysis(analyzeSurface(controlGrid)));
+        reportSurfaceAnalysis(*surfaceAnalysis);
+        uploadedAnalysisMode = 0;
+    }
+    if(uploadedAnalysisMode != analysisMode)
+    {
+        uploadTextureBuffer(analysisBuffer, analysisTexture, analysisMode == 1 ? surfaceAnalysis->gaussian : surfaceAnalysis->mean);
+        uploadedAnalysisMode = analysisMode;
+    }
+}
+
+int runSurfaceAnalysis(const char* sceneFile, int samples, const char* outPrefix)
+{
+    Scene scene;
+    if(!parseScene(sceneFile, scene))
+    {
+        return EXIT_FAILURE;
+    }
+    SurfaceAnalysis analysis = analyzeSurface(scene.grid, samples);
+    reportSurfaceAnalysis(analysis);
+    if(outPrefix != nullptr)
+    {
+        //Raw float32 arrays, layout as in SurfaceAnalysis
+        std::string prefix = outPrefix;
+        std::ofstream gaussian(prefix + "_gaussian.f32", std::ios::binary);
+        gaussian.write((const char*)analysis.gaussian.data(), sizeof(float) * analysis.gaussian.size());
+        std::ofstream mean(prefix + "_mean.f32", std::ios::binary);
+        mean.write((const char*)analysis.mean.data(), sizeof(float) * analysis.mean.size());
+        std::ofstream seams(prefix + "_seams.txt");
+        for(const SeamFlag& seam : analysis.seams)
+        {
+            seams << seam.patchA << " " << seam.patchB << " " << (seam.alongU ? "u" : "v") << " " << seam.maxGap << " " << seam.maxAngle << "\n";
+        }
+        if(!gaussian || !mean || !seams)
+        {
+            std::cout << "Failed to write the analysis to " << prefix << "_*" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
+
+int runSurfaceIntegration(const char* sceneFile, double tolerance, const char* outFile)
+{
+    Scene scene;
+    if(!parseScene(sceneFile, scene))
+    {
+        return EXIT_FAILURE;
+    }
+    SurfaceIntegrals integrals = integrateSurface(scene.grid, tolerance);
+    if(integrals.tolerance != tolerance)
+    {
+        std::cout << "Tolerance " << tolerance << " is below single precision, using " << integrals.tolerance << std::endl;
+    }
+    std::streamsize precision = std::cout.precision(12);
+    std::cout << "Area " << integrals.area << ", volume " << integrals.volume << std::endl;
+    std::cout.precision(precision);
+    std::cout << integrals.patches.size() << " patches, tolerance " << integrals.tolerance << ", " << integrals.numEvaluations
+              << " evaluations, " << integrals.numThreads << " threads, " << integrals.seconds << " s" << std::endl;
+    if(integrals.numUnconverged > 0)
+    {
+        std::cout << integrals.numUnconverged << " patches reached the subdivision limit before the tolerance" << std::endl;
+    }
+    if(outFile != nullptr)
+    {
+        //One line per patch: area, volume, their error estimates and the number of regions
+        std::ofstream out(outFile);
+        out.precision(12);
+        for(const PatchIntegral& patch : integrals.patches)
+        {
+            out << patch.area << " " << patch.volume << " " << patch.areaError << " " << patch.volumeError << " " << patch.numRegions << "\n";
+        }
+        if(!out)
+        {
+            std::cout << "Failed to write " << outFile << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return integrals.numUnconverged == 0 ? 0 : EXIT_FAILURE;
+}
+
+int runHeightmapFit(const char* heightmapFile, const char* sceneFile, int pixelsPerPatch, float heightScale, int rawWidth)
+{
+    Heightmap map;
+    if(!readHeightmap(heightmapFile, map, rawWidth))
+    {
+        return EXIT_FAILURE;
+    }
+    HeightmapFit fit = fitHeightmap(map, pixelsPerPatch, heightScale);
+    std::cout << map.width << " x " << map.height << " heightmap, " << fit.numPatchesX << " x " << fit.numPatchesY
+              << " patches" << std::endl;
+    std::cout << "RMS error " << fit.rmsError << ", max error " << fit.maxError << std::endl;
+    std::cout << fit.iterations << " CG iterations, residual " << fit.residual << ", " << fit.numThreads << " threads, solve "
+              << fit.solveSeconds << " s, total " << fit.seconds << " s" << std::endl;
+    if(!fit.converged)
+    {
+        std::cout << "The solver stopped before reaching the tolerance" << std::endl;
+    }
+
+    //One white light above the surface, the heights are in the units of the default layout
+    Scene scene;
+    scene.lightPositions.push_back(glm::vec3(0.0f, 1.0f, 2.0f));
+    scene.lightIntensities.push_back(glm::vec3(3.0f, 3.0f, 3.0f));
+    scene.grid = std::move(fit.grid);
+    return writeScene(sceneFile, scene) ? 0 : EXIT_FAILURE;
+}
+
+void startCapture()
+{
+    std::filesystem::create_directories("captures");
+    captureName = "captures/capture_" + std::to_string((long long)std::time(nullptr));
+    frameCapture.reset(new FrameCapture(captureName, captureFormat));
+    lastCaptureReport = glfwGetTime();
+    captureFrameSeconds = 0.0;
+    std::cout << "Capturing to " << captureName << std::endl;
+}
+
+void stopCapture()
+{
+    //The raw stream keeps the size of its first frame whatever the window did since
+    int width = frameCapture->getFrameWidth();
+    int height = frameCapture->getFrameHeight();
+    //Waits for every frame in flight to be written
+    frameCapture.reset();
+    std::cout << "Capture stopped, " << captureName << " complete" << std::endl;
+    if(captureFormat == CaptureFormat::RAW && width > 0)
+    {
+        std::cout << "Encode with: ffmpeg -f rawvideo -pix_fmt rgb24 -s " << width << "x" << height
+                  << " -r 60 -i " << captureName << ".rgb " << captureName << ".mp4" << std::endl;
+    }
+}
+
+/*
+    Reads the frame back for the capture and prints its cost once a second: the time the
+    render thread spent on it, absolute and as a share of the frame time
+*/
+void captureFrame()
+{
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    frameCapture->capture(width, height);
+    captureFrameSeconds += deltaTime;
+    double now = glfwGetTime();
+    if(now - lastCaptureReport < 1.0)
+    {
+        return;
+    }
+    lastCaptureReport = now;
+    CaptureStats stats = frameCapture->takeStats();
+    if(stats.framesCaptured > 0 && captureFrameSeconds > 0.0)
+    {
+        std::cout << "Capture: " << stats.framesCaptured << " frames, " << stats.renderThreadMs / stats.framesCaptured
+                  << " ms per frame on the render thread (" << stats.stallMs / stats.framesCaptured << " ms waiting), "
+                  << 100.0 * stats.renderThreadMs / (1000.0 * captureFrameSeconds) << "% of the frame time, "
+                  << stats.framesWritten << " written" << std::endl;
+    }
+    captureFrameSeconds = 0.0;
+}
+
+/*
+    Opens a tiled control grid for paged rendering. The global grid only keeps the dimensions
+    so that the layout code works, the heights live in the tiles.
+*/
+bool initPagedScene(const char* tiledFile, size_t hostBudgetBytes, size_t gpuBudgetBytes)
+{
+    tilePager.reset(new TilePager(tiledFile, hostBudgetBytes, gpuBudgetBytes));
+    if(!tilePager->isOpen())
+    {
+        tilePager.reset();
+        return false;
+    }
+    const TiledGridHeader& header = tilePager->getHeader();
+    controlGrid.numPx = header.numPx;
+    controlGrid.numPy = header.numPy;
+    controlGrid.degreeU = header.degreeU;
+    controlGrid.degreeV = header.degreeV;
+    //The tiles carry the weights, so the variant is taken from their shape
+    ControlGrid tileShape = controlGrid;
+    if(header.rational)
+    {
+        tileShape.weights.assign(1, 1.0f);
+    }
+    resetSceneShaders();
+    sceneShader = &getBezierShader(tileShape);
+    lightPositions = tilePager->getLightPositions();
+    lightIntensities = tilePager->getLightIntensities();
+    return true;
+}
+
 /*
-    Triangulates the surface and sets the (u, v) coordinates required for computations.
+    Asks the pager for the tiles in view and draws the resident ones
 */
-void triangulate(BezierSurface& surf)
-{
-    //Clear uv and triangles as this function can be called multiple times in the program
-    surf.uv.clear();
-    surf.tris.clear();
-    int si; //Sample index (temporary var)
-    float sampleSpacing = numSamples - 1;
-    surf.uv.reserve(numSamples * numSamples);
-    surf.tris.reserve(2 * (numSamples-1) * (numSamples-1));
-    //Create samples and triangulate at the same time
-    for(int i = 0; i < numSamples; ++i)
-    {
-        for(int j = 0; j < numSamples; ++j)
-        {
-            //Create the sample
-            surf.uv.push_back(glm::vec2(j / sampleSpacing, i / sampleSpacing));
-            si = i * numSamples + j;
-            if((i != numSamples - 1) && (j != numSamples - 1))
+void renderPagedScene()
+{
+    glm::mat4 view = camera.getViewMatrix();
+    glm::mat4 projection = glm::perspective(glm::radians(camera.getFov()), (float)SCR_WIDTH / SCR_HEIGHT, 0.1f, 100.0f);
+    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), glm::radians(rotationAngle), glm::vec3(1.0, 0.0, 0.0));
+    glm::mat4 PV = projection * view;
+    //Same layout as layoutBezierSurfaces()
+    float s = layoutPatchSize(controlGrid, coordMultiplier);
+    glm::vec3 offset = determineBezierTileOffset(controlGrid);
+
+    tilePager->request(tilePager->selectTiles(PV * rotation, offset, s));
+    //Spread the uploads over frames so that a burst of finished reads does not stall one frame
+    tilePager->update(4);
+
+    for(const std::unique_ptr<Tile>& tile : tilePager->getResidentTiles())
+    {
+        Shader& shader = getSceneShader();
+        shader.use();
+        shader.setMat4("PV", PV);
+        shader.setVec3("eyePos", camera.getPosition());
+        shader.setInt("numLights", (int)lightPositions.size());
+        shader.setVec3Array("lightPositions", (int)lightPositions.size(), lightPositions[0]);
+        shader.setVec3Array("lightIntensities", (int)lightIntensities.size(), lightIntensities[0]);
+        shader.setInt("gridStride", tile->grid.numPx);
+        shader.setInt("controlHeights", 0);
+        shader.setInt("controlWeights", 1);
+        bindControlGrid(tile->grid);
+        glc::bindVertexArray(meshVAO);
+        for(int a = 0; a < tile->numPatchesI; ++a)
+        {
+            for(int b = 0; b < tile->numPatchesJ; ++b)
             {
-                //Counter-clockwise orientation
-                surf.tris.push_back(glm::ivec3(si, si + numSamples, si+numSamples+1));
-                surf.tris.push_back(glm::ivec3(si, si + numSamples + 1, si + 1));
+                int i = tile->firstPatchI + a;
+                int j = tile->firstPatchJ + b;
+                glm::mat4 model = glm::translate(rotation, offset + glm::vec3(j * s, -i * s, 0.0));
+                model = glm::scale(model, glm::vec3(s, s, 1.0));
+                shader.setMat4("modelMat", model);
+                shader.setInt("gridOffset", patchOffset(tile->grid, a, b));
+                glc::drawElements(GL_TRIANGLES, (GLsizei)uploadedMesh->indices.size(), meshIndexType, 0);
             }
         }
     }
-}
 
+    //Report once a second
+    double now = glfwGetTime();
+    if(now - lastPagerReport >= 1.0)
+    {
+        lastPagerReport = now;
+        TilePagerStats stats = tilePager->getStats();
+        std::cout << "Tiles: " << stats.residentTiles << " resident, " << stats.pendingTiles << " pending, "
+                  << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions, "
+                  << stats.readFailures << " failed reads, " << stats.hostBytes / (1024.0 * 1024.0) << " MB host, " << stats.gpuBytes / (1024.0 * 1024.0) << " MB GPU" << std::endl;
+    }
+}
 
-void createOpenGLObjects(BezierSurface& surf)
+/*
+    Whether frames have to keep coming although nothing was input: scene uploads, evaluation caches
+    and tiles being read or uploaded progress once per frame, captures record every frame, progressive refinement
+    refines until the full mesh is on screen and a shader variant that is still compiling is
+    drawn the moment it is ready.
+*/
+bool needsContinuousFrames()
 {
-    glGenVertexArrays(1, &surf.VAO);
-    glGenBuffers(1, &surf.VBO);
-    glGenBuffers(1, &surf.EBO);
+    if(pendingScene || frameCapture || (tilePager && tilePager->hasPendingTiles()))
+    {
+        return true;
+    }
+    if(cacheBehind && useEvaluationCache && !useIndirect)
+    {
+        return true;
+    }
+    if(bezierSurfaces.empty())
+    {
+        return false;
+    }
+    if(isProgressiveActive() && (isCameraMoving() || progressiveRenderer->isRefining()))
+    {
+        return true;
+    }
+    return !getSceneShader(false, useIndirect).isReady();
 }
 
-
-void setupOpenGLBuffers(BezierSurface& surf)
+/*
+    Sleeps in glfwWaitEventsTimeout until the next event. The loader thread posts an empty event
+    once a scene is read, so the timeout only keeps the reports going.
+*/
+void waitForEvents()
 {
-    //Bind VAO
-    glBindVertexArray(surf.VAO);
-    //Bind VBO and send the data
-    glBindBuffer(GL_ARRAY_BUFFER, surf.VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * surf.uv.size(), surf.uv.data(), GL_STATIC_DRAW);
-    
-    //Bind EBO and send theindices
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, surf.EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(glm::ivec3) * surf.tris.size(), surf.tris.data(), GL_STATIC_DRAW);
-    
-    //Configure vertex attributes
-    //UV
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
-    
-    //Data passign and configuration is done
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    const double IDLE_TIMEOUT_SECONDS = 1.0;
+    glfwWaitEventsTimeout(IDLE_TIMEOUT_SECONDS);
+    ++idleWakeups;
 }
 
-
-glm::vec3 determineBezierTileOffset()
+/*
+    Prints, every 5 seconds of on demand rendering, the frames drawn, the CPU time the process
+    used (all threads, as a share of one core) and the time from an input to its frame
+*/
+void reportOnDemand()
 {
-    int numBezierX = numPx / 4;
-    int numBezierY = numPy / 4;
-    float s = coordMultiplier / std::max(numBezierY, numBezierX);
-    glm::vec3 offset;
-    if(numBezierX == numBezierY) //If the whole surface is square
+    double now = glfwGetTime();
+    double elapsed = now - lastIdleReport;
+    if(elapsed < 5.0)
     {
-        offset = glm::vec3(0.5 * s - coordMultiplier / 2, coordMultiplier / 2 - 0.5 * s, 0.0);
+        return;
     }
-    else //Non-square
+    std::clock_t cpu = std::clock();
+    double cpuShare = double(cpu - lastIdleCpu) / CLOCKS_PER_SEC / elapsed;
+    std::cout << "On demand: " << idleFramesDrawn << " frames and " << idleWakeups << " wakeups in " << elapsed
+              << " s, CPU " << 100.0 * cpuShare << "% of a core";
+    if(latencyCount > 0)
     {
-        if(numBezierX > numBezierY) //X dominated case
-        {
-            offset = glm::vec3(0.5 * s - coordMultiplier / 2, -coordMultiplier / 2 + s * numBezierY - 0.5 * s, 0.0);
-        }
-        else //Y dominated case
-        {
-            offset = glm::vec3(0.5 * s - coordMultiplier / 2, coordMultiplier / 2 - 0.5 * s, 0.0);
-        }
+        std::cout << ", input to frame " << 1000.0 * latencySum / latencyCount << " ms average, "
+                  << 1000.0 * latencyMax << " ms worst";
     }
-    
-    return offset;
+    std::cout << std::endl;
+    lastIdleReport = now;
+    lastIdleCpu = cpu;
+    idleFramesDrawn = 0;
+    idleWakeups = 0;
+    latencyCount = 0;
+    latencySum = 0.0;
+    latencyMax = 0.0;
 }
 
-void createBezierSurfaces()
+/*
+    Ends the GL accounting of a drawn frame: dumps its counters and checks them against the
+    budget. Frames over budget are reported once a second.
+*/
+void endGlFrame()
 {
-    //Each 4x4 subblock represents a Bezier Surface iterate through and create the Surfaces
-    float spacing = 1.0 / 3.0; //Spacing between the CP's in XY plane.
-    //Number of Bezier surfaces along each axis
-    int numBezierX = numPx / 4;
-    int numBezierY = numPy / 4;
-    //Scaling of each bezier surface. This is also equal to the side length of each surface.
-    //Each surface has the same length and uniformly squared. So, each surface is actually
-    //a square
-    float s = coordMultiplier / std::max(numBezierY, numBezierX);
-    glm::vec3 offset = determineBezierTileOffset(); //Offset to map the first surface to the top left.
-    bezierSurfaces.reserve(numBezierX * numBezierY);
-    for(int i = 0; i < numBezierY; ++i)
-    {
-        for(int j = 0; j < numBezierX; ++j)
-        {
-            BezierSurface surf;
-            //Read 16 CP's and determine XY coordinates by partitioning the surface uniformly
-            //Global indices
-            int I = 4*i;
-            int J = 4*j;
-            int k = 0;
-            for(int v = 0; v < 4; ++v)
-            {
-                for(int u = 0; u < 4; ++u)
-                {
-                    float z = CP[I + v][J + u];
-                    //Uniformly lay out the Control Points. Also, centralize them around origin.
-                    surf.P[k] = glm::vec3(u * spacing - 0.5, 0.5 - v * spacing, z);
-                    ++k;
-                }
-            }
-            
-            //Set the scaling
-            surf.scaling = glm::vec3(s, s, 1.0);
-            //Set the translation to send the current bezier surface to the correct place
-            surf.translation = offset + glm::vec3(j * s, -i * s, 0.0);
-            bezierSurfaces.push_back(surf);
-        }
+    GlFrameStats stats = glc::takeFrameStats();
+    ++glFrameNumber;
+    if(glStatsFile.is_open())
+    {
+        glStatsFile << glFrameNumber << " " << stats.drawCalls << " " << stats.stateChanges << " " << stats.uniformUploads
+                    << " " << stats.bytesUploaded << " " << stats.bufferAllocations << "\n";
+    }
+    std::string violations;
+    if(!checkGlBudget(stats, glBudget, violations))
+    {
+        ++framesOverBudget;
+        lastBudgetViolation = violations;
+    }
+    double now = glfwGetTime();
+    if(framesOverBudget > 0 && now - lastBudgetReport >= 1.0)
+    {
+        std::cout << "GL budget: " << framesOverBudget << " frames over it, the last with " << lastBudgetViolation << std::endl;
+        framesOverBudget = 0;
+        lastBudgetReport = now;
     }
 }
 
 /*
-    Reads the file and initializes the data structs needed
+    Switches GPU driven drawing on or off. It needs GL 4.3, on older contexts it stays off.
 */
-void initScene(const char* fileName)
+void toggleIndirect()
 {
-    std::ifstream fileStream(fileName);
-    //Number of point lights
-    int numPointLights;
-    fileStream >> numPointLights;
-    //Initialize the points lights
-    lightPositions.resize(numPointLights);
-    lightIntensities.resize(numPointLights);
-    for(int i = 0; i < numPointLights; ++i)
+    if(!useIndirect && !IndirectRenderer::isSupported())
     {
-        fileStream >> lightPositions[i].x;
-        fileStream >> lightPositions[i].y;
-        fileStream >> lightPositions[i].z;
-        fileStream >> lightIntensities[i].x;
-        fileStream >> lightIntensities[i].y;
-        fileStream >> lightIntensities[i].z;
+        std::cout << "GPU culling needs OpenGL 4.3 (compute shaders and multi draw indirect)" << std::endl;
+        return;
     }
-    //Number of CP's
-    fileStream >> numPy >> numPx;
-    //Now read the Control Points
-    CP.resize(numPy);
-    for(int i = 0; i < numPy; ++i)
+    useIndirect = !useIndirect;
+    if(useIndirect && !indirectRenderer)
     {
-        CP[i].resize(numPx);
-        for(int j = 0; j < numPx; ++j)
-        {
-            fileStream >> CP[i][j];
-        }
+        indirectRenderer.reset(new IndirectRenderer());
+        indirectPatchesDirty = true;
+        indirectSamples = 0;
     }
-    
-    createBezierSurfaces();
-    
-    //Triangulate surfaces and setup their OpenGL data
-    for(int i = 0; i < bezierSurfaces.size(); ++i)
+    std::cout << "GPU culling " << (useIndirect ? "on" : "off") << std::endl;
+}
+
+/*
+    Switches occlusion culling on or off. It draws into the pyramid's framebuffer while it is on.
+*/
+void toggleOcclusion()
+{
+    useOcclusion = !useOcclusion;
+    if(useOcclusion && !hiZPyramid)
     {
-        triangulate(bezierSurfaces[i]);
-        createOpenGLObjects(bezierSurfaces[i]);
-        setupOpenGLBuffers(bezierSurfaces[i]);
+        hiZPyramid.reset(new HiZPyramid());
     }
-    
+    patchBoxesDirty = true;
+    lastOcclusionReport = glfwGetTime();
+    occlusionFrames = 0;
+    occludedShareSum = 0.0;
+    std::cout << "Occlusion culling " << (useOcclusion ? "on" : "off") << std::endl;
 }
 
 /*
-    Renders a single bezier surface
+    Switches progressive refinement on or off. It draws into the renderer's framebuffers while it is on.
 */
-void renderBezierSurface(BezierSurface& surf, Shader& shader, int i)
+void toggleProgressive()
 {
-    shader.use();
-    glm::mat4 view = camera.getViewMatrix();
-    glm::mat4 projection = glm::perspective(glm::radians(camera.getFov()), (float)SCR_WIDTH / SCR_HEIGHT, 0.1f, 100.0f);
-    glm::mat4 model = glm::mat4(1.0f);
-    //Transformation order: Scale-Translate-Rotate (rotation should be at the end this time)
-    model = glm::rotate(model, glm::radians(rotationAngle), glm::vec3(1.0, 0.0, 0.0));
-    model = glm::translate(model, surf.translation);
-    model = glm::scale(model, surf.scaling);
-    glm::mat4 PV = projection * view;
-    //Set uniforms
-    //Vertex Shader uniforms
-    shader.setMat4("modelMat", model);
-    shader.setMat4("PV", PV);
-    shader.setVec3Array("P", 16, surf.P[0]);
-    //glUniform3fv(glGetUniformLocation(shader.getID(), "P"), 16, glm::value_ptr(surf.P[0]));
-    //Fragment Shader uniforms
-    shader.setVec3("eyePos", camera.getPosition());
-    shader.setInt("numLights", (int)lightPositions.size());
-    shader.setVec3Array("lightPositions", (int)lightPositions.size(), lightPositions[0]);
-    shader.setVec3Array("lightIntensities", (int)lightIntensities.size(), lightIntensities[0]);
-    glBindVertexArray(surf.VAO);
-    //total 6 indices since we have triangles
-    glDrawElements(GL_TRIANGLES, 3 * surf.tris.size(), GL_UNSIGNED_INT, 0);
+    useProgressive = !useProgressive;
+    if(useProgressive && !progressiveRenderer)
+    {
+        progressiveRenderer.reset(new ProgressiveRenderer(progressiveBudgetMs));
+        progressiveSamples = 0;
+    }
+    lastProgressiveReport = glfwGetTime();
+    std::cout << "Progressive refinement " << (useProgressive ? "on" : "off");
+    if(useProgressive && (useIndirect || useOcclusion))
+    {
+        std::cout << ", waiting for GPU culling and occlusion culling to be switched off";
+    }
+    std::cout << std::endl;
 }
 
 //Keyboard callback
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    //Every key changes the view, the scene or the mode
+    requestRedraw();
+
     //If pressed glfwGetKey return GLFW_PRESS, if not it returns GLFW_RELEASE
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
     {
@@ -374,22 +1344,15 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
     {
         numSamples = std::min(numSamples+2, 80);
-        //Changing numSamples changes the triangulation and thus the OpenGL Buffers.
-        for(int i = 0; i < bezierSurfaces.size(); ++i)
-        {
-            triangulate(bezierSurfaces[i]);
-            setupOpenGLBuffers(bezierSurfaces[i]);
-        }
+        //Changing numSamples changes the triangulation, the updater rebuilds it and the
+        //frames keep the old one until it is published
+        sceneUpdater->setSamples(numSamples);
         
     }
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
     {
         numSamples = std::max(numSamples-2, 2);
-        for(int i = 0; i < bezierSurfaces.size(); ++i)
-        {
-            triangulate(bezierSurfaces[i]);
-            setupOpenGLBuffers(bezierSurfaces[i]);
-        }
+        sceneUpdater->setSamples(numSamples);
     }
     
     //Size controller
@@ -397,51 +1360,72 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     {
         coordMultiplier += 0.1;
         //Update the offset and the scale
-        int numBezierX = numPx / 4;
-        int numBezierY = numPy / 4;
-        //Scaling of each bezier surface. This is also equal to the side length of each surface.
-        //Each surface has the same length and uniformly squared. So, each surface is actually
-        //a square
-        float s = coordMultiplier / std::max(numBezierY, numBezierX);
-        glm::vec3 offset = determineBezierTileOffset();
-        for(int i = 0; i < numBezierY; ++i)
-        {
-            for(int j = 0; j < numBezierX; ++j)
-            {
-                BezierSurface& surf = bezierSurfaces[i * numBezierY + j];
-                //Set the scaling
-                surf.scaling = glm::vec3(s, s, 1.0);
-                //Set the translation to send the current bezier surface to the correct place
-                surf.translation = offset + glm::vec3(j * s, -i * s, 0.0);
-            }
-        }
+        sceneUpdater->setCoordMultiplier(coordMultiplier);
         
     }
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
     {
         coordMultiplier = std::max(coordMultiplier - 0.1, 0.1);
         //Update the offset and the scale
-        int numBezierX = numPx / 4;
-        int numBezierY = numPy / 4;
-        //Scaling of each bezier surface. This is also equal to the side length of each surface.
-        //Each surface has the same length and uniformly squared. So, each surface is actually
-        //a square
-        float s = coordMultiplier / std::max(numBezierY, numBezierX);
-        glm::vec3 offset = determineBezierTileOffset();
-        for(int i = 0; i < numBezierY; ++i)
-        {
-            for(int j = 0; j < numBezierX; ++j)
-            {
-                BezierSurface& surf = bezierSurfaces[i * numBezierY + j];
-                //Set the scaling
-                surf.scaling = glm::vec3(s, s, 1.0);
-                //Set the translation to send the current bezier surface to the correct place
-                surf.translation = offset + glm::vec3(j * s, -i * s, 0.0);
-            }
-        }
+        sceneUpdater->setCoordMultiplier(coordMultiplier);
     }
     
     
+    //Evaluation cache switch, to compare the GPU time of both paths
+    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS)
+    {
+        useEvaluationCache = !useEvaluationCache;
+        std::cout << "Evaluation cache " << (useEvaluationCache ? "on" : "off") << std::endl;
+    }
+
+    //On demand rendering switch
+    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
+    {
+        onDemandRendering = !onDemandRendering;
+        lastIdleReport = glfwGetTime();
+        lastIdleCpu = std::clock();
+        std::cout << "On demand rendering " << (onDemandRendering ? "on" : "off") << std::endl;
+    }
+
+    //GPU driven drawing switch
+    if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS && !tilePager)
+    {
+        toggleIndirect();
+    }
+
+    //Occlusion culling switch
+    if (glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS && !tilePager)
+    {
+        toggleOcclusion();
+    }
+
+    //Progressive refinement switch
+    if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS && !tilePager)
+    {
+        toggleProgressive();
+    }
+
+    //Surface analysis colours, not for paged scenes whose heights stay on disk
+    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS && !tilePager)
+    {
+        const char* modeNames[3] = { "off", "Gaussian curvature", "mean curvature" };
+        analysisMode = (analysisMode + 1) % 3;
+        std::cout << "Surface analysis colours: " << modeNames[analysisMode] << std::endl;
+    }
+
+    //Capture switch
+    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS)
+    {
+        if(frameCapture)
+        {
+            stopCapture();
+        }
+        else
+        {
+            startCapture();
+        }
+    }
+
     //Rotation Controller
     if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS)
     {
@@ -467,22 +1451,14 @@ void processInput(GLFWwindow* window)
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
     {
         numSamples = std::min(numSamples+2, 80);
-        //Changing numSamples changes the triangulation and thus the OpenGL Buffers.
-        for(int i = 0; i < bezierSurfaces.size(); ++i)
-        {
-            triangulate(bezierSurfaces[i]);
-            setupOpenGLBuffers(bezierSurfaces[i]);
-        }
+        //Changing numSamples changes the triangulation, the updater rebuilds it
+        sceneUpdater->setSamples(numSamples);
         
     }
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
     {
         numSamples = std::max(numSamples-2, 2);
-        for(int i = 0; i < bezierSurfaces.size(); ++i)
-        {
-            triangulate(bezierSurfaces[i]);
-            setupOpenGLBuffers(bezierSurfaces[i]);
-        }
+        sceneUpdater->setSamples(numSamples);
     }
     
     //Size controller
@@ -490,48 +1466,14 @@ void processInput(GLFWwindow* window)
     {
         coordMultiplier += 0.1;
         //Update the offset and the scale
-        int numBezierX = numPx / 4;
-        int numBezierY = numPy / 4;
-        //Scaling of each bezier surface. This is also equal to the side length of each surface.
-        //Each surface has the same length and uniformly squared. So, each surface is actually
-        //a square
-        float s = coordMultiplier / std::max(numBezierY, numBezierX);
-        glm::vec3 offset = determineBezierTileOffset();
-        for(int i = 0; i < numBezierY; ++i)
-        {
-            for(int j = 0; j < numBezierX; ++j)
-            {
-                BezierSurface& surf = bezierSurfaces[i * numBezierY + j];
-                //Set the scaling
-                surf.scaling = glm::vec3(s, s, 1.0);
-                //Set the translation to send the current bezier surface to the correct place
-                surf.translation = offset + glm::vec3(j * s, -i * s, 0.0);
-            }
-        }
+        sceneUpdater->setCoordMultiplier(coordMultiplier);
         
     }
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
     {
         coordMultiplier = std::max(coordMultiplier - 0.1, 0.1);
         //Update the offset and the scale
-        int numBezierX = numPx / 4;
-        int numBezierY = numPy / 4;
-        //Scaling of each bezier surface. This is also equal to the side length of each surface.
-        //Each surface has the same length and uniformly squared. So, each surface is actually
-        //a square
-        float s = coordMultiplier / std::max(numBezierY, numBezierX);
-        glm::vec3 offset = determineBezierTileOffset();
-        for(int i = 0; i < numBezierY; ++i)
-        {
-            for(int j = 0; j < numBezierX; ++j)
-            {
-                BezierSurface& surf = bezierSurfaces[i * numBezierY + j];
-                //Set the scaling
-                surf.scaling = glm::vec3(s, s, 1.0);
-                //Set the translation to send the current bezier surface to the correct place
-                surf.translation = offset + glm::vec3(j * s, -i * s, 0.0);
-            }
-        }
+        sceneUpdater->setCoordMultiplier(coordMultiplier);
     }
     
     
@@ -576,6 +1518,11 @@ int setupDependencies()
         std::cout << "Failed to initialize GLEW" << std::endl;
         return EXIT_FAILURE;
     }
+
+    //Linked programs are kept between runs, so only the first run of a build pays for compiling
+    std::error_code error;
+    std::filesystem::create_directories("shader_cache", error);
+    Shader::setupCompilation(error ? "" : "shader_cache");
     
     //Specify the actual window rectangle for renderings.
     glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
@@ -585,6 +1532,7 @@ int setupDependencies()
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
     //GLFW will capture the mouse and will hide the cursor
     //glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -596,14 +1544,197 @@ int setupDependencies()
 
 
 
-int main()
+/*
+    Headless closest point mode: projects every point of pointsFile onto the scene and writes
+    "patchId u v distance nx ny nz" per point to outFile (if given). Points are whitespace
+    separated "x y z" triples in the scene frame.
+*/
+int runClosestPointQuery(const char* sceneFile, const char* pointsFile, const char* outFile)
+{
+    if(!loadScene(sceneFile))
+    {
+        return EXIT_FAILURE;
+    }
+    std::ifstream pointStream(pointsFile);
+    if(!pointStream)
+    {
+        std::cout << "Failed to open the points file " << pointsFile << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::vector<glm::vec3> points;
+    glm::vec3 p;
+    while(pointStream >> p.x >> p.y >> p.z)
+    {
+        points.push_back(p);
+    }
+
+    ClosestPointQuery closestPointQuery(controlGrid, bezierSurfaces);
+    std::vector<ClosestPointResult> results;
+    ClosestPointStats stats = closestPointQuery.query(points, results);
+    std::cout << "Closest point query: " << stats.numPoints << " points, " << bezierSurfaces.size() << " patches, "
+              << stats.numThreads << " threads, " << stats.numNewtonSolves << " Newton solves, "
+              << stats.seconds << " s, " << stats.pointsPerSecond << " points/s" << std::endl;
+
+    if(outFile != nullptr)
+    {
+        std::ofstream out(outFile);
+        for(const ClosestPointResult& r : results)
+        {
+            out << r.patchId << " " << r.uv.x << " " << r.uv.y << " " << r.distance << " "
+                << r.normal.x << " " << r.normal.y << " " << r.normal.z << "\n";
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char** argv)
 {
+    std::string mode = argc >= 2 ? argv[1] : "";
+    if(argc >= 4 && mode == "--closest")
+    {
+        return runClosestPointQuery(argv[2], argv[3], argc >= 5 ? argv[4] : nullptr);
+    }
+    if(mode == "--mesh-stats")
+    {
+        //Vertex cache figures of every sample count the W and S keys can reach
+        std::vector<glm::u16vec2> uv;
+        std::vector<uint32_t> indices;
+        for(int samples = 2; samples <= 80; samples += 2)
+        {
+            buildSampleMesh(samples, uv, indices, true);
+        }
+        return 0;
+    }
+    if(argc >= 3 && (mode == "--batch" || mode == "--batch-cpu"))
+    {
+        return runRenderFarm(argv[2], argc >= 4 ? std::atoi(argv[3]) : 0, mode == "--batch-cpu");
+    }
+    if(argc >= 4 && mode == "--compare")
+    {
+        return compareImages(argv[2], argv[3], argc >= 5 ? std::atoi(argv[4]) : 8);
+    }
+    if(argc >= 3 && mode == "--analyze")
+    {
+        return runSurfaceAnalysis(argv[2], argc >= 4 ? std::atoi(argv[3]) : 16, argc >= 5 ? argv[4] : nullptr);
+    }
+    if(argc >= 3 && mode == "--integrate")
+    {
+        return runSurfaceIntegration(argv[2], argc >= 4 ? std::atof(argv[3]) : 1e-6, argc >= 5 ? argv[4] : nullptr);
+    }
+    if(argc >= 4 && mode == "--fit")
+    {
+        return runHeightmapFit(argv[2], argv[3], argc >= 5 ? std::atoi(argv[4]) : 16, argc >= 6 ? (float)std::atof(argv[5]) : 1.0f,
+                               argc >= 7 ? std::atoi(argv[6]) : 0);
+    }
+    if(argc >= 4 && mode == "--make-tiles")
+    {
+        return writeTiledControlGrid(argv[2], argv[3], argc >= 5 ? std::atoi(argv[4]) : 8) ? 0 : EXIT_FAILURE;
+    }
+
+    //--capture <ppm|png|raw> picks the capture format and starts capturing right away,
+    //--gpu-cull starts with GPU driven drawing, --on-demand with on demand rendering, --occlusion
+    //with occlusion culling, --progressive [budget ms] with progressive refinement
+    bool captureAtStart = false;
+    bool indirectAtStart = false;
+    bool occlusionAtStart = false;
+    bool progressiveAtStart = false;
+    for(int a = 1; a < argc; ++a)
+    {
+        if(std::string(argv[a]) == "--gpu-cull")
+        {
+            indirectAtStart = true;
+        }
+        if(std::string(argv[a]) == "--on-demand")
+        {
+            onDemandRendering = true;
+        }
+        if(std::string(argv[a]) == "--occlusion")
+        {
+            occlusionAtStart = true;
+        }
+        if(std::string(argv[a]) == "--progressive")
+        {
+            progressiveAtStart = true;
+            if(a + 1 < argc && std::atof(argv[a + 1]) > 0.0)
+            {
+                progressiveBudgetMs = std::atof(argv[a + 1]);
+            }
+        }
+        if(a + 1 >= argc)
+        {
+            continue;
+        }
+        if(std::string(argv[a]) == "--gl-budget" && !parseGlBudget(argv[a + 1], glBudget))
+        {
+            return EXIT_FAILURE;
+        }
+        if(std::string(argv[a]) == "--gl-stats")
+        {
+            glStatsFile.open(argv[a + 1]);
+            glStatsFile << "frame draws state uniforms bytes allocs\n";
+        }
+        if(std::string(argv[a]) == "--capture")
+        {
+            if(!parseCaptureFormat(argv[a + 1], captureFormat))
+            {
+                std::cout << "Unknown capture format " << argv[a + 1] << ", use ppm, png or raw" << std::endl;
+                return EXIT_FAILURE;
+            }
+            captureAtStart = true;
+        }
+    }
+
 	setupDependencies();
-	Shader shader("Shaders/bezier/bezier.vert",
-                  "Shaders/bezier/bezier.frag");
+    if(!isGlAccountingEnabled() && (hasGlBudget(glBudget) || glStatsFile.is_open()))
+    {
+        std::cout << "Built without GL_ACCOUNTING, GL calls are not counted" << std::endl;
+    }
+    cachedShader.reset(new Shader("Shaders/bezier/cached.vert", "Shaders/bezier/bezier.frag"));
+    surfaceTimer.reset(new GpuTimer());
+    //A published snapshot wakes the loop when it sleeps in on demand mode
+    sceneUpdater.reset(new SceneUpdater(numSamples, coordMultiplier, []() { glfwPostEmptyEvent(); }));
 
 
-    initScene("input2.txt");
+    if(argc >= 3 && mode == "--paged")
+    {
+        //Budgets are given in megabytes
+        size_t hostBudget = (argc >= 4 ? std::atoi(argv[3]) : 512) * size_t(1024 * 1024);
+        size_t gpuBudget = (argc >= 5 ? std::atoi(argv[4]) : 256) * size_t(1024 * 1024);
+        if(!initPagedScene(argv[2], hostBudget, gpuBudget))
+        {
+            glfwTerminate();
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        //The scene file can be given as the first argument
+        //A finished scene wakes the loop like a published snapshot, reloads come in unasked
+        sceneLoader.reset(new SceneLoader([]() { glfwPostEmptyEvent(); }));
+        sceneLoader->load(argc >= 2 && argv[1][0] != '-' ? argv[1] : "input2.txt");
+        //Most scenes are bicubic, get that variant compiling while the file is read
+        getBezierShader(ControlGrid());
+    }
+    if(captureAtStart)
+    {
+        startCapture();
+    }
+    if(indirectAtStart && !tilePager)
+    {
+        toggleIndirect();
+    }
+    if(occlusionAtStart && !tilePager)
+    {
+        toggleOcclusion();
+    }
+    if(progressiveAtStart && !tilePager)
+    {
+        toggleProgressive();
+    }
+    lastIdleReport = glfwGetTime();
+    lastIdleCpu = std::clock();
+    dirtySince = lastIdleReport;
 	// render loop
 	// -----------
 	while (!glfwWindowShouldClose(window))
@@ -613,23 +1744,119 @@ int main()
 		// input
 		//processInput(window);
 
+        updateSceneSnapshot();
+        if(sceneLoader)
+        {
+            updateSceneLoading();
+        }
+        if(onDemandRendering)
+        {
+            reportOnDemand();
+            //Nothing changed, the frame on screen is still right
+            if(!frameDirty && !needsContinuousFrames())
+            {
+                waitForEvents();
+                continue;
+            }
+        }
+
 		// render
 		// ------
+        if(useOcclusion)
+        {
+            int framebufferWidth, framebufferHeight;
+            glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+            hiZPyramid->begin(framebufferWidth, framebufferHeight);
+        }
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        
-        for(int i = 0; i < bezierSurfaces.size(); ++i)
+
+        //Scenes are only swapped in after the first mesh is up, tiles have to wait for it
+        if(tilePager && uploadedMesh)
         {
-            renderBezierSurface(bezierSurfaces[i], shader, i);
+            renderPagedScene();
+        }
+        if(useEvaluationCache && !useIndirect)
+        {
+            updateEvaluationCache();
+        }
+        updateSurfaceAnalysis();
+        surfaceTimer->begin();
+        if(useIndirect)
+        {
+            renderIndirect();
+        }
+        else if(useOcclusion)
+        {
+            renderOccluded();
+        }
+        else if(isProgressiveActive())
+        {
+            renderProgressive();
+        }
+        else
+        {
+            Shader& shader = getSceneShader();
+            for(int i = 0; i < bezierSurfaces.size(); ++i)
+            {
+                renderBezierSurface(bezierSurfaces[i], shader, i);
+            }
+        }
+        surfaceTimer->end();
+        if(useOcclusion)
+        {
+            hiZPyramid->present();
+        }
+        reportSurfaceTime();
+        //Reads the back buffer, so before the swap
+        if(frameCapture)
+        {
+            captureFrame();
         }
         
 		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
 		// -------------------------------------------------------------------------------
 		glfwSwapBuffers(window);
+		//The swap waits for the GPU once it is frames behind, so this is the frame's cost
+		if(isProgressiveActive())
+		{
+			progressiveRenderer->frameTime(glfwGetTime() - progressiveFrameStart);
+		}
+		if(onDemandRendering)
+		{
+			if(frameDirty)
+			{
+				double latency = glfwGetTime() - dirtySince;
+				latencySum += latency;
+				latencyMax = std::max(latencyMax, latency);
+				++latencyCount;
+			}
+			++idleFramesDrawn;
+		}
+		frameDirty = false;
+		endGlFrame();
 		glfwPollEvents();
 	}
 
 
+	//The pager owns GL objects, release them while the context is alive
+	if(frameCapture)
+	{
+		stopCapture();
+	}
+	tilePager.reset();
+	sceneLoader.reset();
+	glDeleteTextures(1, &analysisTexture);
+	glDeleteBuffers(1, &analysisBuffer);
+	surfaceTimer.reset();
+	indirectRenderer.reset();
+	hiZPyramid.reset();
+	progressiveRenderer.reset();
+	sceneUpdater.reset();
+	glDeleteVertexArrays(1, &meshVAO);
+	glDeleteBuffers(1, &meshVBO);
+	glDeleteBuffers(1, &meshEBO);
+
 	// glfw: terminate, clearing all previously allocated GLFW resources.
 	// ------------------------------------------------------------------
 	glfwTerminate();